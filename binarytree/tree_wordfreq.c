@@ -33,7 +33,9 @@
 /*
  * tree_wordfreq.c -- construct a frequency count from a text file
  *
- * Usage: tree_wordfreq [-FMd] path files...
+ * Usage: tree_wordfreq [-FMSd] path files...
+ *
+ * With -S, libpmem statistics for each call site are printed at the end.
  */
 
 #include <stdio.h>
@@ -52,7 +54,7 @@
 #define	DEFAULT_POOL_SIZE (10 * 1024 * 1024)
 #define MAXWORD 8192
 
-char Usage[] = "[-FMd] path files...";	/* for USAGE() */
+char Usage[] = "[-FMSd] path files...";	/* for USAGE() */
 
 /*
  * tree_insert_words -- insert all words from a file into the tree
@@ -109,9 +111,10 @@ main(int argc, char *argv[])
 	int opt;
 	const char *path;
 	int i;
+	int sflag = 0;
 
 	Myname = argv[0];
-	while ((opt = getopt(argc, argv, "FMd")) != -1) {
+	while ((opt = getopt(argc, argv, "FMSd")) != -1) {
 		switch (opt) {
 		case 'F':
 			pmem_fit_mode();
@@ -121,6 +124,11 @@ main(int argc, char *argv[])
 			pmem_msync_mode();
 			break;
 
+		case 'S':
+			sflag++;
+			pmem_stats_enable(1);
+			break;
+
 		case 'd':
 			Debug++;
 			break;
@@ -142,5 +150,8 @@ main(int argc, char *argv[])
 	for (i = optind; i < argc; i++)
 		tree_insert_words(argv[i]);
 
+	if (sflag)
+		pmem_stats_dump(stdout);
+
 	exit(0);
 }
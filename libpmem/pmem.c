@@ -35,36 +35,223 @@
  */
 
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdint.h>
 
 #include "pmem.h"
+#include "pmem_internal.h"
 
 /* dispatch tables for the various versions of libpmem */
-void *pmem_map_cl(int fd, size_t len);
+void *pmem_map_cl(int fd, size_t len, int flags, int *oflagsp);
 void pmem_persist_cl(void *addr, size_t len, int flags);
+void pmem_persist_iov_cl(const struct iovec *iov, int iovcnt, int flags);
 void pmem_flush_cache_cl(void *addr, size_t len, int flags);
 void pmem_drain_pm_stores_cl(void);
-void *pmem_map_msync(int fd, size_t len);
+void *pmem_memmove_persist_cl(void *pmemdest, const void *src, size_t len);
+void *pmem_memset_persist_cl(void *pmemdest, int c, size_t len);
+int pmem_remap_cl(struct pmem_mapping *mp, size_t newlen);
+void *pmem_map_msync(int fd, size_t len, int flags, int *oflagsp);
 void pmem_persist_msync(void *addr, size_t len, int flags);
+void pmem_persist_iov_msync(const struct iovec *iov, int iovcnt, int flags);
 void pmem_flush_cache_msync(void *addr, size_t len, int flags);
 void pmem_drain_pm_stores_msync(void);
-void *pmem_map_fit(int fd, size_t len);
+void *pmem_memmove_persist_msync(void *pmemdest, const void *src, size_t len);
+void *pmem_memset_persist_msync(void *pmemdest, int c, size_t len);
+void pmem_unmap_msync(struct pmem_mapping *mp);
+int pmem_remap_msync(struct pmem_mapping *mp, size_t newlen);
+void *pmem_map_fit(int fd, size_t len, int flags, int *oflagsp);
 void pmem_persist_fit(void *addr, size_t len, int flags);
+void pmem_persist_iov_fit(const struct iovec *iov, int iovcnt, int flags);
 void pmem_flush_cache_fit(void *addr, size_t len, int flags);
 void pmem_drain_pm_stores_fit(void);
+void pmem_fence_fit(void);
+void pmem_unmap_fit(struct pmem_mapping *mp);
+void *pmem_memmove_persist_fit(void *pmemdest, const void *src, size_t len);
+void *pmem_memset_persist_fit(void *pmemdest, int c, size_t len);
+int pmem_remap_fit(struct pmem_mapping *mp, size_t newlen);
+void *pmem_map_deferred(int fd, size_t len, int flags, int *oflagsp);
+void pmem_persist_deferred(void *addr, size_t len, int flags);
+void pmem_persist_iov_deferred(const struct iovec *iov, int iovcnt, int flags);
+void pmem_flush_cache_deferred(void *addr, size_t len, int flags);
+void pmem_drain_pm_stores_deferred(void);
+void *pmem_memmove_persist_deferred(void *pmemdest, const void *src,
+		size_t len);
+void *pmem_memset_persist_deferred(void *pmemdest, int c, size_t len);
+void pmem_commit_deferred(void);
+void pmem_unmap_deferred(struct pmem_mapping *mp);
+void *pmem_map_image(int fd, size_t len, int flags, int *oflagsp);
+void pmem_persist_image(void *addr, size_t len, int flags);
+void pmem_persist_iov_image(const struct iovec *iov, int iovcnt, int flags);
+void pmem_flush_cache_image(void *addr, size_t len, int flags);
+void pmem_fence_image(void);
+void pmem_drain_pm_stores_image(void);
+void *pmem_memmove_persist_image(void *pmemdest, const void *src,
+		size_t len);
+void *pmem_memset_persist_image(void *pmemdest, int c, size_t len);
+void pmem_unmap_image(struct pmem_mapping *mp);
+int pmem_remap_image(struct pmem_mapping *mp, size_t newlen);
+void pmem_persist_emul(void *addr, size_t len, int flags);
+void pmem_persist_iov_emul(const struct iovec *iov, int iovcnt, int flags);
+void pmem_flush_cache_emul(void *addr, size_t len, int flags);
+void pmem_fence_emul(void);
+void pmem_drain_pm_stores_emul(void);
+void *pmem_memmove_persist_emul(void *pmemdest, const void *src, size_t len);
+void *pmem_memset_persist_emul(void *pmemdest, int c, size_t len);
+void *pmem_map_auto(int fd, size_t len, int flags, int *oflagsp);
+void pmem_persist_auto(void *addr, size_t len, int flags);
+void pmem_persist_iov_auto(const struct iovec *iov, int iovcnt, int flags);
+void pmem_flush_cache_auto(void *addr, size_t len, int flags);
+void pmem_drain_pm_stores_auto(void);
+void *pmem_memmove_persist_auto(void *pmemdest, const void *src, size_t len);
+void *pmem_memset_persist_auto(void *pmemdest, int c, size_t len);
+static void pmem_unmap_nop(struct pmem_mapping *mp);
+static void pmem_commit_nop(void);
+static void pmem_fence_sfence(void);
 #define	PMEM_CL_INDEX 0
 #define	PMEM_MSYNC_INDEX 1
 #define	PMEM_FIT_INDEX 2
-static void *(*Map[])(int fd, size_t len) =
-		{ pmem_map_cl, pmem_map_msync, pmem_map_fit };
-static void (*Persist[])(void *addr, size_t len, int flags) =
-		{ pmem_persist_cl, pmem_persist_msync, pmem_persist_fit };
-static void (*Flush[])(void *addr, size_t len, int flags) =
+#define	PMEM_DEFERRED_INDEX 3
+#define	PMEM_IMAGE_INDEX 4
+#define	PMEM_EMUL_INDEX 5
+#define	PMEM_AUTO_INDEX 6
+static void *(*const Map[])(int fd, size_t len, int flags, int *oflagsp) =
+		{ pmem_map_cl, pmem_map_msync, pmem_map_fit,
+		pmem_map_deferred, pmem_map_image, pmem_map_cl,
+		pmem_map_auto };
+static void (*const Unmap[])(struct pmem_mapping *mp) =
+		{ pmem_unmap_nop, pmem_unmap_msync, pmem_unmap_fit,
+		pmem_unmap_deferred, pmem_unmap_image, pmem_unmap_nop,
+		pmem_unmap_nop };
+static int (*const Remap[])(struct pmem_mapping *mp, size_t newlen) =
+		{ pmem_remap_cl, pmem_remap_msync, pmem_remap_fit,
+		pmem_remap_cl, pmem_remap_image, pmem_remap_cl,
+		pmem_remap_cl };
+static void (*const Persist[])(void *addr, size_t len, int flags) =
+		{ pmem_persist_cl, pmem_persist_msync, pmem_persist_fit,
+		pmem_persist_deferred, pmem_persist_image, pmem_persist_emul,
+		pmem_persist_auto };
+static void (*const Persist_iov[])(const struct iovec *iov, int iovcnt,
+		int flags) =
+		{ pmem_persist_iov_cl, pmem_persist_iov_msync,
+		pmem_persist_iov_fit, pmem_persist_iov_deferred,
+		pmem_persist_iov_image, pmem_persist_iov_emul,
+		pmem_persist_iov_auto };
+static void (*const Flush[])(void *addr, size_t len, int flags) =
 		{ pmem_flush_cache_cl, pmem_flush_cache_msync,
-			pmem_flush_cache_fit };
-static void (*Drain_pm_stores[])(void) =
+			pmem_flush_cache_fit, pmem_flush_cache_deferred,
+			pmem_flush_cache_image, pmem_flush_cache_emul,
+			pmem_flush_cache_auto };
+static void (*const Drain_pm_stores[])(void) =
 		{ pmem_drain_pm_stores_cl, pmem_drain_pm_stores_msync,
-		pmem_drain_pm_stores_fit };
-static int Mode = PMEM_CL_INDEX;	/* current libpmem mode */
+		pmem_drain_pm_stores_fit, pmem_drain_pm_stores_deferred,
+		pmem_drain_pm_stores_image, pmem_drain_pm_stores_emul,
+		pmem_drain_pm_stores_auto };
+static void *(*const Memmove_persist[])(void *pmemdest, const void *src,
+		size_t len) =
+		{ pmem_memmove_persist_cl, pmem_memmove_persist_msync,
+		pmem_memmove_persist_fit, pmem_memmove_persist_deferred,
+		pmem_memmove_persist_image, pmem_memmove_persist_emul,
+		pmem_memmove_persist_auto };
+static void *(*const Memset_persist[])(void *pmemdest, int c, size_t len) =
+		{ pmem_memset_persist_cl, pmem_memset_persist_msync,
+		pmem_memset_persist_fit, pmem_memset_persist_deferred,
+		pmem_memset_persist_image, pmem_memset_persist_emul,
+		pmem_memset_persist_auto };
+static void (*const Commit[])(void) =
+		{ pmem_commit_nop, pmem_commit_nop, pmem_commit_nop,
+		pmem_commit_deferred, pmem_commit_nop, pmem_commit_nop,
+		pmem_commit_nop };
+static void (*const Fence[])(void) =
+		{ pmem_fence_sfence, pmem_fence_sfence, pmem_fence_fit,
+		pmem_fence_sfence, pmem_fence_image, pmem_fence_emul,
+		pmem_fence_sfence };
+
+/*
+ * whether pmem_persist_async() hands off to the flusher threads; the
+ * fault injection modes persist in-line, so the writes happen in the
+ * same order every run (and image mode isn't thread-safe anyway)
+ */
+static const int Async[] = { 1, 1, 0, 1, 0, 1, 1 };
+
+/*
+ * whether the mappings are shared ones, which may be Persistent Memory
+ * (see pmem_is_pmem()); the fault injection modes map privately
+ */
+static const int Shared[] = { 1, 1, 0, 1, 0, 1, 1 };
+
+/*
+ * The entry points call through these pointers, which are patched from
+ * the tables above once, when the mode is selected, so the hot paths
+ * cost a single indirect call without looking up the mode each time.
+ * They start out pointing at the default (auto) versions.
+ */
+static void *(*Map_fn)(int fd, size_t len, int flags, int *oflagsp) =
+		pmem_map_auto;
+static void (*Unmap_fn)(struct pmem_mapping *mp) = pmem_unmap_nop;
+static int (*Remap_fn)(struct pmem_mapping *mp, size_t newlen) =
+		pmem_remap_cl;
+static void (*Persist_fn)(void *addr, size_t len, int flags) =
+		pmem_persist_auto;
+static void (*Persist_iov_fn)(const struct iovec *iov, int iovcnt,
+		int flags) = pmem_persist_iov_auto;
+static void (*Flush_fn)(void *addr, size_t len, int flags) =
+		pmem_flush_cache_auto;
+static void (*Drain_pm_stores_fn)(void) = pmem_drain_pm_stores_auto;
+static void *(*Memmove_persist_fn)(void *pmemdest, const void *src,
+		size_t len) = pmem_memmove_persist_auto;
+static void *(*Memset_persist_fn)(void *pmemdest, int c, size_t len) =
+		pmem_memset_persist_auto;
+static void (*Commit_fn)(void) = pmem_commit_nop;
+static void (*Fence_fn)(void) = pmem_fence_sfence;
+static int Async_on = 1;
+static int Shared_on = 1;
+
+/*
+ * the last PMEM_F_ASYNC persist this thread handed off, which its
+ * next pmem_fence() waits for (waiting for a token covers every
+ * token before it)
+ */
+static __thread unsigned long Async_pending;
+
+/*
+ * pmem_set_mode -- point the entry points at the given version of libpmem
+ */
+static void
+pmem_set_mode(int mode)
+{
+	Map_fn = Map[mode];
+	Unmap_fn = Unmap[mode];
+	Remap_fn = Remap[mode];
+	Persist_fn = Persist[mode];
+	Persist_iov_fn = Persist_iov[mode];
+	Flush_fn = Flush[mode];
+	Drain_pm_stores_fn = Drain_pm_stores[mode];
+	Memmove_persist_fn = Memmove_persist[mode];
+	Memset_persist_fn = Memset_persist[mode];
+	Commit_fn = Commit[mode];
+	Fence_fn = Fence[mode];
+	Async_on = Async[mode];
+	Shared_on = Shared[mode];
+}
+
+/*
+ * pmem_cl_mode -- switch libpmem to cache line mode
+ *
+ * Flushing the processor caches is used for every mapping, even ones
+ * that aren't Persistent Memory, where it doesn't make anything durable.
+ * Must be called before any other libpmem routines.
+ */
+void
+pmem_cl_mode(void)
+{
+	pmem_set_mode(PMEM_CL_INDEX);
+}
 
 /*
  * pmem_msync_mode -- switch libpmem to msync mode
@@ -74,7 +261,7 @@ static int Mode = PMEM_CL_INDEX;	/* current libpmem mode */
 void
 pmem_msync_mode(void)
 {
-	Mode = PMEM_MSYNC_INDEX;
+	pmem_set_mode(PMEM_MSYNC_INDEX);
 }
 
 /*
@@ -85,7 +272,51 @@ pmem_msync_mode(void)
 void
 pmem_fit_mode(void)
 {
-	Mode = PMEM_FIT_INDEX;
+	pmem_set_mode(PMEM_FIT_INDEX);
+}
+
+/*
+ * pmem_msync_deferred_mode -- switch libpmem to deferred msync mode
+ *
+ * Must be called before any other libpmem routines.
+ */
+void
+pmem_msync_deferred_mode(void)
+{
+	pmem_set_mode(PMEM_DEFERRED_INDEX);
+}
+
+/*
+ * pmem_fit_image_mode -- switch libpmem to crash image test mode
+ *
+ * Must be called before any other libpmem routines.
+ */
+void
+pmem_fit_image_mode(void)
+{
+	pmem_set_mode(PMEM_IMAGE_INDEX);
+}
+
+/*
+ * pmem_emul_mode -- switch libpmem to emulated Persistent Memory mode
+ *
+ * Must be called before any other libpmem routines.
+ */
+void
+pmem_emul_mode(void)
+{
+	pmem_set_mode(PMEM_EMUL_INDEX);
+}
+
+/*
+ * pmem_auto_mode -- switch libpmem back to auto mode, the default
+ *
+ * Must be called before any other libpmem routines.
+ */
+void
+pmem_auto_mode(void)
+{
+	pmem_set_mode(PMEM_AUTO_INDEX);
 }
 
 /*
@@ -94,7 +325,126 @@ pmem_fit_mode(void)
 void *
 pmem_map(int fd, size_t len)
 {
-	return (*Map[Mode])(fd, len);
+	return pmem_map_ex(fd, len, 0, NULL);
+}
+
+/*
+ * pmem_map_ex -- map the Persistent Memory, with options
+ *
+ * The options that took effect are returned in *oflagsp.
+ */
+void *
+pmem_map_ex(int fd, size_t len, int flags, int *oflagsp)
+{
+	struct pmem_mapping *mp;
+	void *base;
+	int oflags = 0;
+
+	if ((base = (*Map_fn)(fd, len, flags, &oflags)) == NULL)
+		return NULL;
+
+	pmem_numa_map(fd, base, len, flags, &oflags);
+
+	mp = pmem_reg_find(base);
+	mp->oflags = oflags;
+	mp->limit = mp->start + pmem_mmap_span(len, oflags);
+	mp->pmem = Shared_on &&
+		((oflags & PMEM_MAP_SYNC) || pmem_auto_probe(fd));
+
+	/* growing maps more of the file, so hang on to it */
+	if ((oflags & PMEM_MAP_GROWABLE) && mp->fd < 0 &&
+	    (mp->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0)) < 0) {
+		int oerrno = errno;
+
+		pmem_unmap(base);
+		errno = oerrno;
+		return NULL;
+	}
+
+	if (oflagsp)
+		*oflagsp = oflags;
+
+	return base;
+}
+
+/*
+ * pmem_unmap -- unmap the Persistent Memory
+ *
+ * addr must be an address returned by pmem_map() or pmem_map_ex().
+ * Returns 0 on success, or -1 with errno set.
+ */
+int
+pmem_unmap(void *addr)
+{
+	struct pmem_mapping *mp;
+	int ret;
+
+	if ((mp = pmem_reg_remove(addr)) == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	(*Unmap_fn)(mp);
+	ret = munmap(addr, mp->limit - mp->start);
+	if (mp->fd >= 0)
+		close(mp->fd);
+	free(mp);
+
+	return ret;
+}
+
+/*
+ * pmem_remap -- grow a mapping made with PMEM_MAP_GROWABLE in place
+ *
+ * addr must be an address returned by pmem_map_ex().  The file is
+ * extended first, if need be, so the new part of the mapping is backed.
+ * Returns 0 on success, or -1 with errno set.
+ */
+int
+pmem_remap(void *addr, size_t newlen)
+{
+	struct pmem_mapping *mp = pmem_reg_find(addr);
+	struct stat stbuf;
+	int err;
+
+	if (mp == NULL || mp->start != (uintptr_t)addr ||
+	    !(mp->oflags & PMEM_MAP_GROWABLE) ||
+	    newlen < mp->end - mp->start) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (newlen > mp->limit - mp->start) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	if (fstat(mp->fd, &stbuf) < 0)
+		return -1;
+
+	if (stbuf.st_size < newlen &&
+	    (err = posix_fallocate(mp->fd, 0, newlen)) != 0) {
+		errno = err;
+		return -1;
+	}
+
+	if ((*Remap_fn)(mp, newlen) < 0)
+		return -1;
+
+	mp->end = mp->start + newlen;
+
+	return 0;
+}
+
+/*
+ * pmem_unmap_nop -- nothing to clean up when unmapping
+ *
+ * The cache line version keeps nothing for a mapping besides its
+ * registry entry.
+ */
+static void
+pmem_unmap_nop(struct pmem_mapping *mp)
+{
 }
 
 /*
@@ -103,7 +453,61 @@ pmem_map(int fd, size_t len)
 void
 pmem_persist(void *addr, size_t len, int flags)
 {
-	(*Persist[Mode])(addr, len, flags);
+	void *site;
+
+	PMEM_STATS_ENTER(site);
+	if (Pmem_stats)
+		pmem_stats_persist(addr, len);
+
+	if ((flags & PMEM_F_ASYNC) && Async_on)
+		Async_pending = pmem_async_submit(addr, len);
+	else
+		(*Persist_fn)(addr, len, flags);
+
+	PMEM_STATS_LEAVE(site);
+}
+
+/*
+ * pmem_persist_async -- start making a range of PM persistent
+ *
+ * Returns a token for pmem_persist_wait() and pmem_persist_poll().
+ */
+unsigned long
+pmem_persist_async(void *addr, size_t len)
+{
+	if (Async_on)
+		return pmem_async_submit(addr, len);
+
+	pmem_persist(addr, len, 0);
+	return 0;
+}
+
+/*
+ * pmem_persist_iov -- make several discontiguous ranges of PM persistent
+ */
+void
+pmem_persist_iov(const struct iovec *iov, int iovcnt, int flags)
+{
+	void *site;
+	int i;
+
+	PMEM_STATS_ENTER(site);
+	if (Pmem_stats) {
+		pmem_stats_persist(NULL, 0);
+		for (i = 0; i < iovcnt; i++)
+			pmem_stats_flush(iov[i].iov_base, iov[i].iov_len);
+	}
+
+	if ((flags & PMEM_F_ASYNC) && Async_on) {
+		for (i = 0; i < iovcnt; i++)
+			if (iov[i].iov_len)
+				Async_pending = pmem_async_submit(
+						iov[i].iov_base,
+						iov[i].iov_len);
+	} else
+		(*Persist_iov_fn)(iov, iovcnt, flags);
+
+	PMEM_STATS_LEAVE(site);
 }
 
 /*
@@ -112,7 +516,18 @@ pmem_persist(void *addr, size_t len, int flags)
 void
 pmem_flush_cache(void *addr, size_t len, int flags)
 {
-	(*Flush[Mode])(addr, len, flags);
+	void *site;
+
+	PMEM_STATS_ENTER(site);
+	if (Pmem_stats)
+		pmem_stats_flush(addr, len);
+
+	if ((flags & PMEM_F_ASYNC) && Async_on)
+		Async_pending = pmem_async_submit(addr, len);
+	else
+		(*Flush_fn)(addr, len, flags);
+
+	PMEM_STATS_LEAVE(site);
 }
 
 /*
@@ -121,7 +536,20 @@ pmem_flush_cache(void *addr, size_t len, int flags)
 void
 pmem_fence(void)
 {
-	__builtin_ia32_sfence();
+	void *site;
+
+	PMEM_STATS_ENTER(site);
+	if (Pmem_stats)
+		pmem_stats_fence();
+
+	if (Async_pending) {
+		pmem_persist_wait(Async_pending);
+		Async_pending = 0;
+	}
+
+	(*Fence_fn)();
+
+	PMEM_STATS_LEAVE(site);
 }
 
 /*
@@ -130,5 +558,105 @@ pmem_fence(void)
 void
 pmem_drain_pm_stores(void)
 {
-	(*Drain_pm_stores[Mode])();
+	void *site;
+
+	PMEM_STATS_ENTER(site);
+	if (Pmem_stats)
+		pmem_stats_drain();
+
+	(*Drain_pm_stores_fn)();
+
+	PMEM_STATS_LEAVE(site);
+}
+
+/*
+ * pmem_memcpy_persist -- memcpy to PM and make the result persistent
+ *
+ * Since the copy is done by the same routine as pmem_memmove_persist(),
+ * overlapping ranges are handled correctly here too.
+ */
+void *
+pmem_memcpy_persist(void *pmemdest, const void *src, size_t len)
+{
+	void *site;
+
+	PMEM_STATS_ENTER(site);
+	if (Pmem_stats)
+		pmem_stats_persist(pmemdest, len);
+
+	(*Memmove_persist_fn)(pmemdest, src, len);
+
+	PMEM_STATS_LEAVE(site);
+	return pmemdest;
+}
+
+/*
+ * pmem_memmove_persist -- memmove to PM and make the result persistent
+ */
+void *
+pmem_memmove_persist(void *pmemdest, const void *src, size_t len)
+{
+	void *site;
+
+	PMEM_STATS_ENTER(site);
+	if (Pmem_stats)
+		pmem_stats_persist(pmemdest, len);
+
+	(*Memmove_persist_fn)(pmemdest, src, len);
+
+	PMEM_STATS_LEAVE(site);
+	return pmemdest;
+}
+
+/*
+ * pmem_memset_persist -- memset PM and make the result persistent
+ */
+void *
+pmem_memset_persist(void *pmemdest, int c, size_t len)
+{
+	void *site;
+
+	PMEM_STATS_ENTER(site);
+	if (Pmem_stats)
+		pmem_stats_persist(pmemdest, len);
+
+	(*Memset_persist_fn)(pmemdest, c, len);
+
+	PMEM_STATS_LEAVE(site);
+	return pmemdest;
+}
+
+/*
+ * pmem_fence_sfence -- fence for modes where a store barrier is enough
+ */
+static void
+pmem_fence_sfence(void)
+{
+	__builtin_ia32_sfence();
+}
+
+/*
+ * pmem_commit_nop -- commit for modes where persist is already durable
+ */
+static void
+pmem_commit_nop(void)
+{
+}
+
+/*
+ * pmem_commit -- make everything persisted so far durable
+ *
+ * Only deferred msync mode has anything to do here, the other modes
+ * are already durable when pmem_persist() returns.
+ */
+void
+pmem_commit(void)
+{
+	void *site;
+
+	PMEM_STATS_ENTER(site);
+
+	(*Commit_fn)();
+
+	PMEM_STATS_LEAVE(site);
 }
@@ -34,12 +34,101 @@
  * pmem.h -- definitions of libpmem entry points
  */
 
+#include <stdio.h>
+
+struct iovec;
+
+/* options for pmem_map_ex() */
+#define	PMEM_MAP_SYNC 0x1	/* MAP_SYNC, for DAX file systems */
+#define	PMEM_MAP_POPULATE 0x2	/* prefault the whole mapping */
+#define	PMEM_MAP_HUGE_2M 0x4	/* align to 2MB for huge page mappings */
+#define	PMEM_MAP_HUGE_1G 0x8	/* align to 1GB for huge page mappings */
+#define	PMEM_MAP_NODE(n) ((((n) & 0xff) + 1) << 16)	/* NUMA node hint */
+#define	PMEM_MAP_NODE_MASK 0xff0000
+#define	PMEM_MAP_GROWABLE 0x10	/* leave room to grow with pmem_remap() */
+
+/* flags for pmem_persist(), pmem_persist_iov() and pmem_flush_cache() */
+#define	PMEM_F_NOFENCE 0x1	/* flush only, a pmem_fence() comes later */
+#define	PMEM_F_NODRAIN 0x2	/* fence, but no pmem_drain_pm_stores() */
+#define	PMEM_F_NONTEMPORAL 0x4	/* the range won't be read again soon */
+#define	PMEM_F_ASYNC 0x8	/* on the flusher threads, pmem_fence() waits */
+
+void pmem_auto_mode(void);	/* the default: cl or msync, per mapping */
+void pmem_cl_mode(void);	/* cache flushing, even for non-PM files */
 void pmem_msync_mode(void);	/* for testing on non-PM memory-mapped files */
 void pmem_fit_mode(void);	/* for fault injection testing */
+void pmem_msync_deferred_mode(void);	/* msync mode, synced at commit */
+void pmem_fit_image_mode(void);	/* for in-process crash image checking */
+void pmem_emul_mode(void);	/* PM-like latency and bandwidth on DRAM */
 
 /* commonly-used functions for Persistent Memory */
 void *pmem_map(int fd, size_t len);
+void *pmem_map_ex(int fd, size_t len, int flags, int *oflagsp);
+int pmem_unmap(void *addr);
+int pmem_remap(void *addr, size_t newlen);
+int pmem_is_pmem(const void *addr, size_t len);
+int pmem_map_node(const void *addr);
+int pmem_bind_thread(int node);
 void pmem_persist(void *addr, size_t len, int flags);
+void pmem_persist_iov(const struct iovec *iov, int iovcnt, int flags);
+
+/* persist in the background, waiting only where it has to be durable */
+unsigned long pmem_persist_async(void *addr, size_t len);
+int pmem_persist_poll(unsigned long token);
+void pmem_persist_wait(unsigned long token);
+void pmem_async_threads(int nthreads);
+
+/* flush ranges of at least min bytes on several threads, 0 for never */
+void pmem_parallel_flush(size_t min, int nthreads);
+
+/* copy or set a range of PM and make the result persistent */
+void *pmem_memcpy_persist(void *pmemdest, const void *src, size_t len);
+void *pmem_memmove_persist(void *pmemdest, const void *src, size_t len);
+void *pmem_memset_persist(void *pmemdest, int c, size_t len);
+
+/* batch several persists together, flushing each cache line once */
+void pmem_batch_begin(void);
+void pmem_batch_add(void *addr, size_t len);
+void pmem_batch_commit(void);
+
+/* commit point for deferred msync mode, no-op in the other modes */
+void pmem_commit(void);
+void pmem_group_commit(unsigned usec);
+
+/* msync mode: sync only the pages written since the last sync */
+void pmem_track_dirty(void);
+void pmem_sync_dirty(void);
+
+/* crash image mode: the durable image at each epoch (fence) */
+unsigned long pmem_image_epoch(void);
+unsigned long pmem_image_line_epoch(const void *addr);
+int pmem_image_get(const void *addr, unsigned long epoch, void *buf);
+int pmem_image_dump(const void *addr, unsigned long epoch, const char *path);
+int pmem_image_walk(const void *addr, int (*checker)(const void *image,
+		size_t len, unsigned long epoch, void *arg), void *arg);
+
+/* persistence statistics, see LIBPMEM_API.txt */
+struct pmem_stats {
+	unsigned long persists;		/* persist calls of any kind */
+	unsigned long bytes;		/* bytes persisted or flushed */
+	unsigned long lines;		/* 64B lines flushed */
+	unsigned long redundant;	/* lines flushed again soon after */
+	unsigned long fences;
+	unsigned long drains;
+	unsigned long msyncs;		/* msync() calls */
+	unsigned long remote;		/* persists to another NUMA node */
+};
+
+struct pmem_stats_site {
+	void *caller;			/* return address into the caller */
+	struct pmem_stats stats;
+};
+
+void pmem_stats_enable(int on);
+void pmem_stats_get(struct pmem_stats *statsp);
+int pmem_stats_sites(struct pmem_stats_site *sites, int max);
+void pmem_stats_reset(void);
+void pmem_stats_dump(FILE *fp);
 
 /* for advanced users -- functions that do portions of pmem_persist() */
 void pmem_flush_cache(void *addr, size_t len, int flags);
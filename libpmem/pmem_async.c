@@ -0,0 +1,280 @@
+/*
+ * Copyright (c) 2013, Intel Corporation
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ * 
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ * 
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * pmem_async.c -- asynchronous persist for libpmem
+ *
+ * pmem_persist_async() hands a range to a pool of flusher threads and
+ * returns a token right away, so the caller can get on with its work
+ * and wait for durability only at its commit points.  Tokens are
+ * sequence numbers, and the requests live in a ring indexed by them.
+ * Each flusher has its own queue, a lock-free stack that submitters
+ * push on with compare-and-swap and the flusher empties in one atomic
+ * exchange, reversing what it took to get the requests back in order.
+ *
+ * Requests complete in any order, but Done only moves past a token
+ * once every token before it is done too, so waiting for the last
+ * token a thread submitted covers everything it submitted.  That also
+ * bounds the requests in flight by the ring size; submitters wait for
+ * the oldest slot to free up when the ring is full.
+ */
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "util/util.h"
+#include "pmem.h"
+#include "pmem_internal.h"
+
+#define	RING 4096		/* requests in flight, power of 2 */
+#define	MAXFLUSHERS 64
+#define	SPINS 1000		/* polls before a waiter goes to sleep */
+
+/*
+ * a request, in the slot of the ring picked by its token
+ */
+struct req {
+	struct req *next;	/* next on the queue, newest first */
+	void *addr;
+	size_t len;
+	unsigned long token;
+	unsigned long done;	/* token, once it's persistent */
+};
+
+/*
+ * a flusher's queue of requests, and the count of requests pushed
+ * on it for the flusher to sleep on
+ */
+struct queue {
+	struct req *top;
+	sem_t sem;
+} __attribute__((aligned(64)));
+
+static struct req Ring[RING];
+static struct queue Queues[MAXFLUSHERS];
+static int Nflushers = 2;
+static pthread_once_t Once = PTHREAD_ONCE_INIT;
+
+static unsigned long Next = 1;	/* next token to hand out */
+static unsigned long Done = 1;	/* every token below this is done */
+
+static pthread_mutex_t Lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t Cond = PTHREAD_COND_INITIALIZER;
+static int Nwaiters;		/* waiters sleeping (or about to) on Cond */
+
+/*
+ * pmem_async_threads -- set the number of flusher threads
+ *
+ * Must be called before the first pmem_persist_async().
+ */
+void
+pmem_async_threads(int nthreads)
+{
+	if (nthreads < 1 || nthreads > MAXFLUSHERS)
+		FATAL("flusher threads must be 1 to %d", MAXFLUSHERS);
+
+	Nflushers = nthreads;
+}
+
+/*
+ * complete -- mark a request done, and move Done past all finished tokens
+ *
+ * Several flushers may be moving Done at once, so it's only ever
+ * advanced by compare-and-swap, one token at a time.
+ */
+static void
+complete(struct req *rp)
+{
+	unsigned long d;
+
+	/*
+	 * Storing done before looking at Done (and the other way around
+	 * below) means that of two flushers finishing neighboring tokens
+	 * at once, at least one sees the other's and moves Done past both.
+	 */
+	__atomic_store_n(&rp->done, rp->token, __ATOMIC_SEQ_CST);
+
+	for (;;) {
+		d = __atomic_load_n(&Done, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&Ring[d & (RING - 1)].done,
+					__ATOMIC_SEQ_CST) != d)
+			break;
+		__atomic_compare_exchange_n(&Done, &d, d + 1, 0,
+				__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	}
+
+	if (__atomic_load_n(&Nwaiters, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&Lock);
+		pthread_cond_broadcast(&Cond);
+		pthread_mutex_unlock(&Lock);
+	}
+}
+
+/*
+ * flusher -- flusher thread, persisting the requests on its queue
+ */
+static void *
+flusher(void *arg)
+{
+	struct queue *qp = arg;
+
+	for (;;) {
+		struct req *rp;
+		struct req *fifo = NULL;
+
+		while (sem_wait(&qp->sem) < 0)
+			;
+
+		/* take everything queued, and reverse it to oldest first */
+		rp = __atomic_exchange_n(&qp->top, NULL, __ATOMIC_ACQUIRE);
+		while (rp) {
+			struct req *next = rp->next;
+
+			rp->next = fifo;
+			fifo = rp;
+			rp = next;
+		}
+
+		/* the slot may be reused as soon as it's marked done */
+		while ((rp = fifo) != NULL) {
+			fifo = rp->next;
+			pmem_persist(rp->addr, rp->len, 0);
+			complete(rp);
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * start -- start the flusher threads
+ */
+static void
+start(void)
+{
+	pthread_attr_t attr;
+	pthread_t tid;
+	int i;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	for (i = 0; i < Nflushers; i++) {
+		if (sem_init(&Queues[i].sem, 0, 0) < 0)
+			FATALSYS("sem_init");
+		if ((errno = pthread_create(&tid, &attr, flusher,
+						&Queues[i])) != 0)
+			FATALSYS("pthread_create");
+	}
+
+	pthread_attr_destroy(&attr);
+
+	DEBUG("%d flusher threads", Nflushers);
+}
+
+/*
+ * pmem_async_submit -- queue a range to be persisted, returning its token
+ */
+unsigned long
+pmem_async_submit(void *addr, size_t len)
+{
+	unsigned long token;
+	struct req *rp;
+	struct queue *qp;
+
+	pthread_once(&Once, start);
+
+	token = __atomic_fetch_add(&Next, 1, __ATOMIC_RELAXED);
+
+	/* wait for the slot's last occupant if the ring is full */
+	if (token >= RING)
+		pmem_persist_wait(token - RING);
+
+	rp = &Ring[token & (RING - 1)];
+	rp->addr = addr;
+	rp->len = len;
+	rp->token = token;
+
+	qp = &Queues[token % Nflushers];
+	rp->next = __atomic_load_n(&qp->top, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&qp->top, &rp->next, rp, 1,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+	sem_post(&qp->sem);
+
+	return token;
+}
+
+/*
+ * pmem_persist_poll -- return true if the persist for token is done
+ *
+ * Token 0, returned when the range was persisted synchronously, is
+ * always done.
+ */
+int
+pmem_persist_poll(unsigned long token)
+{
+	return __atomic_load_n(&Done, __ATOMIC_SEQ_CST) > token;
+}
+
+/*
+ * pmem_persist_wait -- wait for the persist for token, and all before it
+ */
+void
+pmem_persist_wait(unsigned long token)
+{
+	int i;
+
+	for (i = 0; i < SPINS; i++) {
+		if (pmem_persist_poll(token))
+			return;
+		__builtin_ia32_pause();
+	}
+
+	/*
+	 * Nwaiters goes up before Done is checked again, and complete()
+	 * moves Done before checking Nwaiters, so either this sees the
+	 * token done or the flusher sees a waiter to wake up.
+	 */
+	pthread_mutex_lock(&Lock);
+	__atomic_add_fetch(&Nwaiters, 1, __ATOMIC_SEQ_CST);
+	while (!pmem_persist_poll(token))
+		pthread_cond_wait(&Cond, &Lock);
+	__atomic_sub_fetch(&Nwaiters, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&Lock);
+}
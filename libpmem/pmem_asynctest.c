@@ -0,0 +1,278 @@
+/*
+ * Copyright (c) 2013, Intel Corporation
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ * 
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ * 
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * pmem_asynctest.c -- stress test for pmem_persist_async()
+ *
+ * Usage: pmem_asynctest [-Md] [-f flushers] [-t threads] [-n iters] path
+ *
+ * Each of the threads submits iters persists of its own part of the
+ * file at path with pmem_persist_async(), more than the 4096 the ring
+ * holds between them, waiting for some of the tokens and polling the
+ * rest, and checks that:
+ *
+ *	- the tokens it gets are increasing
+ *	- once a token is done, every token before it is done too
+ *	- once pmem_persist_wait() returns, the token is done
+ *	- pmem_fence() waits for the persists submitted with
+ *	  PMEM_F_ASYNC before it
+ *
+ * When the threads are finished, the main thread checks that
+ * pmem_fence() waits for exactly the last PMEM_F_ASYNC persist, with no
+ * other threads submitting.  The default mode is cl, -M is msync mode.
+ * Any failure is fatal.  "make test" runs it in both modes.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "util/util.h"
+#include "pmem.h"
+
+#define	RING 4096	/* requests in flight, as in pmem_async.c */
+#define	PART 4096	/* bytes of the file for each thread */
+#define	LINE 64
+#define	WAITEVERY 61	/* wait instead of poll every this many tokens */
+#define	FENCEEVERY 97	/* check pmem_fence() every this many tokens */
+
+char Usage[] = "[-Md] [-f flushers] [-t threads] [-n iters] path";
+							/* for USAGE() */
+
+/*
+ * what each thread works with
+ */
+struct thread {
+	pthread_t tid;
+	int num;
+	char *part;		/* the thread's part of the file */
+	unsigned long iters;
+	unsigned long *tokens;	/* every token the thread got, in order */
+};
+
+/*
+ * check_done -- check that tokens[lo..hi] are all done, oldest last
+ *
+ * Internal support routine.  Polling the newest first means a token
+ * reported done with an older one still pending is caught.
+ */
+static void
+check_done(struct thread *tp, unsigned long lo, unsigned long hi)
+{
+	unsigned long i;
+
+	for (i = hi + 1; i-- > lo; )
+		if (!pmem_persist_poll(tp->tokens[i]))
+			FATAL("thread %d: token %lu not done after token %lu",
+					tp->num, tp->tokens[i], tp->tokens[hi]);
+}
+
+/*
+ * worker -- submit the thread's persists and check the tokens
+ *
+ * Internal support routine.
+ */
+static void *
+worker(void *arg)
+{
+	struct thread *tp = (struct thread *)arg;
+	unsigned long checked = 0;	/* tokens[0..checked-1] are done */
+	unsigned long i;
+	unsigned long j;
+	char *line;
+
+	for (i = 0; i < tp->iters; i++) {
+		line = tp->part + (i % (PART / LINE)) * LINE;
+		memset(line, (int)i, LINE);
+		tp->tokens[i] = pmem_persist_async(line, LINE);
+
+		if (tp->tokens[i] == 0)
+			FATAL("thread %d: token 0 for an async persist",
+					tp->num);
+		if (i && tp->tokens[i] <= tp->tokens[i - 1])
+			FATAL("thread %d: token %lu after token %lu",
+					tp->num, tp->tokens[i],
+					tp->tokens[i - 1]);
+
+		if (i % WAITEVERY == 0) {
+			pmem_persist_wait(tp->tokens[i]);
+			check_done(tp, checked, i);
+			checked = i + 1;
+		} else if (pmem_persist_poll(tp->tokens[i])) {
+			check_done(tp, checked, i);
+			checked = i + 1;
+		}
+
+		/*
+		 * A PMEM_F_ASYNC persist gets a token after the one just
+		 * submitted, so once pmem_fence() returns that one has to
+		 * be done too.
+		 */
+		if (i % FENCEEVERY == 0) {
+			for (j = 0; j < 3; j++)
+				pmem_persist(line, LINE, PMEM_F_ASYNC);
+			pmem_fence();
+			if (!pmem_persist_poll(tp->tokens[i]))
+				FATAL("thread %d: pmem_fence() returned "
+						"before token %lu was done",
+						tp->num, tp->tokens[i]);
+			check_done(tp, checked, i);
+			checked = i + 1;
+		}
+	}
+
+	/* the last token covers everything the thread submitted */
+	pmem_persist_wait(tp->tokens[tp->iters - 1]);
+	check_done(tp, checked, tp->iters - 1);
+
+	return NULL;
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *path;
+	int nflushers = 3;
+	int nthreads = 4;
+	unsigned long iters = 3 * RING;
+	struct thread *threads;
+	unsigned long before;
+	unsigned long after;
+	char *base;
+	int fd;
+	int opt;
+	int t;
+
+	Myname = argv[0];
+	while ((opt = getopt(argc, argv, "Mdf:t:n:")) != -1) {
+		switch (opt) {
+		case 'M':
+			pmem_msync_mode();
+			break;
+
+		case 'd':
+			Debug++;
+			break;
+
+		case 'f':
+			nflushers = atoi(optarg);
+			break;
+
+		case 't':
+			nthreads = atoi(optarg);
+			break;
+
+		case 'n':
+			iters = strtoul(optarg, NULL, 0);
+			break;
+
+		default:
+			USAGE(NULL);
+		}
+	}
+
+	if (optind >= argc)
+		USAGE("No path given");
+	path = argv[optind++];
+
+	if (optind < argc)
+		USAGE(NULL);
+
+	if (nflushers < 1 || nthreads < 1 || iters < 1)
+		USAGE("flushers, threads and iters must be at least 1");
+
+	if ((fd = open(path, O_CREAT|O_RDWR, 0666)) < 0)
+		FATALSYS("%s", path);
+
+	if ((errno = posix_fallocate(fd, 0, (off_t)PART * nthreads)) != 0)
+		FATALSYS("posix_fallocate");
+
+	if ((base = pmem_map(fd, (size_t)PART * nthreads)) == NULL)
+		FATALSYS("pmem_map");
+
+	close(fd);
+
+	pmem_async_threads(nflushers);
+
+	if (!pmem_persist_poll(0))
+		FATAL("token 0 not done");
+
+	if ((threads = calloc(nthreads, sizeof(*threads))) == NULL)
+		FATALSYS("calloc");
+
+	for (t = 0; t < nthreads; t++) {
+		threads[t].num = t;
+		threads[t].part = base + (size_t)t * PART;
+		threads[t].iters = iters;
+		if ((threads[t].tokens =
+				malloc(sizeof(unsigned long) * iters)) == NULL)
+			FATALSYS("malloc");
+		if ((errno = pthread_create(&threads[t].tid, NULL,
+				worker, &threads[t])) != 0)
+			FATALSYS("pthread_create");
+	}
+
+	for (t = 0; t < nthreads; t++)
+		if ((errno = pthread_join(threads[t].tid, NULL)) != 0)
+			FATALSYS("pthread_join");
+
+	/*
+	 * With no other threads submitting, the PMEM_F_ASYNC persists get
+	 * the tokens between before and after, so the last of them is
+	 * after - 1, and pmem_fence() has to have waited for it.
+	 */
+	before = pmem_persist_async(base, LINE);
+	pmem_persist(base, LINE, PMEM_F_ASYNC);
+	pmem_persist(base + LINE, LINE, PMEM_F_ASYNC);
+	pmem_fence();
+	after = pmem_persist_async(base, LINE);
+	if (after != before + 3)
+		FATAL("tokens %lu and %lu around two PMEM_F_ASYNC persists",
+				before, after);
+	if (!pmem_persist_poll(after - 1))
+		FATAL("pmem_fence() returned before token %lu was done",
+				after - 1);
+	pmem_persist_wait(after);
+
+	for (t = 0; t < nthreads; t++)
+		free(threads[t].tokens);
+	free(threads);
+	pmem_unmap(base);
+
+	exit(0);
+}
@@ -0,0 +1,320 @@
+/*
+ * Copyright (c) 2013, Intel Corporation
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ * 
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ * 
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * pmem_auto.c -- pick cache flushing or msync() for each mapping
+ *
+ * Flushing the processor caches only makes stores durable when a
+ * mapping really is Persistent Memory: a device DAX character device,
+ * or a file on a DAX file system mapped with MAP_SYNC, which keeps the
+ * file system metadata for the mapping durable too.  For a file in the
+ * page cache, flushing does nothing for durability, and msync() is
+ * what's needed.  Auto mode, the default, finds out which kind each
+ * mapping is when it's made, and uses the cache line version of
+ * libpmem for Persistent Memory and the msync version for the rest,
+ * so programs are correct without being told, and fast where they can
+ * be.
+ *
+ * On platforms with eADR, the processor caches are inside the
+ * persistence domain, so a store to Persistent Memory is durable once
+ * it's globally visible.  Flushing is skipped there, leaving only the
+ * fence.  This is found out from the persistence_domain of the NVDIMM
+ * regions in sysfs, and can be forced either way by setting
+ * PMEM_NO_FLUSH to 1 or 0 in the environment.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <glob.h>
+
+#include "util/util.h"
+#include "pmem.h"
+#include "pmem_internal.h"
+
+/* in case the system headers are too old to know about MAP_SYNC */
+#ifndef MAP_SHARED_VALIDATE
+#define	MAP_SHARED_VALIDATE 0x03
+#endif
+#ifndef MAP_SYNC
+#define	MAP_SYNC 0x80000
+#endif
+
+#define	ALIGN 4096	/* the probe maps a single page */
+
+/* the two versions auto mode chooses between */
+void *pmem_map_cl(int fd, size_t len, int flags, int *oflagsp);
+void pmem_persist_cl(void *addr, size_t len, int flags);
+void pmem_persist_iov_cl(const struct iovec *iov, int iovcnt, int flags);
+void pmem_flush_cache_cl(void *addr, size_t len, int flags);
+void pmem_drain_pm_stores_cl(void);
+void *pmem_memmove_persist_cl(void *pmemdest, const void *src, size_t len);
+void *pmem_memset_persist_cl(void *pmemdest, int c, size_t len);
+void pmem_persist_msync(void *addr, size_t len, int flags);
+void pmem_persist_iov_msync(const struct iovec *iov, int iovcnt, int flags);
+void pmem_flush_cache_msync(void *addr, size_t len, int flags);
+void *pmem_memmove_persist_msync(void *pmemdest, const void *src, size_t len);
+void *pmem_memset_persist_msync(void *pmemdest, int c, size_t len);
+
+static int No_flush;		/* caches are in the persistence domain */
+
+/*
+ * eadr -- return true if every NVDIMM region survives with the caches
+ */
+static int
+eadr(void)
+{
+	glob_t g;
+	size_t i;
+	int ret;
+
+	if (glob("/sys/bus/nd/devices/region*/persistence_domain", 0,
+			NULL, &g) != 0)
+		return 0;
+
+	ret = 1;
+	for (i = 0; i < g.gl_pathc && ret; i++) {
+		FILE *fp;
+		char buf[32];
+
+		if ((fp = fopen(g.gl_pathv[i], "r")) == NULL)
+			ret = 0;
+		else {
+			ret = fgets(buf, sizeof(buf), fp) != NULL &&
+				strncmp(buf, "cpu_cache", 9) == 0;
+			fclose(fp);
+		}
+	}
+
+	globfree(&g);
+	return ret;
+}
+
+/*
+ * pmem_auto_init -- find out if flushing can be skipped
+ */
+static void __attribute__((constructor))
+pmem_auto_init(void)
+{
+	char *e = getenv("PMEM_NO_FLUSH");
+
+	if (e != NULL)
+		No_flush = strcmp(e, "0") != 0;
+	else
+		No_flush = eadr();
+
+	DEBUG("flushing %s", No_flush ? "skipped" : "needed");
+}
+
+/*
+ * devdax -- return true if a character device is a device DAX one
+ */
+static int
+devdax(dev_t rdev)
+{
+	char path[PATH_MAX];
+	char target[PATH_MAX];
+	ssize_t n;
+
+	snprintf(path, sizeof(path), "/sys/dev/char/%u:%u/subsystem",
+			major(rdev), minor(rdev));
+	if ((n = readlink(path, target, sizeof(target) - 1)) < 0)
+		return 0;
+	target[n] = '\0';
+
+	return strcmp(strrchr(target, '/') ? strrchr(target, '/') + 1 :
+			target, "dax") == 0;
+}
+
+/*
+ * pmem_auto_probe -- return true if flushing is enough for a file
+ *
+ * A DAX file system is the only kind that accepts MAP_SYNC, so a
+ * throwaway single page mapping with it tells them apart.
+ */
+int
+pmem_auto_probe(int fd)
+{
+	struct stat stbuf;
+	void *addr;
+
+	if (fstat(fd, &stbuf) < 0)
+		return 0;
+
+	if (S_ISCHR(stbuf.st_mode))
+		return devdax(stbuf.st_rdev);
+
+	if ((addr = mmap(NULL, ALIGN, PROT_READ,
+			MAP_SHARED_VALIDATE|MAP_SYNC, fd, 0)) == MAP_FAILED)
+		return 0;
+
+	munmap(addr, ALIGN);
+	return 1;
+}
+
+/*
+ * pmem_is_pmem -- return true if flushing makes a range durable
+ *
+ * The range may cover several adjacent mappings, and all of them must
+ * be Persistent Memory.  Memory libpmem didn't map never is.
+ */
+int
+pmem_is_pmem(const void *addr, size_t len)
+{
+	uintptr_t uptr = (uintptr_t)addr;
+	uintptr_t end = uptr + len;
+
+	do {
+		struct pmem_mapping *mp = pmem_reg_find((void *)uptr);
+
+		if (mp == NULL || !mp->pmem)
+			return 0;
+		uptr = mp->end;
+	} while (uptr < end);
+
+	return 1;
+}
+
+/*
+ * pmem_map -- map the Persistent Memory
+ *
+ * This is the auto version.  MAP_SYNC is always asked for, as cache
+ * flushing is only enough for a DAX file mapped with it.
+ */
+void *
+pmem_map_auto(int fd, size_t len, int flags, int *oflagsp)
+{
+	return pmem_map_cl(fd, len, flags|PMEM_MAP_SYNC, oflagsp);
+}
+
+/*
+ * pmem_persist -- make any cached changes to a range of PM persistent
+ *
+ * This is the auto version.
+ */
+void
+pmem_persist_auto(void *addr, size_t len, int flags)
+{
+	if (!pmem_is_pmem(addr, len))
+		pmem_persist_msync(addr, len, flags);
+	else if (No_flush) {
+		if (!(flags & PMEM_F_NOFENCE))
+			__builtin_ia32_sfence();
+	} else
+		pmem_persist_cl(addr, len, flags);
+}
+
+/*
+ * pmem_persist_iov -- make several ranges of PM persistent
+ *
+ * This is the auto version.  msync() is used for all the ranges unless
+ * every one of them is Persistent Memory.
+ */
+void
+pmem_persist_iov_auto(const struct iovec *iov, int iovcnt, int flags)
+{
+	int i;
+
+	for (i = 0; i < iovcnt; i++)
+		if (!pmem_is_pmem(iov[i].iov_base, iov[i].iov_len)) {
+			pmem_persist_iov_msync(iov, iovcnt, flags);
+			return;
+		}
+
+	if (No_flush) {
+		if (!(flags & PMEM_F_NOFENCE))
+			__builtin_ia32_sfence();
+	} else
+		pmem_persist_iov_cl(iov, iovcnt, flags);
+}
+
+/*
+ * pmem_flush_cache -- flush processor cache for the given range
+ *
+ * This is the auto version.
+ */
+void
+pmem_flush_cache_auto(void *addr, size_t len, int flags)
+{
+	if (!pmem_is_pmem(addr, len))
+		pmem_flush_cache_msync(addr, len, flags);
+	else if (!No_flush)
+		pmem_flush_cache_cl(addr, len, flags);
+}
+
+/*
+ * pmem_drain_pm_stores -- wait for any PM stores to drain from HW buffers
+ *
+ * This is the auto version.
+ */
+void
+pmem_drain_pm_stores_auto(void)
+{
+	pmem_drain_pm_stores_cl();
+}
+
+/*
+ * pmem_memmove_persist -- memmove to PM, then make it persistent
+ *
+ * This is the auto version.
+ */
+void *
+pmem_memmove_persist_auto(void *pmemdest, const void *src, size_t len)
+{
+	if (pmem_is_pmem(pmemdest, len))
+		return pmem_memmove_persist_cl(pmemdest, src, len);
+
+	return pmem_memmove_persist_msync(pmemdest, src, len);
+}
+
+/*
+ * pmem_memset_persist -- memset PM, then make it persistent
+ *
+ * This is the auto version.
+ */
+void *
+pmem_memset_persist_auto(void *pmemdest, int c, size_t len)
+{
+	if (pmem_is_pmem(pmemdest, len))
+		return pmem_memset_persist_cl(pmemdest, c, len);
+
+	return pmem_memset_persist_msync(pmemdest, c, len);
+}
@@ -0,0 +1,216 @@
+/*
+ * Copyright (c) 2013, Intel Corporation
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ * 
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ * 
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * pmem_batch.c -- batched persists with cache line deduplication
+ *
+ * A batch collects the ranges passed to pmem_batch_add() and makes them
+ * all persistent at pmem_batch_commit(), with a single fence.  The cache
+ * lines covering each range are recorded in a small open-addressed hash
+ * set, so a line added several times during the batch (a clump header
+ * updated field by field, for example) is only flushed once.
+ *
+ * The batch state is per-thread and batches don't nest.
+ */
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "util/util.h"
+#include "pmem.h"
+#include "pmem_internal.h"
+
+#define	LINE 64			/* granularity of the dedup set */
+#define	SLOTS 256		/* hash set size, must be a power of 2 */
+#define	MAXLINES (SLOTS * 3 / 4)	/* flush early when this full */
+#define	BIGRANGE (MAXLINES / 4)	/* ranges this many lines go direct */
+
+static __thread struct {
+	int active;		/* inside pmem_batch_begin/commit */
+	int nlines;		/* number of lines in the set */
+	uintptr_t lines[MAXLINES];	/* the lines, in insertion order */
+	uintptr_t slots[SLOTS];	/* hash set of lines, zero is empty */
+} Batch;
+
+/*
+ * line_compare -- qsort comparison function for line addresses
+ */
+static int
+line_compare(const void *a, const void *b)
+{
+	uintptr_t la = *(const uintptr_t *)a;
+	uintptr_t lb = *(const uintptr_t *)b;
+
+	if (la < lb)
+		return -1;
+	return la > lb;
+}
+
+/*
+ * batch_runs -- turn the lines in the set into an iovec of contiguous runs
+ *
+ * Empties the set.  Returns the number of entries filled in.
+ */
+static int
+batch_runs(struct iovec *iov)
+{
+	int i;
+	int n = 0;
+
+	qsort(Batch.lines, Batch.nlines, sizeof(uintptr_t), line_compare);
+
+	for (i = 0; i < Batch.nlines; i++) {
+		uintptr_t line = Batch.lines[i];
+
+		if (n && (uintptr_t)iov[n - 1].iov_base +
+				iov[n - 1].iov_len == line)
+			iov[n - 1].iov_len += LINE;
+		else {
+			iov[n].iov_base = (void *)line;
+			iov[n].iov_len = LINE;
+			n++;
+		}
+	}
+
+	memset(Batch.slots, 0, sizeof(Batch.slots));
+	Batch.nlines = 0;
+
+	return n;
+}
+
+/*
+ * batch_spill -- flush everything in the set without a fence
+ */
+static void
+batch_spill(void)
+{
+	struct iovec iov[MAXLINES];
+	int n;
+	int i;
+
+	n = batch_runs(iov);
+	for (i = 0; i < n; i++)
+		pmem_flush_cache(iov[i].iov_base, iov[i].iov_len, 0);
+}
+
+/*
+ * batch_insert -- add a line to the set, return 0 if it was already there
+ */
+static int
+batch_insert(uintptr_t line)
+{
+	unsigned h = (unsigned)(((line / LINE) * 0x9E3779B97F4A7C15ULL) >> 32);
+
+	for (;; h++) {
+		uintptr_t *slot = &Batch.slots[h & (SLOTS - 1)];
+
+		if (*slot == line)
+			return 0;
+		if (*slot == 0) {
+			*slot = line;
+			Batch.lines[Batch.nlines++] = line;
+			return 1;
+		}
+	}
+}
+
+/*
+ * pmem_batch_begin -- start collecting ranges to make persistent
+ */
+void
+pmem_batch_begin(void)
+{
+	if (Batch.active)
+		FATAL("pmem_batch_begin: batch already active");
+
+	Batch.active = 1;
+}
+
+/*
+ * pmem_batch_add -- add a range to the current batch
+ *
+ * Outside of a batch, this is just pmem_persist().  Large ranges are
+ * flushed right away since there's little to gain by tracking their
+ * lines; only the fence is deferred to pmem_batch_commit().
+ */
+void
+pmem_batch_add(void *addr, size_t len)
+{
+	uintptr_t line;
+	uintptr_t end = (uintptr_t)addr + len;
+	void *site;
+
+	/* anything flushed here is charged to our caller */
+	PMEM_STATS_ENTER(site);
+
+	if (!Batch.active)
+		pmem_persist(addr, len, 0);
+	else if (len == 0)
+		;
+	else if ((end - ((uintptr_t)addr & ~(LINE - 1))) / LINE >= BIGRANGE)
+		pmem_flush_cache(addr, len, 0);
+	else {
+		for (line = (uintptr_t)addr & ~(LINE - 1); line < end;
+				line += LINE) {
+			if (Batch.nlines == MAXLINES)
+				batch_spill();
+			batch_insert(line);
+		}
+	}
+
+	PMEM_STATS_LEAVE(site);
+}
+
+/*
+ * pmem_batch_commit -- make everything in the current batch persistent
+ */
+void
+pmem_batch_commit(void)
+{
+	struct iovec iov[MAXLINES];
+	int n;
+	void *site;
+
+	if (!Batch.active)
+		FATAL("pmem_batch_commit: no batch active");
+
+	n = batch_runs(iov);
+	Batch.active = 0;
+
+	/* the fence also covers anything spilled or flushed directly */
+	PMEM_STATS_ENTER(site);
+	pmem_persist_iov(iov, n, 0);
+	PMEM_STATS_LEAVE(site);
+}
@@ -0,0 +1,500 @@
+/*
+ * Copyright (c) 2013, Intel Corporation
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ * 
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ * 
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * pmem_bench.c -- persist latency and bandwidth benchmark for libpmem
+ *
+ * Usage: pmem_bench [-d] [-N] [-m mode] [-s minsize] [-S maxsize]
+ *		[-a aligns] [-t threads] [-o ops] [-n iters] path
+ *
+ * For every combination of operation, range size (powers of two from
+ * minsize to maxsize), alignment and thread count, each thread runs
+ * the operation iters times on its own part of the file at path, and
+ * one line of CSV is printed with the throughput and the 50th, 99th
+ * and 99.9th percentile latencies of a single operation.
+ *
+ * The operations are:
+ *
+ *	persist		dirty the range, then pmem_persist() it
+ *	flush		dirty the range, then pmem_flush_cache(),
+ *			pmem_fence() and pmem_drain_pm_stores()
+ *	memcpy		pmem_memcpy_persist() from a DRAM buffer
+ *	memset		pmem_memset_persist()
+ *
+ * Dirtying the range isn't part of the measured time.  In deferred
+ * msync mode, each operation is followed by pmem_commit().
+ *
+ * The mode is one of cl (the default), auto, msync, deferred, fit, image
+ * or emul (with the emulation parameters taken from the environment).
+ * Flush instruction and non-temporal copy variants are chosen through
+ * the environment (PMEM_NO_CLWB, PMEM_NO_CLFLUSHOPT, PMEM_NO_AVX512F,
+ * PMEM_NO_AVX2), and the flush instruction used is in the output.
+ * "make bench" runs the usual sweep.
+ */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "util/util.h"
+#include "pmem_cpu.h"
+#include "pmem.h"
+
+#define	MAXLIST 32	/* entries in -a, -t and -o lists */
+#define	MAXITERS 10000
+#define	MINITERS 16
+#define	ITERBYTES (256UL << 20)	/* bytes per run when iters is automatic */
+
+char Usage[] = "[-d] [-N] [-m mode] [-s minsize] [-S maxsize] "
+	"[-a aligns] [-t threads] [-o ops] [-n iters] path";	/* for USAGE() */
+
+enum op { OP_PERSIST, OP_FLUSH, OP_MEMCPY, OP_MEMSET };
+static const char *Opnames[] = { "persist", "flush", "memcpy", "memset" };
+
+/*
+ * what one run of the benchmark does
+ */
+struct run {
+	enum op op;
+	size_t size;
+	size_t align;
+	unsigned long iters;
+	int commit;		/* call pmem_commit() after each operation */
+	pthread_barrier_t barrier;
+};
+
+/*
+ * what each thread of a run works with, and what it measures
+ */
+struct thread {
+	pthread_t tid;
+	struct run *rp;
+	char *dest;		/* the thread's part of the file */
+	char *src;		/* DRAM buffer for memcpy */
+	uint64_t *lat;		/* latency of each operation, in ns */
+	uint64_t busy;		/* total time in the operations, in ns */
+};
+
+/*
+ * now -- return a monotonic timestamp in ns
+ */
+static uint64_t
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * worker -- run the operation iters times, timing each one
+ */
+static void *
+worker(void *arg)
+{
+	struct thread *tp = arg;
+	struct run *rp = tp->rp;
+	char *dest = tp->dest + rp->align;
+	unsigned long i;
+	uint64_t start;
+
+	pthread_barrier_wait(&rp->barrier);
+
+	for (i = 0; i < rp->iters; i++) {
+		if (rp->op == OP_PERSIST || rp->op == OP_FLUSH)
+			memset(dest, (int)i, rp->size);
+
+		start = now();
+
+		switch (rp->op) {
+		case OP_PERSIST:
+			pmem_persist(dest, rp->size, 0);
+			break;
+
+		case OP_FLUSH:
+			pmem_flush_cache(dest, rp->size, 0);
+			pmem_fence();
+			pmem_drain_pm_stores();
+			break;
+
+		case OP_MEMCPY:
+			pmem_memcpy_persist(dest, tp->src, rp->size);
+			break;
+
+		case OP_MEMSET:
+			pmem_memset_persist(dest, (int)i, rp->size);
+			break;
+		}
+
+		if (rp->commit)
+			pmem_commit();
+
+		tp->lat[i] = now() - start;
+		tp->busy += tp->lat[i];
+	}
+
+	return NULL;
+}
+
+/*
+ * cmp64 -- qsort comparison for latencies
+ */
+static int
+cmp64(const void *a, const void *b)
+{
+	uint64_t la = *(const uint64_t *)a;
+	uint64_t lb = *(const uint64_t *)b;
+
+	return (la > lb) - (la < lb);
+}
+
+/*
+ * parse_size -- parse a size with an optional k, m or g suffix
+ */
+static size_t
+parse_size(const char *str)
+{
+	char *end;
+	size_t size = strtoul(str, &end, 0);
+
+	switch (*end) {
+	case 'g': case 'G':
+		size <<= 10;
+		/*FALLTHROUGH*/
+	case 'm': case 'M':
+		size <<= 10;
+		/*FALLTHROUGH*/
+	case 'k': case 'K':
+		size <<= 10;
+		end++;
+		break;
+	}
+
+	if (*end != '\0' || end == str)
+		USAGE("bad size: %s", str);
+
+	return size;
+}
+
+/*
+ * parse_list -- parse a comma-separated list of sizes
+ */
+static int
+parse_list(char *str, size_t *list)
+{
+	char *tok;
+	char *save;
+	int n = 0;
+
+	for (tok = strtok_r(str, ",", &save); tok;
+			tok = strtok_r(NULL, ",", &save)) {
+		if (n == MAXLIST)
+			USAGE("too many list entries (max %d)", MAXLIST);
+		list[n++] = parse_size(tok);
+	}
+
+	if (n == 0)
+		USAGE("empty list");
+
+	return n;
+}
+
+/*
+ * flush_name -- return the name of the flush libpmem uses in a mode
+ *
+ * In auto mode, that depends on whether the file is Persistent Memory.
+ */
+static const char *
+flush_name(const char *mode, int is_pmem)
+{
+	if (strcmp(mode, "auto") == 0 && !is_pmem)
+		return "msync";
+
+	if (strcmp(mode, "cl") && strcmp(mode, "emul") &&
+			strcmp(mode, "auto"))
+		return (strcmp(mode, "fit") == 0) ? "pwrite" :
+			(strcmp(mode, "image") == 0) ? "copy" : "msync";
+
+	switch (pmem_cpu_flush_type()) {
+	case PMEM_FLUSH_CLWB:
+		return "clwb";
+	case PMEM_FLUSH_CLFLUSHOPT:
+		return "clflushopt";
+	default:
+		return "clflush";
+	}
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *path;
+	const char *mode = "cl";
+	size_t minsize = 8;
+	size_t maxsize = 64UL << 20;
+	size_t aligns[MAXLIST] = { 0 };
+	size_t nthreads[MAXLIST] = { 1 };
+	enum op ops[MAXLIST] = { OP_PERSIST, OP_FLUSH, OP_MEMCPY, OP_MEMSET };
+	int naligns = 1;
+	int nnthreads = 1;
+	int nops = 4;
+	unsigned long iters = 0;
+	int header = 1;
+	size_t maxalign = 0;
+	size_t maxthreads = 0;
+	size_t stride;
+	struct thread *threads;
+	uint64_t *lats;
+	char *base;
+	int is_pmem;
+	int fd;
+	int opt;
+	int i;
+	int a;
+	int t;
+	int o;
+	size_t size;
+
+	Myname = argv[0];
+	while ((opt = getopt(argc, argv, "dNm:s:S:a:t:o:n:")) != -1) {
+		switch (opt) {
+		case 'd':
+			Debug++;
+			break;
+
+		case 'N':
+			header = 0;
+			break;
+
+		case 'm':
+			mode = optarg;
+			break;
+
+		case 's':
+			minsize = parse_size(optarg);
+			break;
+
+		case 'S':
+			maxsize = parse_size(optarg);
+			break;
+
+		case 'a':
+			naligns = parse_list(optarg, aligns);
+			break;
+
+		case 't':
+			nnthreads = parse_list(optarg, nthreads);
+			break;
+
+		case 'o': {
+			char *tok;
+			char *save;
+
+			nops = 0;
+			for (tok = strtok_r(optarg, ",", &save); tok;
+					tok = strtok_r(NULL, ",", &save)) {
+				for (o = 0; o < 4; o++)
+					if (strcmp(tok, Opnames[o]) == 0)
+						break;
+				if (o == 4)
+					USAGE("unknown operation: %s", tok);
+				if (nops == MAXLIST)
+					USAGE("too many operations");
+				ops[nops++] = o;
+			}
+			break;
+		}
+
+		case 'n':
+			iters = strtoul(optarg, NULL, 0);
+			break;
+
+		default:
+			USAGE(NULL);
+		}
+	}
+
+	if (optind >= argc)
+		USAGE("No path given");
+	path = argv[optind++];
+
+	if (optind < argc)
+		USAGE(NULL);
+
+	if (minsize == 0 || minsize > maxsize)
+		USAGE("bad size range");
+
+	if (strcmp(mode, "cl") == 0)
+		pmem_cl_mode();
+	else if (strcmp(mode, "auto") == 0)
+		pmem_auto_mode();
+	else if (strcmp(mode, "msync") == 0)
+		pmem_msync_mode();
+	else if (strcmp(mode, "deferred") == 0)
+		pmem_msync_deferred_mode();
+	else if (strcmp(mode, "fit") == 0)
+		pmem_fit_mode();
+	else if (strcmp(mode, "image") == 0)
+		pmem_fit_image_mode();
+	else if (strcmp(mode, "emul") == 0)
+		pmem_emul_mode();
+	else
+		USAGE("unknown mode: %s", mode);
+
+	for (a = 0; a < naligns; a++)
+		if (aligns[a] > maxalign)
+			maxalign = aligns[a];
+
+	for (t = 0; t < nnthreads; t++) {
+		if (nthreads[t] == 0)
+			USAGE("thread count must be at least 1");
+		if (nthreads[t] > maxthreads)
+			maxthreads = nthreads[t];
+	}
+
+	if (maxthreads > 1 && strcmp(mode, "image") == 0)
+		FATAL("image mode is single-threaded");
+
+	/* each thread gets its own page-aligned part of the file */
+	stride = (maxsize + maxalign + 4095) & ~4095UL;
+
+	if ((fd = open(path, O_CREAT|O_RDWR, 0666)) < 0)
+		FATALSYS("%s", path);
+
+	if ((errno = posix_fallocate(fd, 0, stride * maxthreads)) != 0)
+		FATALSYS("posix_fallocate");
+
+	if ((base = pmem_map(fd, stride * maxthreads)) == NULL)
+		FATALSYS("pmem_map");
+
+	close(fd);
+	is_pmem = pmem_is_pmem(base, stride * maxthreads);
+
+	if ((threads = calloc(maxthreads, sizeof(*threads))) == NULL)
+		FATALSYS("calloc");
+
+	for (t = 0; t < maxthreads; t++) {
+		threads[t].dest = base + t * stride;
+		if ((threads[t].src = malloc(maxsize)) == NULL ||
+		    (threads[t].lat = malloc(sizeof(uint64_t) *
+				(iters ? iters : MAXITERS))) == NULL)
+			FATALSYS("malloc");
+		memset(threads[t].src, 0x5a, maxsize);
+
+		/* fault the file in so first touch isn't measured */
+		memset(threads[t].dest, 0, stride);
+		pmem_persist(threads[t].dest, stride, 0);
+	}
+
+	if ((lats = malloc(sizeof(uint64_t) * maxthreads *
+				(iters ? iters : MAXITERS))) == NULL)
+		FATALSYS("malloc");
+
+	if (header)
+		printf("mode,flush,op,size,align,threads,iters,"
+				"MB/s,ops/s,p50_ns,p99_ns,p999_ns\n");
+
+	for (o = 0; o < nops; o++)
+	for (size = minsize; size <= maxsize; size *= 2)
+	for (a = 0; a < naligns; a++)
+	for (t = 0; t < nnthreads; t++) {
+		struct run run;
+		int n = nthreads[t];
+		uint64_t busy = 0;
+		unsigned long nlat = 0;
+		double secs;
+
+		run.op = ops[o];
+		run.size = size;
+		run.align = aligns[a];
+		run.commit = strcmp(mode, "deferred") == 0;
+		run.iters = iters;
+		if (run.iters == 0) {
+			run.iters = ITERBYTES / size;
+			if (run.iters > MAXITERS)
+				run.iters = MAXITERS;
+			if (run.iters < MINITERS)
+				run.iters = MINITERS;
+		}
+
+		pthread_barrier_init(&run.barrier, NULL, n);
+
+		for (i = 0; i < n; i++) {
+			threads[i].rp = &run;
+			threads[i].busy = 0;
+			if (i && (errno = pthread_create(&threads[i].tid,
+					NULL, worker, &threads[i])) != 0)
+				FATALSYS("pthread_create");
+		}
+
+		worker(&threads[0]);
+
+		for (i = 0; i < n; i++) {
+			if (i)
+				pthread_join(threads[i].tid, NULL);
+			memcpy(&lats[nlat], threads[i].lat,
+					sizeof(uint64_t) * run.iters);
+			nlat += run.iters;
+			if (threads[i].busy > busy)
+				busy = threads[i].busy;
+		}
+
+		pthread_barrier_destroy(&run.barrier);
+
+		qsort(lats, nlat, sizeof(uint64_t), cmp64);
+
+		/* the slowest thread sets the pace */
+		secs = busy ? busy / 1e9 : 1e-9;
+
+		printf("%s,%s,%s,%zu,%zu,%d,%lu,%.1f,%.0f,%lu,%lu,%lu\n",
+				mode, flush_name(mode, is_pmem),
+				Opnames[run.op],
+				size, run.align, n, run.iters,
+				(double)size * nlat / secs / (1 << 20),
+				nlat / secs,
+				(unsigned long)lats[nlat / 2],
+				(unsigned long)lats[nlat * 99 / 100],
+				(unsigned long)lats[nlat * 999 / 1000]);
+		fflush(stdout);
+	}
+
+	exit(0);
+}
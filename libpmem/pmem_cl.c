@@ -40,10 +40,65 @@
 
 #include <sys/types.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
 
-#define	ALIGN 64	/* assumes 64B cache line size */
+#include "pmem.h"
+#include "pmem_cpu.h"
+#include "pmem_internal.h"
+
+/*
+ * ranges smaller than this are copied with normal stores and flushed,
+ * larger ones use non-temporal stores (see pmem_movnt.c)
+ */
+#define	MOVNT_THRESHOLD 256
+
+/* non-temporal copy/set routines, in pmem_movnt.c */
+void pmem_movnt_sse2(void *dest, const void *src, size_t len);
+void pmem_movnt_avx2(void *dest, const void *src, size_t len);
+void pmem_movnt_avx512f(void *dest, const void *src, size_t len);
+void pmem_movnt_set_sse2(void *dest, int c, size_t len);
+void pmem_movnt_set_avx2(void *dest, int c, size_t len);
+void pmem_movnt_set_avx512f(void *dest, int c, size_t len);
+
+/*
+ * the flush instruction and cache line size are determined at load time
+ */
+static int Flush_type = PMEM_FLUSH_CLFLUSH;
+static uintptr_t Cache_line_size = 64;
+static void (*Movnt)(void *dest, const void *src, size_t len) =
+		pmem_movnt_sse2;
+static void (*Movnt_set)(void *dest, int c, size_t len) =
+		pmem_movnt_set_sse2;
+
+/*
+ * pmem_cl_init -- pick the flush instruction to use on this processor
+ *
+ * Called automatically when the library is loaded.  Like the flush
+ * instructions (see pmem_cpu.h), the wider non-temporal copies can be
+ * turned off for benchmarking by setting PMEM_NO_AVX512F or PMEM_NO_AVX2
+ * in the environment.
+ */
+static void __attribute__((constructor))
+pmem_cl_init(void)
+{
+	Flush_type = pmem_cpu_flush_type();
+	Cache_line_size = pmem_cpu_cache_line();
+
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f") &&
+			getenv("PMEM_NO_AVX512F") == NULL) {
+		Movnt = pmem_movnt_avx512f;
+		Movnt_set = pmem_movnt_set_avx512f;
+	} else if (__builtin_cpu_supports("avx2") &&
+			getenv("PMEM_NO_AVX2") == NULL) {
+		Movnt = pmem_movnt_avx2;
+		Movnt_set = pmem_movnt_set_avx2;
+	}
+}
 
 /*
  * pmem_map -- map the Persistent Memory
@@ -54,17 +109,29 @@
  * This is the cache-line-based version.
  */
 void *
-pmem_map_cl(int fd, size_t len)
+pmem_map_cl(int fd, size_t len, int flags, int *oflagsp)
 {
 	void *base;
 
-	if ((base = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED,
-					fd, 0)) == MAP_FAILED)
+	if ((base = pmem_mmap(fd, len, MAP_SHARED, flags, oflagsp)) == NULL)
 		return NULL;
 
+	pmem_reg_add(base, len);
+
 	return base;
 }
 
+/*
+ * pmem_remap -- map more of the file at the end of a growable mapping
+ *
+ * This is the cache-line-based version.
+ */
+int
+pmem_remap_cl(struct pmem_mapping *mp, size_t newlen)
+{
+	return pmem_mmap_grow(mp, newlen, MAP_SHARED);
+}
+
 /*
  * pmem_drain_pm_stores -- wait for any PM stores to drain from HW buffers
  *
@@ -89,28 +156,201 @@ pmem_drain_pm_stores_cl(void)
 /*
  * pmem_flush_cache -- flush processor cache for the given range
  *
- * This is the cache-line-based version.
+ * This is the cache-line-based version.  With PMEM_F_NONTEMPORAL, the
+ * lines are evicted (CLFLUSHOPT rather than CLWB) since they won't be
+ * read again soon, leaving the cache to data that will.
  */
 void
 pmem_flush_cache_cl(void *addr, size_t len, int flags)
 {
-	uintptr_t uptr;
-	
-	/* loop through 64B-aligned chunks covering the given range */
-	for (uptr = (uintptr_t)addr & ~(ALIGN - 1);
-			uptr < (uintptr_t)addr + len; uptr += 64)
-		__builtin_ia32_clflush((void *)uptr);
+	uintptr_t uptr = (uintptr_t)addr & ~(Cache_line_size - 1);
+	uintptr_t end = (uintptr_t)addr + len;
+	int type = Flush_type;
+
+	/* every processor with CLWB has CLFLUSHOPT too */
+	if ((flags & PMEM_F_NONTEMPORAL) && type == PMEM_FLUSH_CLWB)
+		type = PMEM_FLUSH_CLFLUSHOPT;
+
+	/*
+	 * loop through cache-line-aligned chunks covering the given range.
+	 * the switch is outside the loops so each loop is as tight as
+	 * possible.  only CLFLUSH is serializing, the other two depend
+	 * on the fence issued by the caller.
+	 */
+	switch (type) {
+	case PMEM_FLUSH_CLWB:
+		for (; uptr < end; uptr += Cache_line_size)
+			pmem_clwb((void *)uptr);
+		break;
+
+	case PMEM_FLUSH_CLFLUSHOPT:
+		for (; uptr < end; uptr += Cache_line_size)
+			pmem_clflushopt((void *)uptr);
+		break;
+
+	default:
+		for (; uptr < end; uptr += Cache_line_size)
+			pmem_clflush((void *)uptr);
+		break;
+	}
+}
+
+/*
+ * flush_fenced -- flush a chunk of a large range, see pmem_parallel.c
+ *
+ * Each chunk needs its own fence even with PMEM_F_NOFENCE, since the
+ * caller's fence only orders the flushes done on the caller's core.
+ */
+static void
+flush_fenced(void *addr, size_t len, int flags)
+{
+	pmem_flush_cache_cl(addr, len, flags);
+	__builtin_ia32_sfence();
 }
 
 /*
  * pmem_persist -- make any cached changes to a range of PM persistent
  *
- * This is the cache-line-based version.
+ * This is the cache-line-based version.  Very large ranges are flushed
+ * by several threads at once.  PMEM_F_NOFENCE leaves out the fence and
+ * PMEM_F_NODRAIN the drain, for the caller to do later.
  */
 void
 pmem_persist_cl(void *addr, size_t len, int flags)
 {
-	pmem_flush_cache_cl(addr, len, flags);
+	if (!Pmem_parallel_min || len < Pmem_parallel_min ||
+			pmem_parallel(flush_fenced, addr, len, flags) < 0)
+		pmem_flush_cache_cl(addr, len, flags);
+
+	if (flags & PMEM_F_NOFENCE)
+		return;
+
+	/* the fence also orders CLFLUSHOPT and CLWB, if they were used */
+	__builtin_ia32_sfence();
+	if (!(flags & PMEM_F_NODRAIN))
+		pmem_drain_pm_stores_cl();
+}
+
+/*
+ * pmem_persist_iov -- make several discontiguous ranges persistent
+ *
+ * This is the cache-line-based version.  Each cache line covered by
+ * the vector is flushed once, followed by a single fence and drain.
+ */
+void
+pmem_persist_iov_cl(const struct iovec *iov, int iovcnt, int flags)
+{
+	struct pmem_range stackbuf[PMEM_IOV_STACK];
+	struct pmem_range *r;
+	int n;
+	int i;
+
+	r = pmem_iov_merge(iov, iovcnt, Cache_line_size, stackbuf, &n);
+
+	for (i = 0; i < n; i++)
+		pmem_flush_cache_cl((void *)r[i].start,
+				r[i].end - r[i].start, flags);
+
+	if (r != stackbuf)
+		free(r);
+
+	if (flags & PMEM_F_NOFENCE)
+		return;
+
+	__builtin_ia32_sfence();
+	if (!(flags & PMEM_F_NODRAIN))
+		pmem_drain_pm_stores_cl();
+}
+
+/*
+ * pmem_memmove_persist -- memmove to PM and make the result persistent
+ *
+ * This is the cache-line-based version.  Small or overlapping copies
+ * are done with memmove() followed by a flush.  Otherwise the unaligned
+ * head and tail are copied and flushed the same way, and the 64B-aligned
+ * middle is copied with non-temporal stores.
+ */
+void *
+pmem_memmove_persist_cl(void *pmemdest, const void *src, size_t len)
+{
+	char *dest = pmemdest;
+	const char *s = src;
+	size_t head;
+	size_t body;
+
+	if (len < MOVNT_THRESHOLD ||
+	    (dest < s + len && s < dest + len)) {
+		memmove(dest, s, len);
+		pmem_persist_cl(dest, len, 0);
+		return pmemdest;
+	}
+
+	head = -(uintptr_t)dest & 63;
+	if (head) {
+		memcpy(dest, s, head);
+		pmem_flush_cache_cl(dest, head, 0);
+		dest += head;
+		s += head;
+		len -= head;
+	}
+
+	body = len & ~(size_t)63;
+	(*Movnt)(dest, s, body);
+	dest += body;
+	s += body;
+	len -= body;
+
+	if (len) {
+		memcpy(dest, s, len);
+		pmem_flush_cache_cl(dest, len, 0);
+	}
+
+	/* orders the non-temporal stores as well as the flushes */
+	__builtin_ia32_sfence();
+	pmem_drain_pm_stores_cl();
+
+	return pmemdest;
+}
+
+/*
+ * pmem_memset_persist -- memset PM and make the result persistent
+ *
+ * This is the cache-line-based version.  Uses the same strategy as
+ * pmem_memmove_persist_cl() above.
+ */
+void *
+pmem_memset_persist_cl(void *pmemdest, int c, size_t len)
+{
+	char *dest = pmemdest;
+	size_t head;
+	size_t body;
+
+	if (len < MOVNT_THRESHOLD) {
+		memset(dest, c, len);
+		pmem_persist_cl(dest, len, 0);
+		return pmemdest;
+	}
+
+	head = -(uintptr_t)dest & 63;
+	if (head) {
+		memset(dest, c, head);
+		pmem_flush_cache_cl(dest, head, 0);
+		dest += head;
+		len -= head;
+	}
+
+	body = len & ~(size_t)63;
+	(*Movnt_set)(dest, c, body);
+	dest += body;
+	len -= body;
+
+	if (len) {
+		memset(dest, c, len);
+		pmem_flush_cache_cl(dest, len, 0);
+	}
+
 	__builtin_ia32_sfence();
 	pmem_drain_pm_stores_cl();
+
+	return pmemdest;
 }
@@ -0,0 +1,139 @@
+/*
+ * Copyright (c) 2013, Intel Corporation
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ * 
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ * 
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * pmem_cpu.h -- CPU feature detection and cache flush instructions
+ *
+ * This is internal to libpmem and pmem_inline.h.  It figures out which
+ * of the x86 cache flush instructions the processor supports, and the
+ * size of the cache line those instructions operate on, using CPUID.
+ *
+ * CLFLUSH is serializing: each one waits for the previous one to
+ * complete.  CLFLUSHOPT and CLWB are only ordered by a fence, so a
+ * loop of them over a large range runs much faster.  CLWB has the added
+ * benefit of not evicting the line from the cache.
+ *
+ * The CLFLUSHOPT and CLWB instructions are emitted using their byte
+ * encodings, since older assemblers don't know about them.
+ *
+ * For benchmarking, setting PMEM_NO_CLWB or PMEM_NO_CLFLUSHOPT in the
+ * environment keeps the corresponding instruction from being used.
+ */
+
+#include <stdlib.h>
+#include <cpuid.h>
+
+#define	PMEM_FLUSH_CLFLUSH 0	/* serializing CLFLUSH */
+#define	PMEM_FLUSH_CLFLUSHOPT 1	/* weakly-ordered CLFLUSHOPT */
+#define	PMEM_FLUSH_CLWB 2	/* weakly-ordered, non-evicting CLWB */
+
+#define	PMEM_CPUID_CLFLUSHOPT (1 << 23)	/* leaf 7, ebx */
+#define	PMEM_CPUID_CLWB (1 << 24)	/* leaf 7, ebx */
+
+/*
+ * pmem_clflush -- flush a cache line using CLFLUSH
+ */
+static inline void
+pmem_clflush(const void *addr)
+{
+	__builtin_ia32_clflush(addr);
+}
+
+/*
+ * pmem_clflushopt -- flush a cache line using CLFLUSHOPT
+ */
+static inline void
+pmem_clflushopt(const void *addr)
+{
+	__asm__ volatile(".byte 0x66; clflush %0"
+			: "+m" (*(volatile char *)addr));
+}
+
+/*
+ * pmem_clwb -- write back a cache line using CLWB
+ */
+static inline void
+pmem_clwb(const void *addr)
+{
+	__asm__ volatile(".byte 0x66; xsaveopt %0"
+			: "+m" (*(volatile char *)addr));
+}
+
+/*
+ * pmem_cpu_flush_type -- return the best flush instruction available
+ */
+static inline int
+pmem_cpu_flush_type(void)
+{
+	unsigned eax, ebx, ecx, edx;
+
+	if (__get_cpuid_max(0, NULL) < 7)
+		return PMEM_FLUSH_CLFLUSH;
+
+	__cpuid_count(7, 0, eax, ebx, ecx, edx);
+
+	if (getenv("PMEM_NO_CLWB") != NULL)
+		ebx &= ~PMEM_CPUID_CLWB;
+	if (getenv("PMEM_NO_CLFLUSHOPT") != NULL)
+		ebx &= ~PMEM_CPUID_CLFLUSHOPT;
+
+	if (ebx & PMEM_CPUID_CLWB)
+		return PMEM_FLUSH_CLWB;
+	if (ebx & PMEM_CPUID_CLFLUSHOPT)
+		return PMEM_FLUSH_CLFLUSHOPT;
+
+	return PMEM_FLUSH_CLFLUSH;
+}
+
+/*
+ * pmem_cpu_cache_line -- return the cache line size used by the flushes
+ *
+ * CPUID leaf 1 reports the CLFLUSH line size in 8-byte units.  If the
+ * value looks bogus, fall back to the traditional 64 bytes.
+ */
+static inline unsigned
+pmem_cpu_cache_line(void)
+{
+	unsigned eax, ebx, ecx, edx;
+	unsigned size;
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+		return 64;
+
+	size = ((ebx >> 8) & 0xff) * 8;
+
+	/* must be a non-zero power of two */
+	if (size == 0 || (size & (size - 1)))
+		return 64;
+
+	return size;
+}
@@ -0,0 +1,365 @@
+/*
+ * Copyright (c) 2013, Intel Corporation
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ * 
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ * 
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * pmem_deferred.c -- deferred msync implementation of libpmem
+ *
+ * This is a variation of msync mode (see pmem_msync.c) for use on
+ * normal memory-mapped files where a synchronous msync() per call to
+ * pmem_persist() is just too slow.  Instead of calling msync(),
+ * pmem_persist() records the pages covering the range in a sorted set
+ * of dirty intervals, merging adjacent and overlapping ranges as it goes.
+ * Nothing is made durable until the program calls pmem_commit(), which
+ * syncs each interval with a single msync() call.
+ *
+ * WARNING: the kernel is free to write back any subset of the dirty
+ * pages at any time, in any order, so a crash between commits can
+ * leave the file in neither the last committed state nor the current
+ * one.  Nothing is crash consistent in this mode except the file as of
+ * a pmem_commit() that returned with no stores to it since.  Code that
+ * relies on the order of pmem_persist() calls for crash consistency
+ * (like libpmemalloc) can be left corrupted by a crash, so this mode
+ * must not be used with it.
+ *
+ * An optional group commit window can be set with pmem_group_commit().
+ * When set, the thread that ends up doing the msync() calls waits for
+ * the window first, so commits arriving from other threads meanwhile
+ * are all handled by the same set of msync() calls.
+ */
+
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "util/util.h"
+#include "pmem_internal.h"
+
+#define	ALIGN 4096	/* assumes 4k page size for use with msync() */
+
+/*
+ * a set of dirty intervals, sorted by address, none touching another
+ */
+struct dirty_set {
+	struct pmem_range *r;
+	int n;
+	int max;
+};
+
+static pthread_mutex_t Lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t Done = PTHREAD_COND_INITIALIZER;
+static struct dirty_set Dirty;		/* protected by Lock */
+static struct dirty_set Syncing;	/* owned by the syncing thread */
+static int Syncer;			/* a thread is doing msyncs */
+static unsigned long Gen_started;	/* sets handed to a syncer */
+static unsigned long Gen_done;		/* sets fully synced */
+static unsigned Window_usec;		/* group commit window */
+
+/*
+ * dirty_insert -- add a page-aligned range to the dirty set
+ *
+ * Called with Lock held.
+ */
+static void
+dirty_insert(uintptr_t start, uintptr_t end)
+{
+	struct pmem_range *r;
+	int lo = 0;
+	int hi = Dirty.n;
+	int i;
+
+	/* find the first interval that ends at or after start */
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+
+		if (Dirty.r[mid].end < start)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	/* absorb every interval that overlaps or touches [start, end) */
+	for (i = lo; i < Dirty.n && Dirty.r[i].start <= end; i++) {
+		if (Dirty.r[i].start < start)
+			start = Dirty.r[i].start;
+		if (Dirty.r[i].end > end)
+			end = Dirty.r[i].end;
+	}
+
+	if (i - lo == 1) {
+		/* common case: grew a single interval in place */
+		Dirty.r[lo].start = start;
+		Dirty.r[lo].end = end;
+		return;
+	}
+
+	if (i == lo && Dirty.n == Dirty.max) {
+		Dirty.max = Dirty.max ? Dirty.max * 2 : 64;
+		if ((r = realloc(Dirty.r, sizeof(*r) * Dirty.max)) == NULL)
+			FATALSYS("realloc");
+		Dirty.r = r;
+	}
+
+	/* replace entries lo..i-1 with the single merged interval */
+	memmove(&Dirty.r[lo + 1], &Dirty.r[i],
+			sizeof(*Dirty.r) * (Dirty.n - i));
+	Dirty.n -= i - lo - 1;
+	Dirty.r[lo].start = start;
+	Dirty.r[lo].end = end;
+}
+
+/*
+ * record -- add the pages covering the given range to the dirty set
+ */
+static void
+record(void *addr, size_t len)
+{
+	uintptr_t start = (uintptr_t)addr & ~(ALIGN - 1);
+	uintptr_t end = ((uintptr_t)addr + len + ALIGN - 1) & ~(ALIGN - 1);
+
+	if (len == 0)
+		return;
+
+	pthread_mutex_lock(&Lock);
+	dirty_insert(start, end);
+	pthread_mutex_unlock(&Lock);
+}
+
+/*
+ * pmem_group_commit -- set the group commit window, in microseconds
+ *
+ * Zero (the default) turns group commit off.
+ */
+void
+pmem_group_commit(unsigned usec)
+{
+	pthread_mutex_lock(&Lock);
+	Window_usec = usec;
+	pthread_mutex_unlock(&Lock);
+}
+
+/*
+ * pmem_map -- map the Persistent Memory
+ *
+ * This is the deferred msync version, which maps things exactly the
+ * same way as msync mode.
+ */
+void *
+pmem_map_deferred(int fd, size_t len, int flags, int *oflagsp)
+{
+	void *base;
+
+	if ((base = pmem_mmap(fd, len, MAP_SHARED, flags, oflagsp)) == NULL)
+		return NULL;
+
+	pmem_reg_add(base, len);
+
+	return base;
+}
+
+/*
+ * pmem_drain_pm_stores -- wait for any PM stores to drain from HW buffers
+ *
+ * This is the deferred msync version.
+ */
+void
+pmem_drain_pm_stores_deferred(void)
+{
+	/*
+	 * Nothing to do here for the deferred msync version.
+	 */
+}
+
+/*
+ * pmem_flush_cache -- flush processor cache for the given range
+ *
+ * This is the deferred msync version.  The range is only recorded,
+ * it gets synced by the next pmem_commit().
+ */
+void
+pmem_flush_cache_deferred(void *addr, size_t len, int flags)
+{
+	record(addr, len);
+}
+
+/*
+ * pmem_persist -- make any cached changes to a range of PM persistent
+ *
+ * This is the deferred msync version.  The range is only recorded,
+ * it gets synced by the next pmem_commit().
+ */
+void
+pmem_persist_deferred(void *addr, size_t len, int flags)
+{
+	record(addr, len);
+}
+
+/*
+ * pmem_persist_iov -- make several discontiguous ranges persistent
+ *
+ * This is the deferred msync version.
+ */
+void
+pmem_persist_iov_deferred(const struct iovec *iov, int iovcnt, int flags)
+{
+	int i;
+
+	pthread_mutex_lock(&Lock);
+	for (i = 0; i < iovcnt; i++) {
+		uintptr_t start = (uintptr_t)iov[i].iov_base;
+
+		if (iov[i].iov_len == 0)
+			continue;
+
+		dirty_insert(start & ~(ALIGN - 1),
+				(start + iov[i].iov_len + ALIGN - 1) &
+				~(ALIGN - 1));
+	}
+	pthread_mutex_unlock(&Lock);
+}
+
+/*
+ * pmem_memmove_persist -- memmove to PM and make the result persistent
+ *
+ * This is the deferred msync version.
+ */
+void *
+pmem_memmove_persist_deferred(void *pmemdest, const void *src, size_t len)
+{
+	memmove(pmemdest, src, len);
+	record(pmemdest, len);
+	return pmemdest;
+}
+
+/*
+ * pmem_memset_persist -- memset PM and make the result persistent
+ *
+ * This is the deferred msync version.
+ */
+void *
+pmem_memset_persist_deferred(void *pmemdest, int c, size_t len)
+{
+	memset(pmemdest, c, len);
+	record(pmemdest, len);
+	return pmemdest;
+}
+
+/*
+ * pmem_commit -- make everything recorded so far durable
+ *
+ * This is the deferred msync version.  One thread at a time (the
+ * "syncer") takes the whole dirty set and msyncs it, with the lock
+ * dropped so other threads can keep recording.  Each set handed to a
+ * syncer gets a generation number, and a commit returns once the
+ * generation holding everything this thread recorded is done.
+ */
+void
+pmem_commit_deferred(void)
+{
+	unsigned long target;
+
+	pthread_mutex_lock(&Lock);
+
+	/*
+	 * anything this thread recorded is either still in Dirty (and
+	 * will be in the next generation) or was taken by a syncer that
+	 * may still be working on it.
+	 */
+	target = Dirty.n ? Gen_started + 1 : Gen_started;
+
+	while (Gen_done < target) {
+		struct dirty_set tmp;
+		unsigned long gen;
+		int i;
+
+		if (Syncer) {
+			pthread_cond_wait(&Done, &Lock);
+			continue;
+		}
+
+		Syncer = 1;
+
+		if (Window_usec) {
+			struct timespec ts;
+
+			ts.tv_sec = Window_usec / 1000000;
+			ts.tv_nsec = (Window_usec % 1000000) * 1000;
+
+			pthread_mutex_unlock(&Lock);
+			nanosleep(&ts, NULL);
+			pthread_mutex_lock(&Lock);
+		}
+
+		/* swap the (empty) spare set in for the dirty one */
+		tmp = Syncing;
+		Syncing = Dirty;
+		Dirty = tmp;
+		Dirty.n = 0;
+		gen = ++Gen_started;
+
+		pthread_mutex_unlock(&Lock);
+
+		for (i = 0; i < Syncing.n; i++) {
+			if (msync((void *)Syncing.r[i].start,
+					Syncing.r[i].end - Syncing.r[i].start,
+					MS_SYNC) < 0)
+				FATALSYS("msync");
+			pmem_stats_msync();
+		}
+
+		pthread_mutex_lock(&Lock);
+
+		Syncing.n = 0;
+		Gen_done = gen;
+		Syncer = 0;
+		pthread_cond_broadcast(&Done);
+	}
+
+	pthread_mutex_unlock(&Lock);
+}
+
+/*
+ * pmem_unmap_deferred -- commit what's been persisted before unmapping
+ *
+ * The dirty set may hold ranges of the mapping that's going away, and
+ * they have to be synced while the mapping is still there.
+ */
+void
+pmem_unmap_deferred(struct pmem_mapping *mp)
+{
+	pmem_commit_deferred();
+}
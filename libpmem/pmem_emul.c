@@ -0,0 +1,280 @@
+/*
+ * Copyright (c) 2013, Intel Corporation
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ * 
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ * 
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * pmem_emul.c -- emulated Persistent Memory implementation of libpmem
+ *
+ * For developing on machines where the "Persistent Memory" is really
+ * DRAM (or tmpfs).  This version does everything the cache-line-based
+ * version does, and then waits as long as real Persistent Memory would
+ * make it wait, so programs and benchmarks run at something like the
+ * speed they'd run at on the real thing.  Nothing here makes anything
+ * more durable, of course.
+ *
+ * The model is simple:
+ *
+ *	- each line flushed costs PMEM_EMUL_WRITE_NS nanoseconds,
+ *	  paid by the thread at its next fence, since that's where a
+ *	  thread waits for its flushes to complete
+ *
+ *	- each fence costs another PMEM_EMUL_FENCE_NS nanoseconds
+ *
+ *	- the lines flushed by all threads together go through a
+ *	  token bucket that lets PMEM_EMUL_BANDWIDTH megabytes per
+ *	  second through, with bursts of up to PMEM_EMUL_BURST bytes,
+ *	  and a flush waits right there when the bucket is empty
+ *
+ * The parameters are read from the environment when the library is
+ * loaded.  The defaults are rough figures for a single first generation
+ * Optane module, see LIBPMEM_API.txt.  All the waiting is done by spinning,
+ * since the delays are much too short to sleep for.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "util/util.h"
+#include "pmem.h"
+#include "pmem_internal.h"
+
+#define	ALIGN 64	/* lines are charged in 64B units */
+
+/* the real work is done by the cache-line-based version */
+void pmem_flush_cache_cl(void *addr, size_t len, int flags);
+void pmem_drain_pm_stores_cl(void);
+
+static unsigned long Write_ns = 25;	/* per line flushed */
+static unsigned long Fence_ns = 300;	/* per fence */
+static unsigned long Bandwidth = 2000;	/* MB/s, 0 for unlimited */
+static unsigned long Burst = 16384;	/* bytes let through at once */
+
+static __thread unsigned long Owed;	/* ns owed for flushes since fence */
+static uint64_t Tat;			/* token bucket, see throttle() */
+
+/*
+ * getparam -- set *valp from the environment variable name, if it's set
+ */
+static void
+getparam(const char *name, unsigned long *valp)
+{
+	const char *val;
+	char *end;
+	unsigned long v;
+
+	if ((val = getenv(name)) == NULL)
+		return;
+
+	v = strtoul(val, &end, 0);
+	if (end == val || *end != '\0')
+		FATAL("%s: bad value \"%s\"", name, val);
+
+	*valp = v;
+}
+
+/*
+ * pmem_emul_init -- read the emulation parameters from the environment
+ */
+static void __attribute__((constructor))
+pmem_emul_init(void)
+{
+	getparam("PMEM_EMUL_WRITE_NS", &Write_ns);
+	getparam("PMEM_EMUL_FENCE_NS", &Fence_ns);
+	getparam("PMEM_EMUL_BANDWIDTH", &Bandwidth);
+	getparam("PMEM_EMUL_BURST", &Burst);
+}
+
+/*
+ * now -- return the time in nanoseconds
+ */
+static uint64_t
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * spin_until -- wait until the given time
+ */
+static void
+spin_until(uint64_t t)
+{
+	while (now() < t)
+		__builtin_ia32_pause();
+}
+
+/*
+ * throttle -- wait until the token bucket lets len bytes through
+ *
+ * The bucket is kept as the time it would next be empty if nobody
+ * waited (the generic cell rate algorithm), so letting bytes through
+ * is a single compare-and-swap, with no refill bookkeeping.  A flush
+ * waits until that time is no more than a burst ahead of now.
+ */
+static void
+throttle(size_t len)
+{
+	uint64_t cost = len * 1000 / Bandwidth;
+	uint64_t burst = Burst * 1000 / Bandwidth;
+	uint64_t t = now();
+	uint64_t old = __atomic_load_n(&Tat, __ATOMIC_RELAXED);
+	uint64_t tat;
+
+	do
+		tat = ((old > t) ? old : t) + cost;
+	while (!__atomic_compare_exchange_n(&Tat, &old, tat, 1,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	if (tat > t + burst)
+		spin_until(tat - burst);
+}
+
+/*
+ * pmem_drain_pm_stores -- wait for any PM stores to drain from HW buffers
+ *
+ * This is the emulated version.
+ */
+void
+pmem_drain_pm_stores_emul(void)
+{
+	pmem_drain_pm_stores_cl();
+}
+
+/*
+ * pmem_flush_cache -- flush processor cache for the given range
+ *
+ * This is the emulated version.
+ */
+void
+pmem_flush_cache_emul(void *addr, size_t len, int flags)
+{
+	uintptr_t start = (uintptr_t)addr & ~(ALIGN - 1);
+	size_t nlines = ((uintptr_t)addr + len - start + ALIGN - 1) / ALIGN;
+
+	pmem_flush_cache_cl(addr, len, flags);
+
+	Owed += nlines * Write_ns;
+	if (Bandwidth)
+		throttle(nlines * ALIGN);
+}
+
+/*
+ * pmem_fence_emul -- fence, and wait for the flushes since the last one
+ */
+void
+pmem_fence_emul(void)
+{
+	__builtin_ia32_sfence();
+
+	spin_until(now() + Owed + Fence_ns);
+	Owed = 0;
+}
+
+/*
+ * pmem_persist -- make any cached changes to a range of PM persistent
+ *
+ * This is the emulated version.
+ */
+void
+pmem_persist_emul(void *addr, size_t len, int flags)
+{
+	pmem_flush_cache_emul(addr, len, flags);
+	if (flags & PMEM_F_NOFENCE)
+		return;		/* what's owed is paid at the next fence */
+	pmem_fence_emul();
+	if (!(flags & PMEM_F_NODRAIN))
+		pmem_drain_pm_stores_emul();
+}
+
+/*
+ * pmem_persist_iov -- make several discontiguous ranges persistent
+ *
+ * This is the emulated version.  Like the cache-line-based version,
+ * each line covered by the vector is flushed (and charged) once.
+ */
+void
+pmem_persist_iov_emul(const struct iovec *iov, int iovcnt, int flags)
+{
+	struct pmem_range stackbuf[PMEM_IOV_STACK];
+	struct pmem_range *r;
+	int n;
+	int i;
+
+	r = pmem_iov_merge(iov, iovcnt, ALIGN, stackbuf, &n);
+
+	for (i = 0; i < n; i++)
+		pmem_flush_cache_emul((void *)r[i].start,
+				r[i].end - r[i].start, flags);
+
+	if (r != stackbuf)
+		free(r);
+
+	if (flags & PMEM_F_NOFENCE)
+		return;
+	pmem_fence_emul();
+	if (!(flags & PMEM_F_NODRAIN))
+		pmem_drain_pm_stores_emul();
+}
+
+/*
+ * pmem_memmove_persist -- memmove to PM and make the result persistent
+ *
+ * This is the emulated version.
+ */
+void *
+pmem_memmove_persist_emul(void *pmemdest, const void *src, size_t len)
+{
+	memmove(pmemdest, src, len);
+	pmem_persist_emul(pmemdest, len, 0);
+	return pmemdest;
+}
+
+/*
+ * pmem_memset_persist -- memset PM and make the result persistent
+ *
+ * This is the emulated version.
+ */
+void *
+pmem_memset_persist_emul(void *pmemdest, int c, size_t len)
+{
+	memset(pmemdest, c, len);
+	pmem_persist_emul(pmemdest, len, 0);
+	return pmemdest;
+}
@@ -42,15 +42,47 @@
 
 #include <sys/types.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#include <pthread.h>
 
 #include "util/util.h"
+#include "pmem.h"
+#include "pmem_internal.h"
 
 #define	ALIGN 64	/* assumes 64B cache line size */
 
-static int PM_fd;
-static uintptr_t PM_base;
+/*
+ * Flushed ranges aren't written to the file until the next fence, as
+ * the hardware doesn't promise anything before then either, so a crash
+ * between a flush (or a persist with PMEM_F_NOFENCE) and the fence
+ * loses it.  What gets written is the contents at flush time: stores
+ * made after the flush weren't flushed.
+ *
+ * A fence only orders the flushes made by its own thread, so each
+ * thread keeps its own pending ranges, and a fence writes only those.
+ */
+struct pending {
+	struct pmem_mapping *mp;
+	uintptr_t off;		/* offset of the range in the file */
+	size_t len;
+	size_t data;		/* offset of the contents in Data */
+};
+
+static __thread struct pending *Pending;
+static __thread size_t Npending;
+static __thread size_t Maxpending;
+static __thread char *Data;
+static __thread size_t Ndata;
+static __thread size_t Maxdata;
+
+static pthread_once_t Once = PTHREAD_ONCE_INIT;
+static pthread_key_t Key;	/* set once a thread has pending buffers */
+static void make_key(void);
 
 /*
  * pmem_map -- map the Persistent Memory
@@ -58,20 +90,49 @@ static uintptr_t PM_base;
  * This is the fit version (fault injection test) that uses copy-on-write.
  */
 void *
-pmem_map_fit(int fd, size_t len)
+pmem_map_fit(int fd, size_t len, int flags, int *oflagsp)
 {
 	void *base;
 
-	if ((base = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_PRIVATE,
-					fd, 0)) == MAP_FAILED)
+	if ((base = pmem_mmap(fd, len, MAP_PRIVATE, flags, oflagsp)) == NULL)
 		return NULL;
 
-	PM_base = (uintptr_t)base;
-	PM_fd = dup(fd);
+	if ((pmem_reg_add(base, len)->fd = dup(fd)) < 0)
+		FATALSYS("dup");
 
 	return base;
 }
 
+/*
+ * pmem_unmap_fit -- drop a mapping's flushes still waiting for a fence
+ *
+ * Only the calling thread's flushes are dropped, so other threads must
+ * fence their flushes to a mapping before it's unmapped, just as they
+ * must stop using it.
+ */
+void
+pmem_unmap_fit(struct pmem_mapping *mp)
+{
+	size_t i;
+	size_t j;
+
+	for (i = j = 0; i < Npending; i++)
+		if (Pending[i].mp != mp)
+			Pending[j++] = Pending[i];
+	Npending = j;
+}
+
+/*
+ * pmem_remap -- map more of the file at the end of a growable mapping
+ *
+ * This is the fit version (fault injection test) that uses copy-on-write.
+ */
+int
+pmem_remap_fit(struct pmem_mapping *mp, size_t newlen)
+{
+	return pmem_mmap_grow(mp, newlen, MAP_PRIVATE);
+}
+
 /*
  * pmem_drain_pm_stores -- wait for any PM stores to drain from HW buffers
  *
@@ -93,21 +154,109 @@ pmem_drain_pm_stores_fit(void)
 void
 pmem_flush_cache_fit(void *addr, size_t len, int flags)
 {
+	struct pmem_mapping *mp;
+	struct pending *pp;
 	uintptr_t uptr;
+	uintptr_t end;
+
+	if (len == 0)
+		return;
 
-	if (!PM_base)
-		FATAL("pmem_map hasn't been called");
+	if ((mp = pmem_reg_find(addr)) == NULL)
+		FATAL("%p is not in a pmem mapping", addr);
 
 	/*
 	 * even though pwrite() can take any random byte addresses and
 	 * lengths, we simulate cache flushing by writing the full 64B
-	 * chunks that cover the given range.
+	 * chunks that cover the given range.  The chunks are contiguous,
+	 * so they all go in one pwrite() at fence time instead of one
+	 * system call per chunk.
 	 */
-	for (uptr = (uintptr_t)addr & ~(ALIGN - 1);
-			uptr < (uintptr_t)addr + len; uptr += ALIGN)
-		if (pwrite(PM_fd, (void *)uptr, ALIGN, uptr - PM_base) < 0)
-			FATALSYS("pwrite len %d offset %lu", len,
-					addr - PM_base);
+	uptr = (uintptr_t)addr & ~(ALIGN - 1);
+	end = ((uintptr_t)addr + len + ALIGN - 1) & ~(ALIGN - 1);
+
+	if (Pending == NULL) {
+		pthread_once(&Once, make_key);
+		if ((errno = pthread_setspecific(Key, &Key)) != 0)
+			FATALSYS("pthread_setspecific");
+	}
+	if (Npending == Maxpending) {
+		Maxpending = Maxpending ? Maxpending * 2 : 64;
+		if ((Pending = realloc(Pending,
+				sizeof(*Pending) * Maxpending)) == NULL)
+			FATALSYS("realloc");
+	}
+	while (Ndata + (end - uptr) > Maxdata) {
+		Maxdata = Maxdata ? Maxdata * 2 : 64 * 1024;
+		if ((Data = realloc(Data, Maxdata)) == NULL)
+			FATALSYS("realloc");
+	}
+
+	pp = &Pending[Npending++];
+	pp->mp = mp;
+	pp->off = uptr - mp->start;
+	pp->len = end - uptr;
+	pp->data = Ndata;
+	memcpy(Data + Ndata, (void *)uptr, end - uptr);
+	Ndata += end - uptr;
+}
+
+/*
+ * pmem_fence -- write the ranges flushed since the last fence
+ *
+ * This is the fit version (fault injection test) that uses copy-on-write.
+ * Only the calling thread's flushes are written, in the order they were
+ * made, so a later flush of the same line wins.
+ */
+void
+pmem_fence_fit(void)
+{
+	size_t i;
+
+	for (i = 0; i < Npending; i++) {
+		struct pending *pp = &Pending[i];
+		size_t done;
+		ssize_t n;
+
+		for (done = 0; done < pp->len; done += n)
+			if ((n = pwrite(pp->mp->fd, Data + pp->data + done,
+					pp->len - done, pp->off + done)) < 0)
+				FATALSYS("pwrite len %zu offset %lu",
+						pp->len - done,
+						pp->off + done);
+	}
+
+	Npending = 0;
+	Ndata = 0;
+}
+
+/*
+ * thread_exit -- write and free an exiting thread's pending ranges
+ *
+ * Internal support routine.  The flushes a thread made still reach
+ * the file after it exits, as they would on real hardware.
+ */
+static void
+thread_exit(void *arg)
+{
+	pmem_fence_fit();
+	free(Pending);
+	free(Data);
+	Pending = NULL;
+	Data = NULL;
+	Maxpending = Maxdata = 0;
+}
+
+/*
+ * make_key -- create the key that frees the pending buffers at exit
+ *
+ * Internal support routine.
+ */
+static void
+make_key(void)
+{
+	if ((errno = pthread_key_create(&Key, thread_exit)) != 0)
+		FATALSYS("pthread_key_create");
 }
 
 /*
@@ -119,6 +268,68 @@ void
 pmem_persist_fit(void *addr, size_t len, int flags)
 {
 	pmem_flush_cache_fit(addr, len, flags);
-	__builtin_ia32_sfence();
-	pmem_drain_pm_stores_fit();
+	if (flags & PMEM_F_NOFENCE)
+		return;		/* written by the next fence */
+	pmem_fence_fit();
+	if (!(flags & PMEM_F_NODRAIN))
+		pmem_drain_pm_stores_fit();
+}
+
+/*
+ * pmem_persist_iov -- make several discontiguous ranges persistent
+ *
+ * This is the fit version (fault injection test) that uses copy-on-write.
+ * Each 64B chunk covered by the vector is written once, with one
+ * pwrite() per run of contiguous chunks.  (pwritev() can't help here,
+ * it writes its buffers to consecutive file offsets, and the merged
+ * runs are never consecutive.)
+ */
+void
+pmem_persist_iov_fit(const struct iovec *iov, int iovcnt, int flags)
+{
+	struct pmem_range stackbuf[PMEM_IOV_STACK];
+	struct pmem_range *r;
+	int n;
+	int i;
+
+	r = pmem_iov_merge(iov, iovcnt, ALIGN, stackbuf, &n);
+
+	for (i = 0; i < n; i++)
+		pmem_flush_cache_fit((void *)r[i].start,
+				r[i].end - r[i].start, flags);
+
+	if (r != stackbuf)
+		free(r);
+
+	if (flags & PMEM_F_NOFENCE)
+		return;
+	pmem_fence_fit();
+	if (!(flags & PMEM_F_NODRAIN))
+		pmem_drain_pm_stores_fit();
+}
+
+/*
+ * pmem_memmove_persist -- memmove to PM and make the result persistent
+ *
+ * This is the fit version (fault injection test) that uses copy-on-write version.
+ */
+void *
+pmem_memmove_persist_fit(void *pmemdest, const void *src, size_t len)
+{
+	memmove(pmemdest, src, len);
+	pmem_persist_fit(pmemdest, len, 0);
+	return pmemdest;
+}
+
+/*
+ * pmem_memset_persist -- memset PM and make the result persistent
+ *
+ * This is the fit version (fault injection test) that uses copy-on-write version.
+ */
+void *
+pmem_memset_persist_fit(void *pmemdest, int c, size_t len)
+{
+	memset(pmemdest, c, len);
+	pmem_persist_fit(pmemdest, len, 0);
+	return pmemdest;
 }
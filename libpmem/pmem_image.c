@@ -0,0 +1,583 @@
+/*
+ * Copyright (c) 2013, Intel Corporation
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ * 
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ * 
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * pmem_image.c -- in-memory crash image implementation of libpmem
+ *
+ * WARNING: like fit mode (see pmem_fit.c), this is a special
+ * implementation of libpmem designed for fault injection testing,
+ * not for real use.  It's single-threaded, and the file is never
+ * written.
+ *
+ * Instead of writing flushed lines back to the file, this version
+ * keeps a volatile copy of what would be durable after a crash: the
+ * "persisted image".  pmem_flush_cache() records the current contents
+ * of the flushed 64B lines as pending, and pmem_fence() applies the
+ * pending lines to the image and starts a new epoch.  Epoch 0 is the
+ * file as it was when mapped, and each fence that persisted something
+ * gives the next epoch.  The lines each epoch replaced are kept in an
+ * undo log, so the image can be rolled back to any earlier epoch.
+ *
+ * A checker can then look at the durable state at every persist point
+ * in one run, with pmem_image_walk(), instead of running the program
+ * over and over again under icount and checking the files it leaves.
+ *
+ * Several files can be mapped at once.  Each has its own image, but the
+ * epochs are shared: a fence makes the lines pending in all of them
+ * durable together, just like a real fence would.
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "util/util.h"
+#include "pmem.h"
+#include "pmem_internal.h"
+
+#define	ALIGN 64	/* assumes 64B cache line size */
+
+/*
+ * a line of the persisted image, either pending (the contents at flush
+ * time) or in the undo log (the contents the epoch replaced)
+ */
+struct line {
+	struct pool *pp;	/* the mapping the line belongs to */
+	size_t idx;		/* line number in the mapping */
+	char data[ALIGN];
+};
+
+/*
+ * a growable array of lines
+ */
+struct lines {
+	struct line *l;
+	size_t n;
+	size_t max;
+};
+
+/*
+ * the state kept for each mapping, hung off its registry entry
+ */
+struct pool {
+	uintptr_t base;		/* the mapping the program stores to */
+	size_t len;
+	char *image;		/* persisted image as of the latest epoch */
+	unsigned long *line_epoch;	/* epoch each line was last persisted */
+	long *pending_slot;	/* index into Pending, or -1 */
+};
+
+static struct lines Pending;	/* flushed but not yet fenced */
+static struct lines Undo;	/* old contents, in epoch order */
+static size_t *Epoch_start;	/* first Undo entry for each epoch */
+static unsigned long Epoch;	/* latest epoch */
+static unsigned long Max_epoch;
+
+/*
+ * lines_add -- append a line to a growable array, returning it
+ */
+static struct line *
+lines_add(struct lines *lp, struct pool *pp, size_t idx)
+{
+	if (lp->n == lp->max) {
+		struct line *l;
+
+		lp->max = lp->max ? lp->max * 2 : 256;
+		if ((l = realloc(lp->l, sizeof(*l) * lp->max)) == NULL)
+			FATALSYS("realloc");
+		lp->l = l;
+	}
+
+	lp->l[lp->n].pp = pp;
+	lp->l[lp->n].idx = idx;
+	return &lp->l[lp->n++];
+}
+
+/*
+ * find_pool -- return the state for the mapping containing addr, or NULL
+ */
+static struct pool *
+find_pool(const void *addr)
+{
+	struct pmem_mapping *mp = pmem_reg_find(addr);
+
+	return mp ? mp->priv : NULL;
+}
+
+/*
+ * pmem_map -- map the Persistent Memory
+ *
+ * This is the crash image version.  Like the fit version, the file is
+ * mapped copy-on-write, and the initial persisted image is read from it.
+ */
+void *
+pmem_map_image(int fd, size_t len, int flags, int *oflagsp)
+{
+	void *base;
+	struct pool *pp;
+	size_t nlines = (len + ALIGN - 1) / ALIGN;
+	size_t i;
+	ssize_t n;
+
+	if ((base = pmem_mmap(fd, len, MAP_PRIVATE, flags, oflagsp)) == NULL)
+		return NULL;
+
+	if ((pp = malloc(sizeof(*pp))) == NULL ||
+	    (pp->image = calloc(1, nlines * ALIGN)) == NULL ||
+	    (pp->line_epoch = calloc(nlines, sizeof(*pp->line_epoch))) == NULL ||
+	    (pp->pending_slot = malloc(nlines *
+				sizeof(*pp->pending_slot))) == NULL)
+		FATALSYS("malloc");
+
+	if (Epoch_start == NULL) {
+		if ((Epoch_start = malloc(sizeof(*Epoch_start) * 64)) == NULL)
+			FATALSYS("malloc");
+		Max_epoch = 64;
+		Epoch_start[0] = 0;
+	}
+
+	for (i = 0; i < len; i += n)
+		if ((n = pread(fd, pp->image + i, len - i, i)) < 0)
+			FATALSYS("pread");
+		else if (n == 0)
+			break;	/* the rest reads as zeros */
+
+	for (i = 0; i < nlines; i++)
+		pp->pending_slot[i] = -1;
+
+	pp->base = (uintptr_t)base;
+	pp->len = len;
+	pmem_reg_add(base, len)->priv = pp;
+
+	return base;
+}
+
+/*
+ * pmem_remap -- map more of the file at the end of a growable mapping
+ *
+ * This is the crash image version.  The image grows along with the
+ * mapping, and the new part reads back as whatever the file holds
+ * there (zeros, as pmem_remap() just extended it) at every epoch,
+ * the earlier ones included.
+ */
+int
+pmem_remap_image(struct pmem_mapping *mp, size_t newlen)
+{
+	struct pool *pp = mp->priv;
+	size_t onlines = (pp->len + ALIGN - 1) / ALIGN;
+	size_t nlines = (newlen + ALIGN - 1) / ALIGN;
+	size_t i;
+	ssize_t n;
+	char *image;
+	unsigned long *line_epoch;
+	long *pending_slot;
+
+	if (pmem_mmap_grow(mp, newlen, MAP_PRIVATE) < 0)
+		return -1;
+
+	if ((image = realloc(pp->image, nlines * ALIGN)) == NULL)
+		FATALSYS("realloc");
+	pp->image = image;
+	if ((line_epoch = realloc(pp->line_epoch,
+			nlines * sizeof(*line_epoch))) == NULL)
+		FATALSYS("realloc");
+	pp->line_epoch = line_epoch;
+	if ((pending_slot = realloc(pp->pending_slot,
+			nlines * sizeof(*pending_slot))) == NULL)
+		FATALSYS("realloc");
+	pp->pending_slot = pending_slot;
+
+	memset(image + pp->len, 0, nlines * ALIGN - pp->len);
+	for (i = pp->len; i < newlen; i += n)
+		if ((n = pread(mp->fd, image + i, newlen - i, i)) < 0)
+			FATALSYS("pread");
+		else if (n == 0)
+			break;
+
+	for (i = onlines; i < nlines; i++) {
+		line_epoch[i] = 0;
+		pending_slot[i] = -1;
+	}
+
+	pp->len = newlen;
+
+	return 0;
+}
+
+/*
+ * pmem_unmap_image -- forget about a mapping
+ *
+ * Its pending lines are dropped, and so are its entries in the undo
+ * log, which leaves the epochs as they were for the other mappings.
+ */
+void
+pmem_unmap_image(struct pmem_mapping *mp)
+{
+	struct pool *pp = mp->priv;
+	unsigned long e = 1;
+	size_t i;
+	size_t j;
+
+	for (i = j = 0; i < Pending.n; i++) {
+		if (Pending.l[i].pp == pp)
+			continue;
+		Pending.l[i].pp->pending_slot[Pending.l[i].idx] = j;
+		Pending.l[j++] = Pending.l[i];
+	}
+	Pending.n = j;
+
+	for (i = j = 0; i < Undo.n; i++) {
+		while (e <= Epoch && Epoch_start[e] == i)
+			Epoch_start[e++] = j;
+		if (Undo.l[i].pp != pp)
+			Undo.l[j++] = Undo.l[i];
+	}
+	while (e <= Epoch)
+		Epoch_start[e++] = j;
+	Undo.n = j;
+
+	free(pp->image);
+	free(pp->line_epoch);
+	free(pp->pending_slot);
+	free(pp);
+}
+
+/*
+ * pmem_drain_pm_stores -- wait for any PM stores to drain from HW buffers
+ *
+ * This is the crash image version.
+ */
+void
+pmem_drain_pm_stores_image(void)
+{
+	/*
+	 * Nothing to do here for the crash image version.
+	 */
+}
+
+/*
+ * pmem_flush_cache -- flush processor cache for the given range
+ *
+ * This is the crash image version.  The current contents of the 64B
+ * chunks covering the range become pending, to be made durable by the
+ * next pmem_fence().  Flushing a line that's already pending just
+ * updates the pending contents.
+ */
+void
+pmem_flush_cache_image(void *addr, size_t len, int flags)
+{
+	struct pool *pp;
+	uintptr_t uptr;
+
+	if (len == 0)
+		return;
+
+	if ((pp = find_pool(addr)) == NULL)
+		FATAL("%p is not in a pmem mapping", addr);
+
+	for (uptr = (uintptr_t)addr & ~(ALIGN - 1);
+			uptr < (uintptr_t)addr + len; uptr += ALIGN) {
+		size_t idx = (uptr - pp->base) / ALIGN;
+		struct line *lp;
+
+		if (pp->pending_slot[idx] >= 0)
+			lp = &Pending.l[pp->pending_slot[idx]];
+		else {
+			pp->pending_slot[idx] = Pending.n;
+			lp = lines_add(&Pending, pp, idx);
+		}
+
+		memcpy(lp->data, (void *)uptr, ALIGN);
+	}
+}
+
+/*
+ * pmem_fence_image -- make the pending lines durable, as a new epoch
+ */
+void
+pmem_fence_image(void)
+{
+	size_t i;
+
+	if (Pending.n == 0)
+		return;
+
+	if (Epoch + 1 == Max_epoch) {
+		size_t *ep;
+
+		Max_epoch *= 2;
+		if ((ep = realloc(Epoch_start,
+				sizeof(*Epoch_start) * Max_epoch)) == NULL)
+			FATALSYS("realloc");
+		Epoch_start = ep;
+	}
+
+	Epoch++;
+
+	for (i = 0; i < Pending.n; i++) {
+		struct pool *pp = Pending.l[i].pp;
+		size_t idx = Pending.l[i].idx;
+		char *ip = pp->image + idx * ALIGN;
+
+		memcpy(lines_add(&Undo, pp, idx)->data, ip, ALIGN);
+		memcpy(ip, Pending.l[i].data, ALIGN);
+		pp->line_epoch[idx] = Epoch;
+		pp->pending_slot[idx] = -1;
+	}
+
+	Pending.n = 0;
+	Epoch_start[Epoch] = Undo.n - i;
+
+	DEBUG("epoch %lu, %zu lines", Epoch, i);
+}
+
+/*
+ * pmem_persist_image -- make any cached changes to a range of PM persistent
+ *
+ * This is the crash image version.
+ */
+void
+pmem_persist_image(void *addr, size_t len, int flags)
+{
+	pmem_flush_cache_image(addr, len, flags);
+	if (flags & PMEM_F_NOFENCE)
+		return;		/* pending until the next fence */
+	pmem_fence_image();
+	if (!(flags & PMEM_F_NODRAIN))
+		pmem_drain_pm_stores_image();
+}
+
+/*
+ * pmem_persist_iov -- make several discontiguous ranges persistent
+ *
+ * This is the crash image version.  All the ranges become durable in
+ * the same epoch.
+ */
+void
+pmem_persist_iov_image(const struct iovec *iov, int iovcnt, int flags)
+{
+	int i;
+
+	for (i = 0; i < iovcnt; i++)
+		pmem_flush_cache_image(iov[i].iov_base, iov[i].iov_len, flags);
+
+	if (flags & PMEM_F_NOFENCE)
+		return;
+	pmem_fence_image();
+	if (!(flags & PMEM_F_NODRAIN))
+		pmem_drain_pm_stores_image();
+}
+
+/*
+ * pmem_memmove_persist -- memmove to PM and make the result persistent
+ *
+ * This is the crash image version.
+ */
+void *
+pmem_memmove_persist_image(void *pmemdest, const void *src, size_t len)
+{
+	memmove(pmemdest, src, len);
+	pmem_persist_image(pmemdest, len, 0);
+	return pmemdest;
+}
+
+/*
+ * pmem_memset_persist -- memset PM and make the result persistent
+ *
+ * This is the crash image version.
+ */
+void *
+pmem_memset_persist_image(void *pmemdest, int c, size_t len)
+{
+	memset(pmemdest, c, len);
+	pmem_persist_image(pmemdest, len, 0);
+	return pmemdest;
+}
+
+/*
+ * undo_epoch -- roll a mapping's image buffer back from epoch e to e - 1
+ */
+static void
+undo_epoch(struct pool *pp, char *buf, unsigned long e)
+{
+	size_t end = (e == Epoch) ? Undo.n : Epoch_start[e + 1];
+	size_t i;
+
+	/* the last line may be cut short by the end of the mapping */
+	for (i = Epoch_start[e]; i < end; i++)
+		if (Undo.l[i].pp == pp)
+			memcpy(buf + Undo.l[i].idx * ALIGN, Undo.l[i].data,
+				MIN(ALIGN, pp->len - Undo.l[i].idx * ALIGN));
+}
+
+/*
+ * pmem_image_epoch -- return the latest epoch
+ */
+unsigned long
+pmem_image_epoch(void)
+{
+	return Epoch;
+}
+
+/*
+ * pmem_image_line_epoch -- return the epoch the line at addr was persisted
+ *
+ * Zero means the line is still as it was in the file when mapped.
+ */
+unsigned long
+pmem_image_line_epoch(const void *addr)
+{
+	struct pool *pp = find_pool(addr);
+
+	if (pp == NULL)
+		return 0;
+
+	return pp->line_epoch[((uintptr_t)addr - pp->base) / ALIGN];
+}
+
+/*
+ * pmem_image_get -- copy a mapping's durable image as of an epoch into buf
+ *
+ * addr is any address in the mapping, and buf must be as large as
+ * the mapping.  Returns 0 on success, or -1 with errno set.
+ */
+int
+pmem_image_get(const void *addr, unsigned long epoch, void *buf)
+{
+	struct pool *pp = find_pool(addr);
+	unsigned long e;
+
+	if (pp == NULL || epoch > Epoch) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	memcpy(buf, pp->image, pp->len);
+	for (e = Epoch; e > epoch; e--)
+		undo_epoch(pp, buf, e);
+
+	return 0;
+}
+
+/*
+ * pmem_image_dump -- write the durable image as of an epoch to a file
+ *
+ * The file can then be examined with the usual tools, as if the
+ * program had crashed right after that epoch.  Returns 0 on success,
+ * or -1 with errno set.
+ */
+int
+pmem_image_dump(const void *addr, unsigned long epoch, const char *path)
+{
+	struct pool *pp = find_pool(addr);
+	char *buf;
+	int fd;
+	size_t i;
+	ssize_t n;
+	int oerrno;
+
+	if (pp == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if ((buf = malloc(pp->len ? pp->len : 1)) == NULL)
+		return -1;
+
+	if (pmem_image_get(addr, epoch, buf) < 0)
+		goto err;
+
+	if ((fd = open(path, O_CREAT|O_TRUNC|O_WRONLY, 0666)) < 0)
+		goto err;
+
+	for (i = 0; i < pp->len; i += n)
+		if ((n = write(fd, buf + i, pp->len - i)) < 0) {
+			oerrno = errno;
+			close(fd);
+			errno = oerrno;
+			goto err;
+		}
+
+	free(buf);
+	return close(fd);
+
+err:
+	oerrno = errno;
+	free(buf);
+	errno = oerrno;
+	return -1;
+}
+
+/*
+ * pmem_image_walk -- call a checker on the durable image at every epoch
+ *
+ * The images are handed to the checker from the latest epoch back to
+ * epoch 0, each made from the one before by undoing a single epoch, so
+ * walking all of them costs no more than one copy of the image plus
+ * the undo log.  The walk stops early if the checker returns non-zero,
+ * and that value is returned.  Returns -1 with errno set on failure.
+ */
+int
+pmem_image_walk(const void *addr, int (*checker)(const void *image,
+		size_t len, unsigned long epoch, void *arg), void *arg)
+{
+	struct pool *pp = find_pool(addr);
+	char *buf;
+	unsigned long e;
+	int ret = 0;
+
+	if (pp == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if ((buf = malloc(pp->len ? pp->len : 1)) == NULL)
+		return -1;
+
+	memcpy(buf, pp->image, pp->len);
+	for (e = Epoch; ; e--) {
+		if ((ret = (*checker)(buf, pp->len, e, arg)) != 0 || e == 0)
+			break;
+		undo_epoch(pp, buf, e);
+	}
+
+	free(buf);
+	return ret;
+}
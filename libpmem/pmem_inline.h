@@ -40,17 +40,63 @@
  * if the pmem library gets updated, your program will have to be
  * recompiled to use the updates.
  *
- * This inlined version only contains the cache-line version of
- * the pmem interfaces (not the "msync mode" or "fault injection
- * test mode" interfaces available with the full libpmem.
+ * Since there's no run-time mode switch here, the version of the pmem
+ * interfaces is chosen at compile time by defining PMEM_INLINE_MODE
+ * before including this file:
+ *
+ *	PMEM_INLINE_CL		cache line flushing (the default)
+ *	PMEM_INLINE_MSYNC	msync mode, like pmem_msync_mode()
+ *	PMEM_INLINE_FIT		fault injection test mode, like pmem_fit_mode()
+ *
+ * so a program can be built once for production and once for testing
+ * without changing its source.  Only the basic interfaces are provided:
+ * pmem_map(), pmem_persist(), pmem_flush_cache(), pmem_fence() and
+ * pmem_drain_pm_stores().
+ *
+ * The PMEM_F_* flags mean what they do in pmem.h, except that there are
+ * no flusher threads here, so PMEM_F_ASYNC persists right away.  As in
+ * the library's fit mode, flushed ranges reach the file only at the
+ * next pmem_fence() in the fault injection version.
  */
 
 #include <sys/types.h>
 #include <sys/mman.h>
+#include <unistd.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+
+/* flags for pmem_persist() and pmem_flush_cache(), as in pmem.h */
+#define	PMEM_F_NOFENCE 0x1	/* flush only, a pmem_fence() comes later */
+#define	PMEM_F_NODRAIN 0x2	/* fence, but no pmem_drain_pm_stores() */
+#define	PMEM_F_NONTEMPORAL 0x4	/* the range won't be read again soon */
+#define	PMEM_F_ASYNC 0x8	/* persists synchronously here */
+
+#define	PMEM_INLINE_CL 0
+#define	PMEM_INLINE_MSYNC 1
+#define	PMEM_INLINE_FIT 2
+
+#ifndef	PMEM_INLINE_MODE
+#define	PMEM_INLINE_MODE PMEM_INLINE_CL
+#endif
 
-#define	ALIGN 64	/* assumes 64B cache line size */
+#if PMEM_INLINE_MODE == PMEM_INLINE_CL
+
+#include "pmem_cpu.h"
+
+/*
+ * the flush instruction and cache line size are determined at load time
+ */
+static int Pmem_flush_type = PMEM_FLUSH_CLFLUSH;
+static uintptr_t Pmem_cache_line_size = 64;
+
+static void __attribute__((constructor))
+pmem_inline_init(void)
+{
+	Pmem_flush_type = pmem_cpu_flush_type();
+	Pmem_cache_line_size = pmem_cpu_cache_line();
+}
 
 static inline void *
 pmem_map(int fd, size_t len)
@@ -83,18 +129,189 @@ pmem_drain_pm_stores(void)
 static inline void
 pmem_flush_cache(void *addr, size_t len, int flags)
 {
-	uintptr_t uptr;
-	
-	/* loop through 64B-aligned chunks covering the given range */
-	for (uptr = (uintptr_t)addr & ~(ALIGN - 1);
-			uptr < (uintptr_t)addr + len; uptr += 64)
-		__builtin_ia32_clflush((void *)uptr);
+	uintptr_t uptr = (uintptr_t)addr & ~(Pmem_cache_line_size - 1);
+	uintptr_t end = (uintptr_t)addr + len;
+	int type = Pmem_flush_type;
+
+	/* evict the lines if they won't be read again soon */
+	if ((flags & PMEM_F_NONTEMPORAL) && type == PMEM_FLUSH_CLWB)
+		type = PMEM_FLUSH_CLFLUSHOPT;
+
+	/* loop through cache-line-aligned chunks covering the given range */
+	switch (type) {
+	case PMEM_FLUSH_CLWB:
+		for (; uptr < end; uptr += Pmem_cache_line_size)
+			pmem_clwb((void *)uptr);
+		break;
+
+	case PMEM_FLUSH_CLFLUSHOPT:
+		for (; uptr < end; uptr += Pmem_cache_line_size)
+			pmem_clflushopt((void *)uptr);
+		break;
+
+	default:
+		for (; uptr < end; uptr += Pmem_cache_line_size)
+			pmem_clflush((void *)uptr);
+		break;
+	}
+}
+
+static inline void
+pmem_fence(void)
+{
+	__builtin_ia32_sfence();
+}
+
+#elif PMEM_INLINE_MODE == PMEM_INLINE_MSYNC
+
+static inline void *
+pmem_map(int fd, size_t len)
+{
+	void *base;
+
+	if ((base = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED,
+					fd, 0)) == MAP_FAILED)
+		return NULL;
+
+	return base;
+}
+
+static inline void
+pmem_drain_pm_stores(void)
+{
+	/*
+	 * Nothing to do here for the msync-based version.
+	 */
+}
+
+static inline void
+pmem_flush_cache(void *addr, size_t len, int flags)
+{
+	/* msync() wants the full 4k pages covering the range */
+	uintptr_t uptr = (uintptr_t)addr & ~4095UL;
+
+	len = ((uintptr_t)addr + len - uptr + 4095) & ~4095UL;
+
+	if (msync((void *)uptr, len, MS_SYNC) < 0) {
+		perror("msync");
+		abort();
+	}
+}
+
+static inline void
+pmem_fence(void)
+{
+	/*
+	 * Nothing to do here for the msync-based version.
+	 */
+}
+
+#elif PMEM_INLINE_MODE == PMEM_INLINE_FIT
+
+/*
+ * WARNING: see pmem_fit.c -- this version is slow and only meant for
+ * fault injection testing.  Only one mapping is supported.  Flushed
+ * 64B chunks are copied to the calling thread's pending buffer, and
+ * written to the file by its next pmem_fence().  The buffers of exiting
+ * threads aren't freed.
+ */
+static int Pmem_fit_fd;
+static uintptr_t Pmem_fit_base;
+static __thread char *Pmem_fit_pending;	/* (offset, len, contents)... */
+static __thread size_t Pmem_fit_npending;
+static __thread size_t Pmem_fit_maxpending;
+
+static inline void *
+pmem_map(int fd, size_t len)
+{
+	void *base;
+
+	if ((base = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_PRIVATE,
+					fd, 0)) == MAP_FAILED)
+		return NULL;
+
+	Pmem_fit_base = (uintptr_t)base;
+	Pmem_fit_fd = dup(fd);
+
+	return base;
+}
+
+static inline void
+pmem_drain_pm_stores(void)
+{
+	/*
+	 * Nothing to do here for the fit version.
+	 */
+}
+
+static inline void
+pmem_flush_cache(void *addr, size_t len, int flags)
+{
+	/* save the full 64B chunks covering the range, as they are now */
+	uintptr_t uptr = (uintptr_t)addr & ~63UL;
+	uintptr_t end = ((uintptr_t)addr + len + 63) & ~63UL;
+	size_t hdr[2];
+	size_t need;
+	char *p;
+
+	hdr[0] = uptr - Pmem_fit_base;
+	hdr[1] = end - uptr;
+	need = Pmem_fit_npending + sizeof(hdr) + hdr[1];
+
+	while (need > Pmem_fit_maxpending) {
+		Pmem_fit_maxpending = Pmem_fit_maxpending ?
+			Pmem_fit_maxpending * 2 : 64 * 1024;
+		if ((Pmem_fit_pending = realloc(Pmem_fit_pending,
+					Pmem_fit_maxpending)) == NULL) {
+			perror("realloc");
+			abort();
+		}
+	}
+
+	p = Pmem_fit_pending + Pmem_fit_npending;
+	memcpy(p, hdr, sizeof(hdr));
+	memcpy(p + sizeof(hdr), (void *)uptr, hdr[1]);
+	Pmem_fit_npending = need;
+}
+
+static inline void
+pmem_fence(void)
+{
+	/* write this thread's flushed chunks, in the order they were saved */
+	size_t i = 0;
+
+	while (i < Pmem_fit_npending) {
+		size_t hdr[2];
+		size_t done;
+		ssize_t n;
+
+		memcpy(hdr, Pmem_fit_pending + i, sizeof(hdr));
+		i += sizeof(hdr);
+
+		for (done = 0; done < hdr[1]; done += n)
+			if ((n = pwrite(Pmem_fit_fd,
+					Pmem_fit_pending + i + done,
+					hdr[1] - done, hdr[0] + done)) < 0) {
+				perror("pwrite");
+				abort();
+			}
+		i += hdr[1];
+	}
+
+	Pmem_fit_npending = 0;
 }
 
+#else
+#error "PMEM_INLINE_MODE must be PMEM_INLINE_CL, _MSYNC or _FIT"
+#endif
+
 static inline void
 pmem_persist(void *addr, size_t len, int flags)
 {
 	pmem_flush_cache(addr, len, flags);
-	__builtin_ia32_sfence();
-	pmem_drain_pm_stores();
+	if (flags & PMEM_F_NOFENCE)
+		return;
+	pmem_fence();
+	if (!(flags & PMEM_F_NODRAIN))
+		pmem_drain_pm_stores();
 }
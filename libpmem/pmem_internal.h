@@ -0,0 +1,130 @@
+/*
+ * Copyright (c) 2013, Intel Corporation
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ * 
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ * 
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * pmem_internal.h -- definitions shared by the libpmem implementations
+ *
+ * Nothing in here is part of the libpmem API.
+ */
+
+/*
+ * a range of addresses, [start, end), as used by pmem_iov_merge()
+ */
+struct pmem_range {
+	uintptr_t start;
+	uintptr_t end;
+};
+
+/*
+ * number of ranges pmem_iov_merge() callers keep on the stack, larger
+ * vectors are allocated with malloc()
+ */
+#define	PMEM_IOV_STACK 32
+
+struct pmem_range *pmem_iov_merge(const struct iovec *iov, int iovcnt,
+		uintptr_t align, struct pmem_range *stackbuf, int *nrangesp);
+
+void *pmem_mmap(int fd, size_t len, int share, int flags, int *oflagsp);
+size_t pmem_mmap_span(size_t len, int oflags);
+
+/*
+ * a mapping made by pmem_map(), see pmem_registry.c
+ */
+struct pmem_mapping {
+	uintptr_t start;
+	uintptr_t end;
+	uintptr_t limit;	/* end of the address space reserved for it */
+	int oflags;	/* the PMEM_MAP_* options that took effect */
+	int fd;		/* file descriptor kept by the implementation, or -1 */
+	int node;	/* NUMA node, or -1 if not known, see pmem_numa.c */
+	int pmem;	/* flushing makes stores durable, see pmem_auto.c */
+	void *priv;	/* anything else the implementation needs */
+};
+
+struct pmem_mapping *pmem_reg_add(void *addr, size_t len);
+struct pmem_mapping *pmem_reg_remove(void *addr);
+struct pmem_mapping *pmem_reg_find(const void *addr);
+
+int pmem_mmap_grow(struct pmem_mapping *mp, size_t newlen, int share);
+
+/*
+ * Persistent Memory detection, see pmem_auto.c
+ */
+int pmem_auto_probe(int fd);
+
+/*
+ * asynchronous persist, see pmem_async.c
+ */
+unsigned long pmem_async_submit(void *addr, size_t len);
+
+/*
+ * NUMA locality, see pmem_numa.c
+ */
+int pmem_numa_multinode(void);
+int pmem_numa_mynode(void);
+void pmem_numa_map(int fd, void *addr, size_t len, int flags, int *oflagsp);
+
+/*
+ * parallel flushing of very large ranges, see pmem_parallel.c
+ */
+extern size_t Pmem_parallel_min;
+int pmem_parallel(void (*fn)(void *addr, size_t len, int flags), void *addr,
+		size_t len, int flags);
+
+/*
+ * write-protect based dirty page tracking, see pmem_wp.c
+ */
+int pmem_wp_enabled(void);
+void pmem_wp_register(void *addr, size_t len);
+void pmem_wp_unregister(void *addr, size_t len);
+
+/*
+ * statistics, see pmem_stats.c
+ *
+ * Entry points bracket their work with PMEM_STATS_ENTER() and
+ * PMEM_STATS_LEAVE(), and call the counting functions only when
+ * Pmem_stats is set.
+ */
+extern int Pmem_stats;
+void *pmem_stats_enter(void *caller);
+void pmem_stats_leave(void *site);
+void pmem_stats_flush(const void *addr, size_t len);
+void pmem_stats_persist(const void *addr, size_t len);
+void pmem_stats_fence(void);
+void pmem_stats_drain(void);
+void pmem_stats_msync(void);
+
+#define	PMEM_STATS_ENTER(site)\
+	((site) = Pmem_stats ?\
+		pmem_stats_enter(__builtin_return_address(0)) : NULL)
+#define	PMEM_STATS_LEAVE(site)\
+	do { if (site) pmem_stats_leave(site); } while (0)
@@ -0,0 +1,111 @@
+/*
+ * Copyright (c) 2013, Intel Corporation
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ * 
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ * 
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * pmem_iov.c -- range sorting & merging for pmem_persist_iov()
+ */
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "util/util.h"
+#include "pmem_internal.h"
+
+/*
+ * range_compare -- qsort comparison function for struct pmem_range
+ */
+static int
+range_compare(const void *a, const void *b)
+{
+	const struct pmem_range *ra = a;
+	const struct pmem_range *rb = b;
+
+	if (ra->start < rb->start)
+		return -1;
+	return ra->start > rb->start;
+}
+
+/*
+ * pmem_iov_merge -- turn an iovec into a sorted list of disjoint ranges
+ *
+ * Each range in the iovec is widened to the given alignment (the cache
+ * line size, or the page size for msync), the ranges are sorted by
+ * address, and any that overlap or touch are merged.  So every aligned
+ * unit covered by the iovec appears in exactly one of the ranges returned.
+ *
+ * The result is stored in stackbuf if there are at most PMEM_IOV_STACK
+ * entries in the iovec, otherwise it is allocated and the caller must
+ * free it when it doesn't match stackbuf.  The number of ranges is
+ * returned in *nrangesp.
+ */
+struct pmem_range *
+pmem_iov_merge(const struct iovec *iov, int iovcnt, uintptr_t align,
+		struct pmem_range *stackbuf, int *nrangesp)
+{
+	struct pmem_range *r = stackbuf;
+	int i;
+	int n = 0;
+
+	if (iovcnt > PMEM_IOV_STACK &&
+	    (r = malloc(sizeof(*r) * iovcnt)) == NULL)
+		FATALSYS("malloc");
+
+	for (i = 0; i < iovcnt; i++) {
+		uintptr_t start = (uintptr_t)iov[i].iov_base;
+
+		if (iov[i].iov_len == 0)
+			continue;
+
+		r[n].start = start & ~(align - 1);
+		r[n].end = (start + iov[i].iov_len + align - 1) & ~(align - 1);
+		n++;
+	}
+
+	if (n > 1) {
+		int j = 0;
+
+		qsort(r, n, sizeof(*r), range_compare);
+
+		for (i = 1; i < n; i++)
+			if (r[i].start <= r[j].end) {
+				if (r[i].end > r[j].end)
+					r[j].end = r[i].end;
+			} else
+				r[++j] = r[i];
+		n = j + 1;
+	}
+
+	*nrangesp = n;
+	return r;
+}
@@ -0,0 +1,239 @@
+/*
+ * Copyright (c) 2013, Intel Corporation
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ * 
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ * 
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * pmem_mmap.c -- the mmap() call shared by the libpmem implementations
+ */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdint.h>
+
+#include "util/util.h"
+#include "pmem.h"
+#include "pmem_internal.h"
+
+/* in case the system headers are too old to know about MAP_SYNC */
+#ifndef MAP_SHARED_VALIDATE
+#define	MAP_SHARED_VALIDATE 0x03
+#endif
+#ifndef MAP_SYNC
+#define	MAP_SYNC 0x80000
+#endif
+
+#define	PAGE 4096
+#define	HUGE_2M (2UL << 20)
+#define	HUGE_1G (1UL << 30)
+#define	GROW_SPAN (1UL << 40)	/* address space kept for growable maps */
+
+/*
+ * reserve -- reserve address space aligned to align, big enough for len
+ *
+ * Returns the aligned address, or NULL if the reservation failed.  Only
+ * [addr, addr + len) is left reserved, to be replaced using MAP_FIXED.
+ */
+static void *
+reserve(size_t len, size_t align)
+{
+	void *resv;
+	uintptr_t start;
+	uintptr_t aligned;
+	uintptr_t end;
+
+	if ((resv = mmap(NULL, len + align, PROT_NONE,
+			MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE,
+			-1, 0)) == MAP_FAILED)
+		return NULL;
+
+	start = (uintptr_t)resv;
+	aligned = (start + align - 1) & ~(align - 1);
+	end = start + len + align;
+
+	/* trim the unused head and tail of the reservation */
+	if (aligned > start)
+		munmap(resv, aligned - start);
+	len = (len + PAGE - 1) & ~(PAGE - 1);
+	if (aligned + len < end)
+		munmap((void *)(aligned + len), end - (aligned + len));
+
+	return (void *)aligned;
+}
+
+/*
+ * pmem_mmap_span -- return the address space kept for a mapping
+ *
+ * A PMEM_MAP_GROWABLE mapping of len bytes sits at the start of a
+ * reservation this big, so pmem_mmap_grow() has somewhere to put
+ * the rest of the file without moving the mapping.
+ */
+size_t
+pmem_mmap_span(size_t len, int oflags)
+{
+	if ((oflags & PMEM_MAP_GROWABLE) && len < GROW_SPAN)
+		return GROW_SPAN;
+
+	return len;
+}
+
+/*
+ * pmem_mmap -- map a file for one of the libpmem implementations
+ *
+ * share is MAP_SHARED or MAP_PRIVATE, and flags are the PMEM_MAP_*
+ * options from pmem_map_ex().  Options that don't apply or aren't
+ * supported are quietly dropped; the ones that took effect are
+ * returned in *oflagsp, if oflagsp isn't NULL.
+ */
+void *
+pmem_mmap(int fd, size_t len, int share, int flags, int *oflagsp)
+{
+	void *addr = NULL;
+	void *base;
+	size_t align = 0;
+	size_t span = pmem_mmap_span(len, flags);
+	int mflags = share;
+	int oflags = 0;
+
+	/* the node hint is dealt with by pmem_numa_map() */
+	if (flags & ~(PMEM_MAP_SYNC|PMEM_MAP_POPULATE|PMEM_MAP_HUGE_2M|
+				PMEM_MAP_HUGE_1G|PMEM_MAP_NODE_MASK|
+				PMEM_MAP_GROWABLE)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (flags & PMEM_MAP_HUGE_1G)
+		align = HUGE_1G;
+	else if (flags & PMEM_MAP_HUGE_2M)
+		align = HUGE_2M;
+
+	/* no point aligning a mapping smaller than a huge page */
+	if (align && len >= align && (addr = reserve(span, align)) != NULL) {
+		mflags |= MAP_FIXED;
+		oflags |= (align == HUGE_1G) ? PMEM_MAP_HUGE_1G :
+				PMEM_MAP_HUGE_2M;
+	} else if (span > len) {
+		if ((addr = reserve(span, PAGE)) == NULL)
+			return NULL;
+		mflags |= MAP_FIXED;
+	}
+
+	/* the rest of the reservation stays PROT_NONE until it's grown into */
+	if (span > len)
+		oflags |= PMEM_MAP_GROWABLE;
+
+	if (flags & PMEM_MAP_POPULATE) {
+		mflags |= MAP_POPULATE;
+		oflags |= PMEM_MAP_POPULATE;
+	}
+
+	/*
+	 * MAP_SYNC only means something for shared mappings, and is
+	 * refused (with EOPNOTSUPP, or EINVAL on kernels that predate
+	 * it) unless the file is on a DAX file system.  Fall back to a
+	 * normal mapping in that case.
+	 */
+	if ((flags & PMEM_MAP_SYNC) && share == MAP_SHARED) {
+		base = mmap(addr, len, PROT_READ|PROT_WRITE,
+			(mflags & ~MAP_SHARED)|MAP_SHARED_VALIDATE|MAP_SYNC,
+			fd, 0);
+
+		if (base != MAP_FAILED) {
+			oflags |= PMEM_MAP_SYNC;
+			goto out;
+		}
+
+		if (errno != EOPNOTSUPP && errno != EINVAL)
+			goto err;
+
+		DEBUG("MAP_SYNC not supported, errno %d", errno);
+	}
+
+	if ((base = mmap(addr, len, PROT_READ|PROT_WRITE, mflags,
+					fd, 0)) == MAP_FAILED)
+		goto err;
+
+out:
+	DEBUG("fd %d len %zu flags 0x%x: %p, took 0x%x",
+			fd, len, flags, base, oflags);
+
+	if (oflagsp)
+		*oflagsp = oflags;
+
+	return base;
+
+err:
+	if (addr) {
+		int oerrno = errno;
+
+		munmap(addr, span);
+		errno = oerrno;
+	}
+
+	return NULL;
+}
+
+/*
+ * pmem_mmap_grow -- map more of the file at the end of a mapping
+ *
+ * The new part replaces the reservation left by pmem_mmap() for a
+ * growable mapping, and is mapped the same way as the rest of it.
+ * mp->end isn't changed, that's up to the caller.  Returns 0 on
+ * success, or -1 with errno set.
+ */
+int
+pmem_mmap_grow(struct pmem_mapping *mp, size_t newlen, int share)
+{
+	uintptr_t off = (mp->end - mp->start + PAGE - 1) & ~(PAGE - 1);
+	uintptr_t newoff = (newlen + PAGE - 1) & ~(PAGE - 1);
+	int mflags = share|MAP_FIXED;
+
+	/* the last page mapped already covers the new bytes */
+	if (newoff <= off)
+		return 0;
+
+	if (mp->oflags & PMEM_MAP_POPULATE)
+		mflags |= MAP_POPULATE;
+	if (mp->oflags & PMEM_MAP_SYNC)
+		mflags = (mflags & ~MAP_SHARED)|MAP_SHARED_VALIDATE|MAP_SYNC;
+
+	if (mmap((void *)(mp->start + off), newoff - off,
+			PROT_READ|PROT_WRITE, mflags, mp->fd, off) == MAP_FAILED)
+		return -1;
+
+	DEBUG("fd %d grown from %zu to %zu", mp->fd, off, newoff);
+
+	return 0;
+}
@@ -0,0 +1,158 @@
+/*
+ * Copyright (c) 2013, Intel Corporation
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ * 
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ * 
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * pmem_movnt.c -- non-temporal copy and set routines for libpmem
+ *
+ * These are used by the cache-line-based version of libpmem to implement
+ * pmem_memcpy_persist() and friends for larger ranges.  Non-temporal
+ * stores bypass the processor caches, so the destination doesn't have
+ * to be read into the cache first (read-for-ownership) and then flushed
+ * back out again.  Like CLFLUSHOPT and CLWB, they are weakly ordered and
+ * the caller must follow up with a fence.
+ *
+ * All the routines here require dest to be 64-byte aligned and len to
+ * be a multiple of 64.  src may have any alignment.  Each ISA variant is
+ * compiled with the matching target attribute so this file builds with
+ * the default compiler flags; the caller picks one at run time based on
+ * what the processor supports.
+ */
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <immintrin.h>
+
+/*
+ * pmem_movnt_sse2 -- non-temporal copy, 16 bytes at a time
+ */
+void
+pmem_movnt_sse2(void *dest, const void *src, size_t len)
+{
+	__m128i *d = dest;
+	const __m128i *s = src;
+
+	for (; len; len -= 64, d += 4, s += 4) {
+		__m128i x0 = _mm_loadu_si128(s);
+		__m128i x1 = _mm_loadu_si128(s + 1);
+		__m128i x2 = _mm_loadu_si128(s + 2);
+		__m128i x3 = _mm_loadu_si128(s + 3);
+
+		_mm_stream_si128(d, x0);
+		_mm_stream_si128(d + 1, x1);
+		_mm_stream_si128(d + 2, x2);
+		_mm_stream_si128(d + 3, x3);
+	}
+}
+
+/*
+ * pmem_movnt_avx2 -- non-temporal copy, 32 bytes at a time
+ */
+__attribute__((target("avx2")))
+void
+pmem_movnt_avx2(void *dest, const void *src, size_t len)
+{
+	__m256i *d = dest;
+	const __m256i *s = src;
+
+	for (; len; len -= 64, d += 2, s += 2) {
+		__m256i y0 = _mm256_loadu_si256(s);
+		__m256i y1 = _mm256_loadu_si256(s + 1);
+
+		_mm256_stream_si256(d, y0);
+		_mm256_stream_si256(d + 1, y1);
+	}
+	_mm256_zeroupper();
+}
+
+/*
+ * pmem_movnt_avx512f -- non-temporal copy, a full cache line at a time
+ */
+__attribute__((target("avx512f")))
+void
+pmem_movnt_avx512f(void *dest, const void *src, size_t len)
+{
+	__m512i *d = dest;
+	const __m512i *s = src;
+
+	for (; len; len -= 64, d++, s++)
+		_mm512_stream_si512(d, _mm512_loadu_si512(s));
+	_mm256_zeroupper();
+}
+
+/*
+ * pmem_movnt_set_sse2 -- non-temporal memset, 16 bytes at a time
+ */
+void
+pmem_movnt_set_sse2(void *dest, int c, size_t len)
+{
+	__m128i *d = dest;
+	__m128i x = _mm_set1_epi8((char)c);
+
+	for (; len; len -= 64, d += 4) {
+		_mm_stream_si128(d, x);
+		_mm_stream_si128(d + 1, x);
+		_mm_stream_si128(d + 2, x);
+		_mm_stream_si128(d + 3, x);
+	}
+}
+
+/*
+ * pmem_movnt_set_avx2 -- non-temporal memset, 32 bytes at a time
+ */
+__attribute__((target("avx2")))
+void
+pmem_movnt_set_avx2(void *dest, int c, size_t len)
+{
+	__m256i *d = dest;
+	__m256i y = _mm256_set1_epi8((char)c);
+
+	for (; len; len -= 64, d += 2) {
+		_mm256_stream_si256(d, y);
+		_mm256_stream_si256(d + 1, y);
+	}
+	_mm256_zeroupper();
+}
+
+/*
+ * pmem_movnt_set_avx512f -- non-temporal memset, a cache line at a time
+ */
+__attribute__((target("avx512f")))
+void
+pmem_movnt_set_avx512f(void *dest, int c, size_t len)
+{
+	__m512i *d = dest;
+	__m512i z = _mm512_set1_epi8((char)c);
+
+	for (; len; len -= 64, d++)
+		_mm512_stream_si512(d, z);
+	_mm256_zeroupper();
+}
@@ -36,11 +36,15 @@
 
 #include <sys/mman.h>
 #include <sys/param.h>
+#include <sys/uio.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
 #include <stdint.h>
+#include <string.h>
 
 #include "util/util.h"
+#include "pmem_internal.h"
 
 #define	ALIGN 4096	/* assumes 4k page size for use with msync() */
 
@@ -50,20 +54,59 @@
  * This is just a convenience function that calls mmap() with the
  * appropriate arguments.
  *
- * This is the msync-based version.
+ * This is the msync-based version.  If pmem_track_dirty() was called,
+ * the mapping starts out write-protected so pmem_sync_dirty() can find
+ * the pages that get written.
  */
 void *
-pmem_map_msync(int fd, size_t len)
+pmem_map_msync(int fd, size_t len, int flags, int *oflagsp)
 {
 	void *base;
 
-	if ((base = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED,
-					fd, 0)) == MAP_FAILED)
+	if ((base = pmem_mmap(fd, len, MAP_SHARED, flags, oflagsp)) == NULL)
 		return NULL;
 
+	pmem_reg_add(base, len);
+	if (pmem_wp_enabled())
+		pmem_wp_register(base, len);
+
 	return base;
 }
 
+/*
+ * pmem_unmap_msync -- stop tracking writes to a mapping
+ *
+ * This is the msync-based version.
+ */
+void
+pmem_unmap_msync(struct pmem_mapping *mp)
+{
+	if (pmem_wp_enabled())
+		pmem_wp_unregister((void *)mp->start, mp->end - mp->start);
+}
+
+/*
+ * pmem_remap -- map more of the file at the end of a growable mapping
+ *
+ * This is the msync-based version.  The new pages are tracked as a
+ * region of their own, so the bitmap of the old ones, which the fault
+ * handler may be using, is left alone.
+ */
+int
+pmem_remap_msync(struct pmem_mapping *mp, size_t newlen)
+{
+	uintptr_t old = (mp->end + ALIGN - 1) & ~(ALIGN - 1);
+	uintptr_t new = (mp->start + newlen + ALIGN - 1) & ~(ALIGN - 1);
+
+	if (pmem_mmap_grow(mp, newlen, MAP_SHARED) < 0)
+		return -1;
+
+	if (pmem_wp_enabled() && new > old)
+		pmem_wp_register((void *)old, new - old);
+
+	return 0;
+}
+
 /*
  * pmem_drain_pm_stores -- wait for any PM stores to drain from HW buffers
  *
@@ -104,6 +147,8 @@ pmem_flush_cache_msync(void *addr, size_t len, int flags)
 
 	if (msync((void *)uptr, len, MS_SYNC) < 0)
 		FATALSYS("msync");
+
+	pmem_stats_msync();
 }
 
 /*
@@ -118,3 +163,60 @@ pmem_persist_msync(void *addr, size_t len, int flags)
 	__builtin_ia32_sfence();
 	pmem_drain_pm_stores_msync();
 }
+
+/*
+ * pmem_persist_iov -- make several discontiguous ranges persistent
+ *
+ * This is the msync-based version.  The ranges are widened to full
+ * pages and merged, so each page is synced once, using the fewest
+ * msync() calls possible.
+ */
+void
+pmem_persist_iov_msync(const struct iovec *iov, int iovcnt, int flags)
+{
+	struct pmem_range stackbuf[PMEM_IOV_STACK];
+	struct pmem_range *r;
+	int n;
+	int i;
+
+	r = pmem_iov_merge(iov, iovcnt, ALIGN, stackbuf, &n);
+
+	for (i = 0; i < n; i++) {
+		if (msync((void *)r[i].start, r[i].end - r[i].start,
+					MS_SYNC) < 0)
+			FATALSYS("msync");
+		pmem_stats_msync();
+	}
+
+	__builtin_ia32_sfence();
+	pmem_drain_pm_stores_msync();
+
+	if (r != stackbuf)
+		free(r);
+}
+
+/*
+ * pmem_memmove_persist -- memmove to PM and make the result persistent
+ *
+ * This is the msync-based version.
+ */
+void *
+pmem_memmove_persist_msync(void *pmemdest, const void *src, size_t len)
+{
+	memmove(pmemdest, src, len);
+	pmem_persist_msync(pmemdest, len, 0);
+	return pmemdest;
+}
+
+/*
+ * pmem_memset_persist -- memset PM and make the result persistent
+ *
+ * This is the msync-based version.
+ */
+void *
+pmem_memset_persist_msync(void *pmemdest, int c, size_t len)
+{
+	memset(pmemdest, c, len);
+	pmem_persist_msync(pmemdest, len, 0);
+	return pmemdest;
+}
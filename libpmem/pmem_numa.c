@@ -0,0 +1,300 @@
+/*
+ * Copyright (c) 2013, Intel Corporation
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ * 
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ * 
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * pmem_numa.c -- NUMA locality of Persistent Memory mappings
+ *
+ * Persisting to memory on another socket costs about twice as much,
+ * so libpmem keeps track of which node each mapping lives on, and
+ * helps put the threads using it on the same node.
+ *
+ * For a device DAX character device, or a file on a DAX file system,
+ * the node is the one sysfs reports for the device, and nothing can
+ * change it.  Otherwise the file is really in DRAM (in the page cache
+ * or tmpfs), which can be put on any node: a node hint given to
+ * pmem_map_ex() is applied with mbind(), and without one, the node is
+ * wherever the kernel put the first page.
+ */
+
+#define	_GNU_SOURCE
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "util/util.h"
+#include "pmem.h"
+#include "pmem_internal.h"
+
+/* from <numaif.h>, which comes with libnuma rather than the C library */
+#define	MPOL_PREFERRED 1
+#define	MPOL_MF_MOVE (1 << 1)
+
+#define	MAXNODES 256	/* node hints fit in eight bits */
+#define	BITS (8 * sizeof(unsigned long))
+
+static int Multinode;		/* there's more than one NUMA node */
+
+/*
+ * pmem_numa_init -- find out if this is a NUMA machine at all
+ */
+static void __attribute__((constructor))
+pmem_numa_init(void)
+{
+	Multinode = access("/sys/devices/system/node/node1", F_OK) == 0;
+}
+
+/*
+ * pmem_numa_multinode -- return true if there's more than one node
+ */
+int
+pmem_numa_multinode(void)
+{
+	return Multinode;
+}
+
+/*
+ * pmem_numa_mynode -- return the node the calling thread is running on
+ */
+int
+pmem_numa_mynode(void)
+{
+	unsigned cpu;
+	unsigned node;
+
+	if (!Multinode || syscall(SYS_getcpu, &cpu, &node, NULL) < 0)
+		return 0;
+
+	return node;
+}
+
+/*
+ * readnum -- read a number from a sysfs file, or return -1
+ */
+static int
+readnum(const char *path)
+{
+	FILE *fp;
+	int n;
+
+	if ((fp = fopen(path, "r")) == NULL)
+		return -1;
+
+	if (fscanf(fp, "%d", &n) != 1)
+		n = -1;
+
+	fclose(fp);
+	return n;
+}
+
+/*
+ * dev_node -- return the node of the PM device behind fd, or -1
+ *
+ * A device DAX character device reports its own node.  For a file,
+ * it's the node of the block device the file system is on (or of
+ * the whole disk, for a partition); page cache backed files on
+ * ordinary disks report -1 there, as there's no node to speak of.
+ */
+static int
+dev_node(int fd)
+{
+	static const char *files[] = {
+		"device/numa_node", "../device/numa_node", "numa_node"
+	};
+	struct stat st;
+	char path[PATH_MAX];
+	const char *type;
+	dev_t dev;
+	int node;
+	int i;
+
+	if (fstat(fd, &st) < 0)
+		return -1;
+
+	if (S_ISCHR(st.st_mode)) {
+		type = "char";
+		dev = st.st_rdev;
+	} else {
+		type = "block";
+		dev = st.st_dev;
+	}
+
+	for (i = 0; i < sizeof(files) / sizeof(*files); i++) {
+		snprintf(path, sizeof(path), "/sys/dev/%s/%u:%u/%s", type,
+				major(dev), minor(dev), files[i]);
+		if ((node = readnum(path)) >= 0)
+			return node;
+	}
+
+	return -1;
+}
+
+/*
+ * page_node -- return the node the page holding addr is on, or -1
+ *
+ * Pages that haven't been touched yet aren't on any node.
+ */
+static int
+page_node(const void *addr)
+{
+	void *page = (void *)((uintptr_t)addr & ~(uintptr_t)4095);
+	int status;
+
+	/* move_pages() with no target nodes just reports where they are */
+	if (syscall(SYS_move_pages, 0, 1UL, &page, NULL, &status, 0) < 0 ||
+			status < 0)
+		return -1;
+
+	return status;
+}
+
+/*
+ * pmem_numa_map -- work out the node of a new mapping
+ *
+ * flags are the pmem_map_ex() options, which may hold a node hint.
+ * The hint only applies to DRAM backed files, where the mapping is
+ * bound to the node with mbind(), moving any pages already there;
+ * if that worked, the hint is added to *oflagsp.
+ */
+void
+pmem_numa_map(int fd, void *addr, size_t len, int flags, int *oflagsp)
+{
+	struct pmem_mapping *mp;
+	int hint = ((flags & PMEM_MAP_NODE_MASK) >> 16) - 1;
+
+	if ((mp = pmem_reg_find(addr)) == NULL)
+		return;
+
+	if ((mp->node = dev_node(fd)) >= 0 || hint < 0)
+		return;
+
+	if (Multinode) {
+		unsigned long mask[MAXNODES / BITS] = { 0 };
+
+		mask[hint / BITS] = 1UL << (hint % BITS);
+		if (syscall(SYS_mbind, addr, len, MPOL_PREFERRED, mask,
+				MAXNODES + 1, MPOL_MF_MOVE) < 0) {
+			DEBUG("mbind node %d: %s", hint, strerror(errno));
+			return;
+		}
+	} else if (hint != 0)
+		return;		/* there's only node 0 */
+
+	mp->node = hint;
+	if (oflagsp)
+		*oflagsp |= PMEM_MAP_NODE(hint);
+}
+
+/*
+ * pmem_map_node -- return the NUMA node of the mapping holding addr
+ *
+ * Returns -1 if addr isn't in a mapping made by libpmem, or it can't
+ * be told yet (a DRAM backed mapping nobody has touched).
+ */
+int
+pmem_map_node(const void *addr)
+{
+	struct pmem_mapping *mp;
+
+	if ((mp = pmem_reg_find(addr)) == NULL)
+		return -1;
+
+	if (mp->node >= 0)
+		return mp->node;
+
+	return Multinode ? page_node((void *)mp->start) : 0;
+}
+
+/*
+ * pmem_bind_thread -- run the calling thread only on a node's processors
+ *
+ * Returns 0 on success, or -1 with errno set (EINVAL if the node has
+ * no processors).
+ */
+int
+pmem_bind_thread(int node)
+{
+	char path[PATH_MAX];
+	FILE *fp;
+	cpu_set_t set;
+	int first;
+	int last;
+	int ncpus = 0;
+	int c;
+
+	snprintf(path, sizeof(path),
+			"/sys/devices/system/node/node%d/cpulist", node);
+	if (node < 0 || (fp = fopen(path, "r")) == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* the list looks like 0-7,16-23 */
+	CPU_ZERO(&set);
+	while (fscanf(fp, "%d", &first) == 1) {
+		last = first;
+		if ((c = getc(fp)) == '-') {
+			if (fscanf(fp, "%d", &last) != 1)
+				break;
+			c = getc(fp);
+		}
+		for (; first <= last && first < CPU_SETSIZE; first++) {
+			CPU_SET(first, &set);
+			ncpus++;
+		}
+		if (c != ',')
+			break;
+	}
+	fclose(fp);
+
+	if (ncpus == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if ((errno = pthread_setaffinity_np(pthread_self(),
+					sizeof(set), &set)) != 0)
+		return -1;
+
+	return 0;
+}
@@ -0,0 +1,319 @@
+/*
+ * Copyright (c) 2013, Intel Corporation
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ * 
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ * 
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * pmem_parallel.c -- flush very large ranges on several threads
+ *
+ * Flushing a freshly loaded multi-GB range one line at a time on a
+ * single core takes a long time.  Above a size threshold, the range
+ * is cut into cache aligned chunks that a pool of worker threads and
+ * the caller flush together, and the caller waits for all of them
+ * before going on to its own fence.  Since a fence only orders the
+ * flushes done by its own core, each thread fences its chunks itself.
+ *
+ * On machines with more than one NUMA node, each thread flushes the
+ * chunks on its own node first, and only then helps with the rest,
+ * so most of the flushing is done by the node holding the memory.
+ *
+ * Only one range is flushed in parallel at a time; anyone else with
+ * a large range meanwhile flushes it the usual way.
+ */
+
+#define	_GNU_SOURCE
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "util/util.h"
+#include "pmem_internal.h"
+
+#define	CHUNK (2 * 1024 * 1024)	/* chunk size, a multiple of any line size */
+#define	MAXWORKERS 16
+#define	DEFAULT_MIN (64 * 1024 * 1024)
+
+size_t Pmem_parallel_min;	/* ranges this large go parallel, 0 for never */
+static int Nworkers;
+static pthread_once_t Once = PTHREAD_ONCE_INIT;
+
+/*
+ * the range being flushed; only the thread holding Job_lock sets it up
+ */
+static pthread_mutex_t Job_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct {
+	void (*fn)(void *addr, size_t len, int flags);	/* NULL once over */
+	int flags;		/* the caller's pmem_persist() flags */
+	uintptr_t start;
+	uintptr_t end;
+	size_t nchunks;
+	unsigned char *claimed;	/* chunks somebody has taken */
+	int *node;		/* node of each chunk, or NULL */
+} Job;
+
+static pthread_mutex_t Lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t Work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t Idle = PTHREAD_COND_INITIALIZER;
+static unsigned long Gen;	/* bumped for each new job */
+static int Busy;		/* workers working on the current job */
+
+/*
+ * pmem_parallel_init -- pick the defaults for this machine
+ *
+ * One worker per processor besides the caller, up to MAXWORKERS.  On a
+ * single processor machine there's nobody to share the work with, so
+ * parallel flushing starts out off.
+ */
+static void __attribute__((constructor))
+pmem_parallel_init(void)
+{
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	Nworkers = (ncpus > MAXWORKERS + 1) ? MAXWORKERS : ncpus - 1;
+	if (Nworkers > 0)
+		Pmem_parallel_min = DEFAULT_MIN;
+}
+
+/*
+ * pmem_parallel_flush -- set the parallel flushing threshold and threads
+ *
+ * Ranges of at least min bytes are flushed in parallel, zero turns it
+ * off.  nthreads of zero keeps the current number of workers, which
+ * can only be changed before the first parallel flush.
+ */
+void
+pmem_parallel_flush(size_t min, int nthreads)
+{
+	if (nthreads < 0 || nthreads > MAXWORKERS)
+		FATAL("parallel flush threads must be 0 to %d", MAXWORKERS);
+
+	if (nthreads)
+		Nworkers = nthreads;
+	Pmem_parallel_min = Nworkers ? min : 0;
+}
+
+/*
+ * nodes -- look up the NUMA node of the first page of each chunk
+ *
+ * Chunks are aligned to CHUNK, so the first one starts before the
+ * range, and its first page in the range is the one holding start.
+ *
+ * Returns NULL if there's only one node, or the lookup fails.
+ */
+static int *
+nodes(uintptr_t start, size_t nchunks)
+{
+	void **pages;
+	int *node;
+	size_t i;
+
+	if (!pmem_numa_multinode())
+		return NULL;
+
+	if ((pages = malloc(sizeof(*pages) * nchunks)) == NULL ||
+	    (node = malloc(sizeof(*node) * nchunks)) == NULL) {
+		free(pages);
+		return NULL;
+	}
+
+	for (i = 0; i < nchunks; i++) {
+		uintptr_t chunk = (start & ~(uintptr_t)(CHUNK - 1)) + i * CHUNK;
+
+		pages[i] = (void *)(MAX(chunk, start) & ~(uintptr_t)4095);
+	}
+
+	/* move_pages() with no target nodes just reports where they are */
+	if (syscall(SYS_move_pages, 0, nchunks, pages, NULL, node, 0) < 0) {
+		free(node);
+		node = NULL;
+	}
+
+	free(pages);
+	return node;
+}
+
+/*
+ * run -- flush chunks of the current job until there are none left
+ *
+ * The chunks on this thread's node are taken first, starting at a
+ * different place for each thread to keep them from fighting over
+ * the same chunks, then whatever's left anywhere.
+ */
+static void
+run(void (*fn)(void *addr, size_t len, int flags), int id)
+{
+	size_t n = Job.nchunks;
+	size_t first = n * id / (Nworkers + 1);
+	int node = Job.node ? pmem_numa_mynode() : 0;
+	int pass;
+	size_t j;
+
+	for (pass = Job.node ? 0 : 1; pass < 2; pass++)
+		for (j = 0; j < n; j++) {
+			size_t i = (first + j) % n;
+			uintptr_t start;
+			uintptr_t end;
+
+			if (pass == 0 && Job.node[i] != node)
+				continue;
+			if (Job.claimed[i] ||
+			    __atomic_exchange_n(&Job.claimed[i], 1,
+					__ATOMIC_ACQ_REL))
+				continue;
+
+			start = (Job.start & ~(uintptr_t)(CHUNK - 1)) +
+				i * CHUNK;
+			end = start + CHUNK;
+			if (start < Job.start)
+				start = Job.start;
+			if (end > Job.end)
+				end = Job.end;
+
+			(*fn)((void *)start, end - start, Job.flags);
+		}
+}
+
+/*
+ * worker -- worker thread, helping with each job as it comes along
+ */
+static void *
+worker(void *arg)
+{
+	int id = (int)(intptr_t)arg;
+	unsigned long gen = 0;
+
+	for (;;) {
+		void (*fn)(void *addr, size_t len, int flags);
+
+		pthread_mutex_lock(&Lock);
+		while (Gen == gen)
+			pthread_cond_wait(&Work, &Lock);
+		gen = Gen;
+		if ((fn = Job.fn) == NULL) {
+			/* woke up too late, it's already over */
+			pthread_mutex_unlock(&Lock);
+			continue;
+		}
+		Busy++;
+		pthread_mutex_unlock(&Lock);
+
+		run(fn, id);
+
+		pthread_mutex_lock(&Lock);
+		if (--Busy == 0)
+			pthread_cond_signal(&Idle);
+		pthread_mutex_unlock(&Lock);
+	}
+
+	return NULL;
+}
+
+/*
+ * start_workers -- start the worker threads
+ */
+static void
+start_workers(void)
+{
+	pthread_attr_t attr;
+	pthread_t tid;
+	int i;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	for (i = 0; i < Nworkers; i++)
+		if ((errno = pthread_create(&tid, &attr, worker,
+					(void *)(intptr_t)(i + 1))) != 0)
+			FATALSYS("pthread_create");
+
+	pthread_attr_destroy(&attr);
+
+	DEBUG("%d workers", Nworkers);
+}
+
+/*
+ * pmem_parallel -- call fn on chunks of a range, on several threads
+ *
+ * fn is passed the caller's flags with each chunk, and must leave the
+ * chunk persistent, fence and all, by the time it returns.  Returns 0
+ * once every chunk is done, or -1 if the range wasn't handled because
+ * another one is in progress, leaving it to the caller.
+ */
+int
+pmem_parallel(void (*fn)(void *addr, size_t len, int flags), void *addr,
+		size_t len, int flags)
+{
+	uintptr_t start = (uintptr_t)addr;
+
+	pthread_once(&Once, start_workers);
+
+	if (pthread_mutex_trylock(&Job_lock) != 0)
+		return -1;
+
+	Job.flags = flags;
+	Job.start = start;
+	Job.end = start + len;
+	Job.nchunks = (Job.end - (start & ~(uintptr_t)(CHUNK - 1)) +
+			CHUNK - 1) / CHUNK;
+	if ((Job.claimed = calloc(Job.nchunks, 1)) == NULL) {
+		pthread_mutex_unlock(&Job_lock);
+		return -1;
+	}
+	Job.node = nodes(start, Job.nchunks);
+
+	pthread_mutex_lock(&Lock);
+	Job.fn = fn;
+	Gen++;
+	pthread_cond_broadcast(&Work);
+	pthread_mutex_unlock(&Lock);
+
+	run(fn, 0);
+
+	/* every chunk is taken, wait for the workers to finish theirs */
+	pthread_mutex_lock(&Lock);
+	Job.fn = NULL;
+	while (Busy)
+		pthread_cond_wait(&Idle, &Lock);
+	pthread_mutex_unlock(&Lock);
+
+	free(Job.claimed);
+	free(Job.node);
+
+	pthread_mutex_unlock(&Job_lock);
+
+	return 0;
+}
@@ -0,0 +1,199 @@
+/*
+ * Copyright (c) 2013, Intel Corporation
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ * 
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ * 
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * pmem_registry.c -- the mappings libpmem knows about
+ *
+ * Every pmem_map() adds the new mapping to a registry, kept as an array
+ * sorted by address, with the start addresses in an array of their own
+ * so the binary search touches as few cache lines as possible.  The
+ * implementations that need to find the mapping an address belongs to
+ * (to find the file behind it in fit mode, for example) look it up
+ * with pmem_reg_find().  Since a program tends to work on one pool for
+ * a while, each thread remembers the last mapping it found, and tries
+ * that first without taking any locks.
+ */
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "util/util.h"
+#include "pmem_internal.h"
+
+static pthread_rwlock_t Lock = PTHREAD_RWLOCK_INITIALIZER;
+static uintptr_t *Starts;		/* start of each mapping, sorted */
+static struct pmem_mapping **Maps;	/* the mapping for each start */
+static int Nmaps;
+static int Maxmaps;
+static unsigned long Gen;		/* bumped on every add or remove */
+
+/*
+ * each thread's last successful lookup, valid while Gen hasn't changed
+ */
+static __thread struct {
+	struct pmem_mapping *mp;
+	unsigned long gen;
+} Last;
+
+/*
+ * search -- return the index of the last mapping starting at or below addr
+ *
+ * Returns -1 if there isn't one.  Called with Lock held.
+ */
+static int
+search(uintptr_t addr)
+{
+	int lo = 0;
+	int hi = Nmaps;
+
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+
+		if (Starts[mid] <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo - 1;
+}
+
+/*
+ * pmem_reg_add -- add a new mapping to the registry
+ *
+ * Returns the new entry, with fd and node set to -1 and priv to NULL,
+ * for the caller to fill in as needed.  pmem_map_ex() fills in limit
+ * and oflags.
+ */
+struct pmem_mapping *
+pmem_reg_add(void *addr, size_t len)
+{
+	struct pmem_mapping *mp;
+	int i;
+
+	if ((mp = calloc(1, sizeof(*mp))) == NULL)
+		FATALSYS("calloc");
+
+	mp->start = (uintptr_t)addr;
+	mp->end = mp->start + len;
+	mp->limit = mp->end;
+	mp->fd = -1;
+	mp->node = -1;
+
+	pthread_rwlock_wrlock(&Lock);
+
+	if (Nmaps == Maxmaps) {
+		Maxmaps = Maxmaps ? Maxmaps * 2 : 16;
+		if ((Starts = realloc(Starts,
+				sizeof(*Starts) * Maxmaps)) == NULL ||
+		    (Maps = realloc(Maps,
+				sizeof(*Maps) * Maxmaps)) == NULL)
+			FATALSYS("realloc");
+	}
+
+	i = search(mp->start) + 1;
+	memmove(&Starts[i + 1], &Starts[i], sizeof(*Starts) * (Nmaps - i));
+	memmove(&Maps[i + 1], &Maps[i], sizeof(*Maps) * (Nmaps - i));
+	Starts[i] = mp->start;
+	Maps[i] = mp;
+	Nmaps++;
+	__atomic_add_fetch(&Gen, 1, __ATOMIC_RELEASE);
+
+	pthread_rwlock_unlock(&Lock);
+
+	DEBUG("%p len %zu, %d mappings", addr, len, Nmaps);
+
+	return mp;
+}
+
+/*
+ * pmem_reg_remove -- remove the mapping starting at addr from the registry
+ *
+ * Returns the entry, which the caller frees, or NULL if addr isn't the
+ * start of a registered mapping.
+ */
+struct pmem_mapping *
+pmem_reg_remove(void *addr)
+{
+	struct pmem_mapping *mp = NULL;
+	int i;
+
+	pthread_rwlock_wrlock(&Lock);
+
+	if ((i = search((uintptr_t)addr)) >= 0 &&
+			Starts[i] == (uintptr_t)addr) {
+		mp = Maps[i];
+		memmove(&Starts[i], &Starts[i + 1],
+				sizeof(*Starts) * (Nmaps - i - 1));
+		memmove(&Maps[i], &Maps[i + 1],
+				sizeof(*Maps) * (Nmaps - i - 1));
+		Nmaps--;
+		__atomic_add_fetch(&Gen, 1, __ATOMIC_RELEASE);
+	}
+
+	pthread_rwlock_unlock(&Lock);
+
+	return mp;
+}
+
+/*
+ * pmem_reg_find -- return the mapping containing addr, or NULL
+ */
+struct pmem_mapping *
+pmem_reg_find(const void *addr)
+{
+	struct pmem_mapping *mp = Last.mp;
+	uintptr_t uptr = (uintptr_t)addr;
+	int i;
+
+	if (mp && Last.gen == __atomic_load_n(&Gen, __ATOMIC_ACQUIRE) &&
+			uptr >= mp->start && uptr < mp->end)
+		return mp;
+
+	pthread_rwlock_rdlock(&Lock);
+
+	if ((i = search(uptr)) >= 0 && uptr < Maps[i]->end) {
+		mp = Maps[i];
+		Last.mp = mp;
+		Last.gen = Gen;
+	} else
+		mp = NULL;
+
+	pthread_rwlock_unlock(&Lock);
+
+	return mp;
+}
@@ -0,0 +1,482 @@
+/*
+ * Copyright (c) 2013, Intel Corporation
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ * 
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ * 
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * pmem_stats.c -- persistence statistics for libpmem
+ *
+ * When turned on, with pmem_stats_enable() or by setting PMEM_STATS in
+ * the environment, the libpmem entry points count what they do: bytes
+ * persisted, cache lines flushed, lines flushed again shortly after
+ * they were last flushed, fences, drains, msync() calls, and persists
+ * by threads running on a different NUMA node than the mapping.  The
+ * counts are kept per thread, with no locking, and charged to the call
+ * site that called into libpmem, found with __builtin_return_address().
+ *
+ * When a libpmem entry point calls another one (pmem_batch_commit()
+ * calling pmem_persist_iov(), for example), everything is charged to
+ * the outermost call, so the sites reported are in the caller's code.
+ *
+ * When statistics are off, all this costs the entry points is a test
+ * of Pmem_stats.
+ */
+
+#define	_GNU_SOURCE
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <dlfcn.h>
+#include <pthread.h>
+
+#include "util/util.h"
+#include "pmem.h"
+#include "pmem_internal.h"
+
+#define	LINE 64		/* lines are counted in 64B units */
+#define	SITES 256	/* call sites tracked per thread, power of 2 */
+#define	RECENT 1024	/* recently flushed lines, power of 2 */
+#define	WINDOW 1024	/* a line flushed within this many lines is redundant */
+
+/*
+ * the statistics kept by each thread
+ */
+struct tstats {
+	struct tstats *next;		/* list of all threads' stats */
+	struct pmem_stats_site *cur;	/* site of the outermost entry point */
+	unsigned long seq;		/* lines flushed so far, for Recent */
+	struct {
+		uintptr_t line;
+		unsigned long seq;
+	} recent[RECENT];
+	struct pmem_stats_site sites[SITES];	/* open addressing */
+	struct pmem_stats_site other;	/* sites that didn't fit */
+};
+
+int Pmem_stats;				/* statistics are on */
+static __thread struct tstats *Mine;	/* this thread's statistics */
+static struct tstats *All;		/* every thread's statistics */
+static pthread_mutex_t Lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * pmem_stats_init -- turn statistics on if PMEM_STATS is set
+ *
+ * They're dumped to stderr at exit in that case.
+ */
+static void
+pmem_stats_exit(void)
+{
+	pmem_stats_dump(stderr);
+}
+
+static void __attribute__((constructor))
+pmem_stats_init(void)
+{
+	if (getenv("PMEM_STATS") != NULL) {
+		Pmem_stats = 1;
+		atexit(pmem_stats_exit);
+	}
+}
+
+/*
+ * pmem_stats_enable -- turn statistics on or off
+ */
+void
+pmem_stats_enable(int on)
+{
+	Pmem_stats = on;
+}
+
+/*
+ * mine -- return the calling thread's statistics, creating them if needed
+ */
+static struct tstats *
+mine(void)
+{
+	struct tstats *tp;
+
+	if ((tp = Mine) != NULL)
+		return tp;
+
+	if ((tp = calloc(1, sizeof(*tp))) == NULL)
+		FATALSYS("calloc");
+
+	pthread_mutex_lock(&Lock);
+	tp->next = All;
+	All = tp;
+	pthread_mutex_unlock(&Lock);
+
+	return Mine = tp;
+}
+
+/*
+ * pmem_stats_enter -- note the call site of an outermost entry point
+ *
+ * Returns the site if this is the outermost entry point, which must be
+ * passed to pmem_stats_leave(), or NULL for nested calls.
+ */
+void *
+pmem_stats_enter(void *caller)
+{
+	struct tstats *tp = mine();
+	unsigned i;
+	unsigned n;
+
+	if (tp->cur)
+		return NULL;
+
+	i = ((uintptr_t)caller * 0x9E3779B97F4A7C15ULL) >> 56;
+	for (n = 0; n < SITES; n++, i = (i + 1) & (SITES - 1)) {
+		struct pmem_stats_site *sp = &tp->sites[i];
+
+		if (sp->caller == caller)
+			return tp->cur = sp;
+
+		if (sp->caller == NULL) {
+			sp->caller = caller;
+			return tp->cur = sp;
+		}
+	}
+
+	return tp->cur = &tp->other;
+}
+
+/*
+ * pmem_stats_leave -- done with the outermost entry point
+ */
+void
+pmem_stats_leave(void *site)
+{
+	Mine->cur = NULL;
+}
+
+/*
+ * cur -- return the site being charged by the calling thread
+ *
+ * Work done outside of any entry point (there shouldn't be any)
+ * is charged to the catch-all site.
+ */
+static struct pmem_stats_site *
+cur(void)
+{
+	struct tstats *tp = mine();
+
+	return tp->cur ? tp->cur : &tp->other;
+}
+
+/*
+ * pmem_stats_flush -- count the lines flushed for a range
+ */
+void
+pmem_stats_flush(const void *addr, size_t len)
+{
+	struct tstats *tp = mine();
+	struct pmem_stats *sp = &cur()->stats;
+	uintptr_t line;
+	uintptr_t end = (uintptr_t)addr + len;
+
+	sp->bytes += len;
+
+	for (line = (uintptr_t)addr & ~(LINE - 1); line < end; line += LINE) {
+		unsigned i = (line / LINE) & (RECENT - 1);
+
+		if (tp->recent[i].line == line &&
+				tp->seq - tp->recent[i].seq < WINDOW)
+			sp->redundant++;
+
+		tp->recent[i].line = line;
+		tp->recent[i].seq = tp->seq++;
+		sp->lines++;
+	}
+}
+
+/*
+ * pmem_stats_persist -- count a persist: a flush, a fence and a drain
+ */
+void
+pmem_stats_persist(const void *addr, size_t len)
+{
+	struct pmem_stats *sp = &cur()->stats;
+
+	sp->persists++;
+	sp->fences++;
+	sp->drains++;
+
+	if (len == 0)
+		return;
+
+	pmem_stats_flush(addr, len);
+
+	if (pmem_numa_multinode()) {
+		struct pmem_mapping *mp = pmem_reg_find(addr);
+
+		if (mp && mp->node >= 0 && mp->node != pmem_numa_mynode())
+			sp->remote++;
+	}
+}
+
+/*
+ * pmem_stats_fence -- count a fence
+ */
+void
+pmem_stats_fence(void)
+{
+	cur()->stats.fences++;
+}
+
+/*
+ * pmem_stats_drain -- count a drain
+ */
+void
+pmem_stats_drain(void)
+{
+	cur()->stats.drains++;
+}
+
+/*
+ * pmem_stats_msync -- count a call to msync()
+ *
+ * Called by the msync-based implementations.
+ */
+void
+pmem_stats_msync(void)
+{
+	if (Pmem_stats)
+		cur()->stats.msyncs++;
+}
+
+/*
+ * add -- add one set of counts to another
+ */
+static void
+add(struct pmem_stats *to, const struct pmem_stats *from)
+{
+	to->persists += from->persists;
+	to->bytes += from->bytes;
+	to->lines += from->lines;
+	to->redundant += from->redundant;
+	to->fences += from->fences;
+	to->drains += from->drains;
+	to->msyncs += from->msyncs;
+	to->remote += from->remote;
+}
+
+/*
+ * pmem_stats_get -- return the counts for all threads and call sites
+ *
+ * The counts of running threads may be a little behind.
+ */
+void
+pmem_stats_get(struct pmem_stats *statsp)
+{
+	struct tstats *tp;
+	int i;
+
+	memset(statsp, 0, sizeof(*statsp));
+
+	pthread_mutex_lock(&Lock);
+	for (tp = All; tp; tp = tp->next) {
+		for (i = 0; i < SITES; i++)
+			add(statsp, &tp->sites[i].stats);
+		add(statsp, &tp->other.stats);
+	}
+	pthread_mutex_unlock(&Lock);
+}
+
+/*
+ * by_caller -- qsort comparison for sites, by caller address
+ */
+static int
+by_caller(const void *a, const void *b)
+{
+	uintptr_t ca = (uintptr_t)((const struct pmem_stats_site *)a)->caller;
+	uintptr_t cb = (uintptr_t)((const struct pmem_stats_site *)b)->caller;
+
+	return (ca > cb) - (ca < cb);
+}
+
+/*
+ * by_lines -- qsort comparison for sites, most lines flushed first
+ */
+static int
+by_lines(const void *a, const void *b)
+{
+	const struct pmem_stats *sa = &((const struct pmem_stats_site *)a)->stats;
+	const struct pmem_stats *sb = &((const struct pmem_stats_site *)b)->stats;
+
+	if (sa->lines != sb->lines)
+		return (sa->lines < sb->lines) - (sa->lines > sb->lines);
+
+	return (sa->msyncs < sb->msyncs) - (sa->msyncs > sb->msyncs);
+}
+
+/*
+ * pmem_stats_sites -- return the counts for each call site
+ *
+ * The counts from all threads are combined by call site, and the sites
+ * are sorted by the number of lines flushed, most first.  Up to max
+ * sites are stored in sites, and the total number of sites is returned.
+ * Counts that couldn't be charged to a particular site appear with a
+ * NULL caller.
+ */
+int
+pmem_stats_sites(struct pmem_stats_site *sites, int max)
+{
+	struct pmem_stats_site *all = NULL;
+	struct tstats *tp;
+	int n = 0;
+	int nthreads = 0;
+	int i;
+	int j;
+
+	pthread_mutex_lock(&Lock);
+
+	for (tp = All; tp; tp = tp->next)
+		nthreads++;
+
+	if (nthreads && (all = malloc(sizeof(*all) *
+				nthreads * (SITES + 1))) == NULL)
+		FATALSYS("malloc");
+
+	for (tp = All; tp; tp = tp->next) {
+		for (i = 0; i < SITES; i++)
+			if (tp->sites[i].caller)
+				all[n++] = tp->sites[i];
+		if (tp->other.stats.persists || tp->other.stats.lines ||
+				tp->other.stats.fences ||
+				tp->other.stats.drains ||
+				tp->other.stats.msyncs) {
+			all[n] = tp->other;
+			all[n++].caller = NULL;
+		}
+	}
+
+	pthread_mutex_unlock(&Lock);
+
+	/* combine the same site from different threads */
+	qsort(all, n, sizeof(*all), by_caller);
+	for (i = 0, j = -1; i < n; i++)
+		if (j >= 0 && all[j].caller == all[i].caller)
+			add(&all[j].stats, &all[i].stats);
+		else
+			all[++j] = all[i];
+	n = j + 1;
+
+	qsort(all, n, sizeof(*all), by_lines);
+	if (max > 0)
+		memcpy(sites, all, sizeof(*all) * (n < max ? n : max));
+
+	free(all);
+	return n;
+}
+
+/*
+ * pmem_stats_reset -- zero all the counts
+ */
+void
+pmem_stats_reset(void)
+{
+	struct tstats *tp;
+	int i;
+
+	pthread_mutex_lock(&Lock);
+	for (tp = All; tp; tp = tp->next) {
+		for (i = 0; i < SITES; i++)
+			memset(&tp->sites[i].stats, 0,
+					sizeof(tp->sites[i].stats));
+		memset(&tp->other.stats, 0, sizeof(tp->other.stats));
+	}
+	pthread_mutex_unlock(&Lock);
+}
+
+/*
+ * pmem_stats_dump -- print the counts, totals first, then by call site
+ *
+ * Call sites are printed as function+offset when the symbol can be
+ * found, otherwise as an offset into the object file that addr2line(1)
+ * can use.
+ */
+void
+pmem_stats_dump(FILE *fp)
+{
+	struct pmem_stats total;
+	struct pmem_stats_site *sites;
+	int n;
+	int i;
+
+	pmem_stats_get(&total);
+
+	fprintf(fp, "libpmem statistics:\n");
+	fprintf(fp, "%10s %12s %10s %10s %10s %10s %10s %10s  %s\n",
+			"persists", "bytes", "lines", "redundant",
+			"fences", "drains", "msyncs", "remote", "call site");
+	fprintf(fp, "%10lu %12lu %10lu %10lu %10lu %10lu %10lu %10lu  TOTAL\n",
+			total.persists, total.bytes, total.lines,
+			total.redundant, total.fences, total.drains,
+			total.msyncs, total.remote);
+
+	n = pmem_stats_sites(NULL, 0);
+	if ((sites = malloc(sizeof(*sites) * (n ? n : 1))) == NULL)
+		FATALSYS("malloc");
+	n = pmem_stats_sites(sites, n);
+
+	for (i = 0; i < n; i++) {
+		struct pmem_stats *sp = &sites[i].stats;
+		Dl_info info;
+
+		/* sites that only add to a batch are charged nothing */
+		if (sp->persists == 0 && sp->lines == 0 && sp->fences == 0 &&
+				sp->drains == 0 && sp->msyncs == 0)
+			continue;
+
+		fprintf(fp, "%10lu %12lu %10lu %10lu %10lu %10lu %10lu %10lu  ",
+				sp->persists, sp->bytes, sp->lines,
+				sp->redundant, sp->fences, sp->drains,
+				sp->msyncs, sp->remote);
+
+		if (sites[i].caller == NULL)
+			fprintf(fp, "(other)\n");
+		else if (dladdr(sites[i].caller, &info) == 0)
+			fprintf(fp, "%p\n", sites[i].caller);
+		else if (info.dli_sname)
+			fprintf(fp, "%s+0x%lx\n", info.dli_sname,
+					(uintptr_t)sites[i].caller -
+					(uintptr_t)info.dli_saddr);
+		else
+			fprintf(fp, "%s+0x%lx\n", info.dli_fname,
+					(uintptr_t)sites[i].caller -
+					(uintptr_t)info.dli_fbase);
+	}
+
+	free(sites);
+}
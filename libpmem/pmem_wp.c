@@ -0,0 +1,381 @@
+/*
+ * Copyright (c) 2013, Intel Corporation
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ * 
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ * 
+ *     * Neither the name of Intel Corporation nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * pmem_wp.c -- write-protect based dirty page tracking for msync mode
+ *
+ * When enabled with pmem_track_dirty(), pmem_map_msync() maps the file
+ * read-only and registers it here.  The first store to each page takes
+ * a SIGSEGV, which the handler below turns into a bit in the mapping's
+ * dirty bitmap before making the page writable again, so the store
+ * succeeds when the faulting instruction is restarted.  Later stores
+ * to the same page run at full speed.
+ *
+ * pmem_sync_dirty() walks the bitmaps, write-protects each run of
+ * dirty pages again and msyncs it, so the cost of a sync depends on
+ * how much was written since the last one, not on the size of the pool.
+ *
+ * This is done with mprotect() rather than userfaultfd write-protect,
+ * which needs a much newer kernel, doesn't support shared file mappings
+ * on most of them, and needs a separate thread to service the faults.
+ */
+
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "util/util.h"
+#include "pmem_internal.h"
+
+#define	ALIGN 4096	/* assumes 4k page size for use with msync() */
+#define	MAXREGIONS 256	/* maximum number of tracked regions */
+#define	BITS (8 * sizeof(unsigned long))
+
+/*
+ * a tracked mapping and its dirty page bitmap, one bit per page
+ */
+struct region {
+	uintptr_t start;
+	uintptr_t end;
+	unsigned long *bitmap;
+	int users;		/* signal handlers looking at the entry */
+};
+
+/*
+ * The signal handler reads the region table without taking any locks.
+ * Nregions is only bumped after a new entry is filled in, and an entry
+ * is unused when its end is zero, which keeps the handler from matching
+ * it while it's being filled in or torn down.  Unused entries below
+ * Nregions get reused.
+ *
+ * The handler counts itself in users before it looks at an entry, and
+ * pmem_wp_unregister() zeroes end and then waits for users to drop to
+ * zero before freeing the bitmap, so a fault racing with an unmap never
+ * writes to a freed bitmap.  A handler that came in after end was
+ * zeroed doesn't match the entry; one that came in before is waited
+ * for.  Since end is filled in last, a handler that sees a non-zero end
+ * also sees the start and bitmap that go with it.
+ */
+static struct region Regions[MAXREGIONS];
+static volatile int Nregions;
+static pthread_mutex_t Lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sigaction Oldact;		/* handler we chain to */
+static int Installed;			/* wp_handler is installed */
+static int Track_dirty;
+
+/*
+ * pmem_track_dirty -- turn on dirty page tracking for msync mode
+ *
+ * Must be called before pmem_map().
+ */
+void
+pmem_track_dirty(void)
+{
+	Track_dirty = 1;
+}
+
+/*
+ * pmem_wp_enabled -- return true if pmem_map() should register mappings
+ */
+int
+pmem_wp_enabled(void)
+{
+	return Track_dirty;
+}
+
+/*
+ * all_dirty -- make a whole region writable and mark every page dirty
+ *
+ * Internal support routine.  Unprotecting the pages one at a time
+ * splits the mapping into a kernel VMA per run of pages, and with
+ * enough scattered dirty pages between syncs, mprotect() runs into
+ * vm.max_map_count and fails with ENOMEM.  Unprotecting the whole
+ * region merges its VMAs back into one instead, at the cost of the next
+ * pmem_sync_dirty() syncing all of it.
+ */
+static void
+all_dirty(struct region *rp, uintptr_t start, uintptr_t end)
+{
+	size_t npages = (end - start) / ALIGN;
+	size_t w;
+
+	/* writable first, then dirty, for the same reason as below */
+	if (mprotect((void *)start, end - start, PROT_READ|PROT_WRITE) < 0)
+		FATALSYS("mprotect of tracked mapping %p", (void *)start);
+
+	for (w = 0; w < npages / BITS; w++)
+		__sync_fetch_and_or(&rp->bitmap[w], ~0UL);
+	if (npages % BITS)
+		__sync_fetch_and_or(&rp->bitmap[w],
+				(1UL << (npages % BITS)) - 1);
+}
+
+/*
+ * wp_handler -- SIGSEGV handler that records first writes to a page
+ */
+static void
+wp_handler(int sig, siginfo_t *info, void *ucontext)
+{
+	uintptr_t addr = (uintptr_t)info->si_addr;
+	int n = Nregions;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		struct region *rp = &Regions[i];
+		uintptr_t start;
+		uintptr_t end;
+		uintptr_t page;
+
+		__atomic_add_fetch(&rp->users, 1, __ATOMIC_SEQ_CST);
+		end = __atomic_load_n(&rp->end, __ATOMIC_SEQ_CST);
+		start = __atomic_load_n(&rp->start, __ATOMIC_SEQ_CST);
+		if (addr < start || addr >= end) {
+			__atomic_sub_fetch(&rp->users, 1, __ATOMIC_SEQ_CST);
+			continue;
+		}
+
+		/*
+		 * Make the page writable before marking it dirty.  Done
+		 * the other way around, pmem_sync_dirty() could clear the
+		 * bit and write-protect the page in between, and then the
+		 * mprotect() here would leave a writable page that isn't
+		 * marked dirty.  The fault is ours either way, so if the
+		 * page can't be unprotected alone, the whole region is.
+		 */
+		page = (addr - start) / ALIGN;
+		if (mprotect((void *)(addr & ~(ALIGN - 1)), ALIGN,
+					PROT_READ|PROT_WRITE) < 0)
+			all_dirty(rp, start, end);
+		else
+			__sync_fetch_and_or(&rp->bitmap[page / BITS],
+					1UL << (page % BITS));
+
+		__atomic_sub_fetch(&rp->users, 1, __ATOMIC_SEQ_CST);
+		return;
+	}
+
+	/*
+	 * Not one of ours.  Pass it along to whatever handler was there
+	 * before, or put the old action back and return, letting the
+	 * faulting instruction run again and fault the usual way.
+	 */
+	if ((Oldact.sa_flags & SA_SIGINFO) && Oldact.sa_sigaction != NULL)
+		(*Oldact.sa_sigaction)(sig, info, ucontext);
+	else if (Oldact.sa_handler != SIG_DFL && Oldact.sa_handler != SIG_IGN)
+		(*Oldact.sa_handler)(sig);
+	else
+		sigaction(SIGSEGV, &Oldact, NULL);
+}
+
+/*
+ * pmem_wp_register -- start tracking writes to a new mapping
+ *
+ * The mapping is write-protected, so every page starts out clean.  A
+ * mapping that grows registers each new part as another region.
+ */
+void
+pmem_wp_register(void *addr, size_t len)
+{
+	struct region *rp;
+	size_t npages = (len + ALIGN - 1) / ALIGN;
+	int i;
+
+	pthread_mutex_lock(&Lock);
+
+	for (i = 0; i < Nregions; i++)
+		if (Regions[i].end == 0)
+			break;
+
+	if (i == MAXREGIONS)
+		FATAL("too many mappings for dirty tracking (max %d)",
+				MAXREGIONS);
+
+	if (!Installed) {
+		struct sigaction act;
+
+		memset(&act, 0, sizeof(act));
+		act.sa_sigaction = wp_handler;
+		act.sa_flags = SA_SIGINFO|SA_RESTART;
+		sigemptyset(&act.sa_mask);
+
+		if (sigaction(SIGSEGV, &act, &Oldact) < 0)
+			FATALSYS("sigaction");
+		Installed = 1;
+	}
+
+	rp = &Regions[i];
+	if ((rp->bitmap = calloc((npages + BITS - 1) / BITS,
+					sizeof(unsigned long))) == NULL)
+		FATALSYS("calloc");
+	__atomic_store_n(&rp->start, (uintptr_t)addr, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&rp->end, rp->start + npages * ALIGN,
+			__ATOMIC_SEQ_CST);
+
+	if (mprotect(addr, npages * ALIGN, PROT_READ) < 0)
+		FATALSYS("mprotect");
+
+	__sync_synchronize();
+	if (i == Nregions)
+		Nregions++;
+
+	pthread_mutex_unlock(&Lock);
+
+	DEBUG("tracking %p, %zu pages", addr, npages);
+}
+
+/*
+ * pmem_wp_unregister -- stop tracking writes to a mapping
+ *
+ * Drops every region in [addr, addr + len).  Pages written since the
+ * last pmem_sync_dirty() aren't synced; like any other dirty pages of
+ * a shared mapping, they're written back by the kernel eventually.
+ * A region's bitmap is only freed once no signal handler is using it.
+ */
+void
+pmem_wp_unregister(void *addr, size_t len)
+{
+	uintptr_t start = (uintptr_t)addr;
+	int i;
+
+	pthread_mutex_lock(&Lock);
+
+	for (i = 0; i < Nregions; i++) {
+		struct region *rp = &Regions[i];
+
+		if (rp->end == 0 || rp->start < start ||
+		    rp->start >= start + len)
+			continue;
+
+		__atomic_store_n(&rp->end, 0, __ATOMIC_SEQ_CST);
+		while (__atomic_load_n(&rp->users, __ATOMIC_SEQ_CST))
+			sched_yield();
+		rp->start = 0;
+		free(rp->bitmap);
+		rp->bitmap = NULL;
+	}
+
+	pthread_mutex_unlock(&Lock);
+}
+
+/*
+ * sync_run -- write-protect and msync a run of dirty pages
+ */
+static void
+sync_run(struct region *rp, size_t first, size_t last)
+{
+	void *addr = (void *)(rp->start + first * ALIGN);
+	size_t len = (last - first) * ALIGN;
+
+	/*
+	 * The bits for these pages have already been cleared, so a store
+	 * landing before the mprotect() is caught by the msync() below,
+	 * and one landing after it faults and marks the page dirty again.
+	 */
+	if (mprotect(addr, len, PROT_READ) < 0)
+		FATALSYS("mprotect");
+
+	if (msync(addr, len, MS_SYNC) < 0)
+		FATALSYS("msync");
+
+	pmem_stats_msync();
+}
+
+/*
+ * pmem_sync_dirty -- make every page written since the last call durable
+ *
+ * Runs of adjacent dirty pages are synced with a single msync() call.
+ * Does nothing unless dirty tracking was turned on with
+ * pmem_track_dirty() before mapping.
+ */
+void
+pmem_sync_dirty(void)
+{
+	int n;
+	int i;
+	void *site;
+
+	PMEM_STATS_ENTER(site);
+	pthread_mutex_lock(&Lock);
+
+	n = Nregions;
+
+	for (i = 0; i < n; i++) {
+		struct region *rp = &Regions[i];
+		size_t npages = (rp->end - rp->start) / ALIGN;
+		size_t nwords = (npages + BITS - 1) / BITS;
+		size_t first = 0;	/* start of current run, if any */
+		int inrun = 0;
+		size_t w;
+
+		for (w = 0; w < nwords; w++) {
+			unsigned long bits;
+			size_t b;
+
+			if (rp->bitmap[w] == 0) {
+				if (inrun) {
+					sync_run(rp, first, w * BITS);
+					inrun = 0;
+				}
+				continue;
+			}
+
+			bits = __sync_lock_test_and_set(&rp->bitmap[w], 0);
+
+			for (b = 0; b < BITS; b++) {
+				size_t page = w * BITS + b;
+
+				if (bits & (1UL << b)) {
+					if (!inrun) {
+						first = page;
+						inrun = 1;
+					}
+				} else if (inrun) {
+					sync_run(rp, first, page);
+					inrun = 0;
+				}
+			}
+		}
+
+		if (inrun)
+			sync_run(rp, first, npages);
+	}
+
+	pthread_mutex_unlock(&Lock);
+	PMEM_STATS_LEAVE(site);
+}
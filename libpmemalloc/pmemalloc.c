@@ -37,6 +37,7 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/param.h>
+#include <sys/uio.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -44,11 +45,22 @@
 #include <errno.h>
 #include <string.h>
 #include <stdarg.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include "util/util.h"
 #include "libpmem/pmem.h"
 #include "pmemalloc.h"
 
+/*
+ * a pointer assignment to make on activate or free: ptr_ is stored at
+ * offset off in the pool.
+ */
+struct onstore {
+	off_t off;
+	void *ptr_;
+};
+
 /*
  * hidden bytes added to each allocation.  the metadata we keep for
  * each allocation is 64 bytes in size so when we return the
@@ -57,10 +69,7 @@
 struct clump {
 	size_t size;			/* size of the clump */
 	size_t prevsize;		/* size of previous (lower) clump */
-	struct {
-		off_t off;
-		void *ptr_;
-	} on[PMEM_NUM_ON];
+	struct onstore on[PMEM_NUM_ON];
 };
 
 /*
@@ -69,7 +78,8 @@ struct clump {
 struct pool_header {
 	char signature[16];	/* must be PMEM_SIGNATURE */
 	size_t totalsize;	/* total file size */
-	char padding[4096 - 16 - sizeof(size_t)];
+	struct slab *slabs_;	/* list of slabs, see pmemalloc_slab_new() */
+	char padding[4096 - 16 - sizeof(size_t) - sizeof(void *)];
 };
 
 /*
@@ -97,6 +107,504 @@ struct pool_header {
  */
 #define	OFF(pmp, ptr) ((uintptr_t)ptr - (uintptr_t)pmp)
 
+/*
+ * size classes for the free clump index.  clumps of up to 4k (64
+ * chunks) get a class per size, so small requests are exact fits.
+ * bigger ones share a class per eighth of a power of two (the three
+ * bits below the leading one), so no class spans more than 12.5%.
+ */
+#define	PMEM_CLASS_SHIFT 6	/* log2 of the chunks with a class each */
+#define	PMEM_CLASS_LINEAR (1 << PMEM_CLASS_SHIFT)
+#define	PMEM_CLASS_SUB 3	/* log2 of the classes per power of two */
+#define	PMEM_NCLASSES 512	/* enough for any size_t clump size */
+#define	PMEM_CLASS_PROBE 8	/* clumps tried in a mixed class first */
+
+#define	PMEM_SLAB_NCLASSES 8	/* slot sizes, see Slab_sizes[] */
+#define	PMEM_SLAB_SLOTS 1024	/* most slots in a slab */
+#define	PMEM_SLAB_NREC 8	/* activates or frees in progress per slab */
+#define	PMEM_SLAB_SHIFT 14	/* log2 of the smallest slab */
+#define	PMEM_SLAB_LEAF 4096	/* slab map entries per leaf */
+#define	PMEM_SLAB_TOP 16384	/* slab map leaves, enough for 1TB */
+
+#define	PMEM_MAX_ARENAS 64	/* see pmemalloc_arenas() */
+#define	PMEM_TCACHE_CHUNKS 16	/* biggest clump a thread cache holds */
+#define	PMEM_TCACHE_MAX 64	/* see pmemalloc_tcache() */
+
+/*
+ * volatile view of the FREE clumps in an arena.  each FREE clump is
+ * covered by a list of vclumps in address order, each either free or
+ * reserved: reserving splits a free vclump, and freeing a reservation
+ * merges it back, without writing to the pool at all.  only activating
+ * a reservation splits the FREE clump in the pool to match.  so a crash
+ * forgets reservations without any recovery work, and pmemalloc_init()
+ * just makes a free vclump of each FREE clump.
+ *
+ * the free vclumps are on a list for their size class, and all of them
+ * are in a hash table by address, so a reservation can be found from
+ * its pointer, and the vclumps of a clump from its header.
+ */
+struct vclump {
+	struct clump *clp;		/* where its header is, or will be */
+	size_t size;
+	int reserved;
+	struct onstore on[PMEM_NUM_ON];	/* onactive list of a reservation */
+	struct vclump *lo;		/* vclumps of the same FREE clump */
+	struct vclump *hi;
+	struct vclump *prev;		/* free vclumps in the same class */
+	struct vclump *next;
+	struct vclump *hnext;		/* hash chain */
+};
+
+/*
+ * a pool is divided into arenas, each a run of clumps with its own lock
+ * and index, so threads working in different arenas don't contend.  a
+ * clump is never split or coalesced across the start of an arena, so
+ * it stays in the arena it's in.  the lock covers the vclumps and every
+ * change to a FREE clump; a clump that isn't FREE belongs to whoever
+ * activated it, and needs no lock until it's FREE again.
+ */
+struct arena {
+	pthread_mutex_t lock;
+	struct clump *start;		/* first clump in the arena */
+	struct vclump *classes[PMEM_NCLASSES];
+	uint64_t bitmap[PMEM_NCLASSES / 64];	/* classes not empty */
+	struct vclump **hash;
+	size_t nhash;			/* hash buckets, a power of two */
+	size_t nvclumps;		/* vclumps in the hash */
+	struct vclump *spare;		/* vclumps to reuse */
+};
+
+/*
+ * a slab is an ACTIVE clump divided into slots of one size, for small
+ * objects that would otherwise each pay for a clump header.  the slabs
+ * are kept on a persistent list starting in the pool header.  a bit
+ * in the bitmap is set for each ACTIVE slot; RESERVED slots are only
+ * known in DRAM, so a crash frees them without any recovery work.  an
+ * activate or free that also makes pointer assignments is done using
+ * a slabrec, which recovery finishes.
+ */
+struct slabrec {
+	uint32_t slot;
+	uint32_t state;		/* PMEM_STATE_ACTIVATING or _FREEING, or 0 */
+	struct onstore on[PMEM_NUM_ON];
+	char padding[8];
+};
+
+struct slab {
+	struct slab *next_;	/* next slab in the pool */
+	size_t slotsize;
+	size_t nslots;
+	char padding[40];
+	uint64_t bitmap[PMEM_SLAB_SLOTS / 64];	/* ACTIVE slots */
+	struct slabrec rec[PMEM_SLAB_NREC];
+};
+
+/*
+ * volatile state kept for each slab.  used has a bit set for each
+ * slot that's RESERVED or ACTIVE, and is what slots are claimed from,
+ * using atomic operations instead of a lock.
+ */
+struct slabinfo {
+	struct slab *sp;
+	size_t slotsize;
+	size_t nslots;
+	uint64_t used[PMEM_SLAB_SLOTS / 64];
+	unsigned recbusy;		/* slabrecs in use */
+	struct onstore (*on)[PMEM_NUM_ON];	/* each slot's on list */
+	struct slabinfo *next;		/* next slab with the same slot size */
+};
+
+/*
+ * the slab map finds the slab a slot is in, by the slot's offset in
+ * the pool.  every slab covers at least one 1 << PMEM_SLAB_SHIFT byte
+ * page, so no more than two slabs share a page.
+ */
+struct slabpage {
+	struct slabinfo *lo;		/* slab covering the start of the page */
+	struct slabinfo *hi;		/* slab starting inside the page */
+};
+
+struct pool {
+	void *pmp;
+	struct pool *next;
+	pthread_mutex_t growlock;	/* one pmemalloc_grow() at a time */
+	int narenas;
+	struct arena *arenas;
+	pthread_mutex_t slablock;	/* one pmemalloc_slab_new() at a time */
+	struct slabinfo *slabs[PMEM_SLAB_NCLASSES];	/* by slot size */
+	struct slabinfo *slabhint[PMEM_SLAB_NCLASSES];	/* last with room */
+	struct slabpage **slabmap;	/* PMEM_SLAB_TOP leaves */
+};
+
+/*
+ * a thread's cache of reserved clumps of the smaller sizes, filled by
+ * pmemalloc_free() and emptied by pmemalloc_reserve(), which takes no
+ * lock to do it.  like any reservation, they're FREE in the pool, so
+ * there's nothing for a crash (or an exit) to leave behind.
+ */
+struct tcache {
+	void *pmp;			/* the pool the clumps are in */
+	int count[PMEM_TCACHE_CHUNKS + 1];	/* by clump size in chunks */
+	struct vclump *clumps[PMEM_TCACHE_CHUNKS + 1][PMEM_TCACHE_MAX];
+};
+
+static const size_t Slab_sizes[PMEM_SLAB_NCLASSES] =
+	{ 16, 32, 48, 64, 96, 128, 192, PMEM_SLAB_MAX };
+
+static struct pool *Pools;	/* only ever added to, at the front */
+static pthread_mutex_t Pools_lock = PTHREAD_MUTEX_INITIALIZER;
+static int Narenas = 1;		/* for the pools set up from now on */
+static int Tcache_max;		/* clumps of each size, 0 for no caches */
+static unsigned Next_arena;	/* for handing out arenas round-robin */
+static __thread int Arena = -1;	/* this thread's arena */
+static __thread struct tcache *Tcache;
+static pthread_key_t Tcache_key;	/* to empty a cache at thread exit */
+static pthread_once_t Tcache_once = PTHREAD_ONCE_INIT;
+
+/*
+ * pmemalloc_class -- return the size class of a clump of n chunks
+ *
+ * Internal support routine.
+ */
+static int
+pmemalloc_class(size_t n)
+{
+	int b;
+
+	if (n < PMEM_CLASS_LINEAR)
+		return n;
+
+	b = 63 - __builtin_clzl(n);
+	return PMEM_CLASS_LINEAR +
+		((b - PMEM_CLASS_SHIFT) << PMEM_CLASS_SUB) +
+		((n >> (b - PMEM_CLASS_SUB)) & ((1 << PMEM_CLASS_SUB) - 1));
+}
+
+/*
+ * pmemalloc_class_up -- return the lowest class holding only clumps >= n
+ *
+ * Internal support routine.
+ */
+static int
+pmemalloc_class_up(size_t n)
+{
+	if (n >= PMEM_CLASS_LINEAR)
+		n += (1UL << (63 - __builtin_clzl(n) - PMEM_CLASS_SUB)) - 1;
+
+	return pmemalloc_class(n);
+}
+
+/*
+ * pmemalloc_pool -- return the volatile state kept for a pool
+ *
+ * Internal support routine.
+ */
+static struct pool *
+pmemalloc_pool(void *pmp)
+{
+	struct pool *pp;
+
+	for (pp = __atomic_load_n(&Pools, __ATOMIC_ACQUIRE); pp;
+			pp = pp->next)
+		if (pp->pmp == pmp)
+			break;
+
+	if (pp == NULL)
+		FATAL("pool 0x%lx not set up by pmemalloc_init", pmp);
+
+	return pp;
+}
+
+/*
+ * pmemalloc_hash -- return the hash bucket for a clump
+ *
+ * Internal support routine.
+ */
+static struct vclump **
+pmemalloc_hash(struct arena *ap, struct clump *clp)
+{
+	uintptr_t h = (uintptr_t)clp / PMEM_CHUNK_SIZE;
+
+	h *= 0x9E3779B97F4A7C15ULL;
+	return &ap->hash[(h >> 32) & (ap->nhash - 1)];
+}
+
+/*
+ * pmemalloc_vclump_new -- make a reserved vclump, on no list yet
+ *
+ * Internal support routine.
+ */
+static struct vclump *
+pmemalloc_vclump_new(struct arena *ap, struct clump *clp, size_t size)
+{
+	struct vclump *vp;
+	struct vclump **hp;
+
+	/* keep the hash chains short by doubling the table as it fills */
+	if (ap->nvclumps >= ap->nhash) {
+		struct vclump **oldhash = ap->hash;
+		size_t oldnhash = ap->nhash;
+		size_t i;
+
+		ap->nhash = oldnhash ? oldnhash * 2 : 1024;
+		if ((ap->hash = calloc(ap->nhash, sizeof(*ap->hash))) == NULL)
+			FATALSYS("calloc");
+
+		for (i = 0; i < oldnhash; i++)
+			while ((vp = oldhash[i]) != NULL) {
+				oldhash[i] = vp->hnext;
+				hp = pmemalloc_hash(ap, vp->clp);
+				vp->hnext = *hp;
+				*hp = vp;
+			}
+		free(oldhash);
+	}
+
+	if ((vp = ap->spare) != NULL)
+		ap->spare = vp->next;
+	else if ((vp = malloc(sizeof(*vp))) == NULL)
+		FATALSYS("malloc");
+
+	memset(vp, '\0', sizeof(*vp));
+	vp->clp = clp;
+	vp->size = size;
+	vp->reserved = 1;
+
+	hp = pmemalloc_hash(ap, clp);
+	vp->hnext = *hp;
+	*hp = vp;
+	ap->nvclumps++;
+
+	return vp;
+}
+
+/*
+ * pmemalloc_vclump_find -- return the vclump at clp, or NULL
+ *
+ * Internal support routine.
+ */
+static struct vclump *
+pmemalloc_vclump_find(struct arena *ap, struct clump *clp)
+{
+	struct vclump *vp;
+
+	for (vp = *pmemalloc_hash(ap, clp); vp; vp = vp->hnext)
+		if (vp->clp == clp)
+			break;
+
+	return vp;
+}
+
+/*
+ * pmemalloc_vclump_delete -- unhash a vclump, and keep it for reuse
+ *
+ * It must already be off its class list and its clump's list.
+ *
+ * Internal support routine.
+ */
+static void
+pmemalloc_vclump_delete(struct arena *ap, struct vclump *vp)
+{
+	struct vclump **hp;
+
+	for (hp = pmemalloc_hash(ap, vp->clp); *hp != vp; hp = &(*hp)->hnext)
+		if (*hp == NULL)
+			FATAL("clump 0x%lx not in the free index", vp->clp);
+
+	*hp = vp->hnext;
+	vp->next = ap->spare;
+	ap->spare = vp;
+	ap->nvclumps--;
+}
+
+/*
+ * pmemalloc_index_add -- add a free vclump to its class list
+ *
+ * Internal support routine.
+ */
+static void
+pmemalloc_index_add(struct arena *ap, struct vclump *vp)
+{
+	int c = pmemalloc_class(vp->size / PMEM_CHUNK_SIZE);
+
+	vp->prev = NULL;
+	if ((vp->next = ap->classes[c]) != NULL)
+		vp->next->prev = vp;
+	ap->classes[c] = vp;
+	ap->bitmap[c / 64] |= 1ULL << (c % 64);
+}
+
+/*
+ * pmemalloc_index_remove -- take a free vclump off its class list
+ *
+ * The vclump's size must still be the one it was added with.
+ *
+ * Internal support routine.
+ */
+static void
+pmemalloc_index_remove(struct arena *ap, struct vclump *vp)
+{
+	int c = pmemalloc_class(vp->size / PMEM_CHUNK_SIZE);
+
+	if (vp->next)
+		vp->next->prev = vp->prev;
+	if (vp->prev)
+		vp->prev->next = vp->next;
+	else if ((ap->classes[c] = vp->next) == NULL)
+		ap->bitmap[c / 64] &= ~(1ULL << (c % 64));
+}
+
+/*
+ * pmemalloc_vclump_free -- make a vclump free, merging it with its neighbours
+ *
+ * A free vclump never has another free one next to it, so a reserved
+ * one being freed merges with at most the one on each side.
+ *
+ * Internal support routine.
+ */
+static void
+pmemalloc_vclump_free(struct arena *ap, struct vclump *vp)
+{
+	struct vclump *lo = vp->lo;
+	struct vclump *hi = vp->hi;
+
+	vp->reserved = 0;
+
+	if (lo && !lo->reserved) {
+		pmemalloc_index_remove(ap, lo);
+		lo->size += vp->size;
+		if ((lo->hi = hi) != NULL)
+			hi->lo = lo;
+		pmemalloc_vclump_delete(ap, vp);
+		vp = lo;
+	}
+
+	if (hi && !hi->reserved) {
+		pmemalloc_index_remove(ap, hi);
+		vp->size += hi->size;
+		if ((vp->hi = hi->hi) != NULL)
+			vp->hi->lo = vp;
+		pmemalloc_vclump_delete(ap, hi);
+	}
+
+	pmemalloc_index_add(ap, vp);
+}
+
+/*
+ * pmemalloc_index_find -- find a free vclump of at least size bytes
+ *
+ * Any vclump in a class from pmemalloc_class_up() on is big enough, so
+ * the bitmap leads straight to one.  The class size itself falls in
+ * may hold vclumps both smaller and bigger than size, and using one of
+ * those instead of splitting a bigger one keeps fragmentation down,
+ * so the first few there are tried before that, and the rest only if
+ * nothing else fits.
+ *
+ * Internal support routine.
+ */
+static struct vclump *
+pmemalloc_index_find(struct arena *ap, size_t size)
+{
+	struct vclump *vp;
+	struct vclump *best = NULL;
+	int c = pmemalloc_class(size / PMEM_CHUNK_SIZE);
+	int i;
+	int w;
+
+	for (vp = ap->classes[c], i = 0; vp && i < PMEM_CLASS_PROBE;
+			vp = vp->next, i++) {
+		if (vp->size == size)
+			return vp;
+		if (vp->size > size && (best == NULL || vp->size < best->size))
+			best = vp;
+	}
+	if (best)
+		return best;
+
+	c = pmemalloc_class_up(size / PMEM_CHUNK_SIZE);
+	for (w = c / 64; w < PMEM_NCLASSES / 64; w++) {
+		uint64_t bits = ap->bitmap[w];
+
+		if (w == c / 64)
+			bits &= ~0ULL << (c % 64);
+		if (bits)
+			return ap->classes[w * 64 + __builtin_ctzll(bits)];
+	}
+
+	/* vp is where the probe above left off */
+	for (; vp; vp = vp->next)
+		if (vp->size >= size)
+			return vp;
+
+	return NULL;
+}
+
+/*
+ * pmemalloc_exec_on -- execute the pointer assignments in an on list
+ *
+ * The assignments don't depend on each other (recovery simply repeats
+ * all of them), so they're made persistent together using a single
+ * pmem_persist_iov() call instead of one pmem_persist() each.
+ *
+ * Internal support routine, used during activate, free and recovery.
+ */
+static void
+pmemalloc_exec_on(void *pmp, struct onstore *on)
+{
+	struct iovec iov[PMEM_NUM_ON];
+	int i;
+
+	for (i = 0; i < PMEM_NUM_ON; i++)
+		if (on[i].off) {
+			uintptr_t *dest = PMEM(pmp, (uintptr_t *)on[i].off);
+			*dest = (uintptr_t)on[i].ptr_;
+			iov[i].iov_base = dest;
+			iov[i].iov_len = sizeof(*dest);
+		} else
+			break;
+
+	if (i)
+		pmem_persist_iov(iov, i, 0);
+}
+
+/*
+ * pmemalloc_lastclump -- return the zero-sized clump ending a pool
+ *
+ * The location of the last clump is calculated by rounding the pool
+ * size down to a multiple of 64, and then subtracting off another 64
+ * to hold the struct clump.
+ *
+ * Internal support routine.
+ */
+static struct clump *
+pmemalloc_lastclump(void *pmp, size_t size)
+{
+	return PMEM(pmp, (struct clump *)
+		((size & ~(PMEM_CHUNK_SIZE - 1)) - PMEM_CHUNK_SIZE));
+}
+
+/*
+ * pmemalloc_fix_prevsize -- make a clump's prevsize match the clump below
+ *
+ * The sizes in the clumps are what define the pool; prevsize is just
+ * kept alongside so a clump's lower neighbour can be found without a
+ * scan, and is set along with or after the size it follows from.  So
+ * a crash may leave it stale (and pools from before it was kept have
+ * it zero), and recovery repairs it from the sizes.
+ *
+ * Internal support routine, used during recovery.
+ */
+static void
+pmemalloc_fix_prevsize(struct clump *clp, size_t prevsize)
+{
+	if (clp->prevsize != prevsize) {
+		DEBUG("clump 0x%lx prevsize 0x%lx, should be 0x%lx",
+				clp, clp->prevsize, prevsize);
+		clp->prevsize = prevsize;
+		pmem_persist(&clp->prevsize, sizeof(clp->prevsize), 0);
+	}
+}
+
 /*
  * pmemalloc_recover -- recover after a possible crash
  *
@@ -106,6 +614,7 @@ static void
 pmemalloc_recover(void *pmp)
 {
 	struct clump *clp;
+	size_t prevsize = 0;
 	int i;
 
 	DEBUG("pmp=0x%lx", pmp);
@@ -119,7 +628,25 @@ pmemalloc_recover(void *pmp)
 		DEBUG("[0x%lx]clump size %lx state %d",
 				OFF(pmp, clp), sz, state);
 
+		pmemalloc_fix_prevsize(clp, prevsize);
+		prevsize = sz;
+
 		switch (state) {
+		case PMEM_STATE_FREE:
+		case PMEM_STATE_ACTIVE:
+			/*
+			 * an activate that didn't reach its commit point
+			 * may have left an "on" list in a FREE clump, and
+			 * pmemalloc_onfree() without the pmemalloc_free()
+			 * one in an ACTIVE clump
+			 */
+			if (clp->on[0].off == 0)
+				break;
+			for (i = PMEM_NUM_ON - 1; i >= 0; i--)
+				clp->on[i].off = 0;
+			pmem_persist(clp, sizeof(*clp), 0);
+			break;
+
 		case PMEM_STATE_RESERVED:
 			/* return the clump to the FREE pool */
 			for (i = PMEM_NUM_ON - 1; i >= 0; i--)
@@ -131,15 +658,7 @@ pmemalloc_recover(void *pmp)
 
 		case PMEM_STATE_ACTIVATING:
 			/* finish progressing the clump to ACTIVE */
-			for (i = 0; i < PMEM_NUM_ON; i++)
-				if (clp->on[i].off) {
-					uintptr_t *dest =
-						PMEM(pmp,
-						(uintptr_t *)clp->on[i].off);
-					*dest = (uintptr_t)clp->on[i].ptr_;
-					pmem_persist(dest, sizeof(*dest), 0);
-				} else
-					break;
+			pmemalloc_exec_on(pmp, clp->on);
 			for (i = PMEM_NUM_ON - 1; i >= 0; i--)
 				clp->on[i].off = 0;
 			pmem_persist(clp, sizeof(*clp), 0);
@@ -149,15 +668,7 @@ pmemalloc_recover(void *pmp)
 
 		case PMEM_STATE_FREEING:
 			/* finish progressing the clump to FREE */
-			for (i = 0; i < PMEM_NUM_ON; i++)
-				if (clp->on[i].off) {
-					uintptr_t *dest =
-						PMEM(pmp,
-						(uintptr_t *)clp->on[i].off);
-					*dest = (uintptr_t)clp->on[i].ptr_;
-					pmem_persist(dest, sizeof(*dest), 0);
-				} else
-					break;
+			pmemalloc_exec_on(pmp, clp->on);
 			for (i = PMEM_NUM_ON - 1; i >= 0; i--)
 				clp->on[i].off = 0;
 			pmem_persist(clp, sizeof(*clp), 0);
@@ -169,25 +680,92 @@ pmemalloc_recover(void *pmp)
 		clp = (struct clump *)((uintptr_t)clp + sz);
 		DEBUG("next clp %lx, offset 0x%lx", clp, OFF(pmp, clp));
 	}
+
+	pmemalloc_fix_prevsize(clp, prevsize);
+}
+
+/*
+ * pmemalloc_arena_target -- return where arena k of a pool should start
+ *
+ * The clumps are divided into narenas runs of about the same size,
+ * each starting on a chunk boundary.
+ *
+ * Internal support routine.
+ */
+static uintptr_t
+pmemalloc_arena_target(size_t size, int narenas, int k)
+{
+	size_t span = (size & ~(PMEM_CHUNK_SIZE - 1)) - PMEM_CHUNK_SIZE -
+		PMEM_CLUMP_OFFSET;
+
+	return PMEM_CLUMP_OFFSET +
+		((span / narenas * k) & ~(PMEM_CHUNK_SIZE - 1));
+}
+
+/*
+ * pmemalloc_arena_of -- return the arena a clump is in
+ *
+ * That's the last arena starting at or below the clump.  When clumps
+ * too big to split cover an arena's share of the pool, it may start
+ * where the next one does, and is left empty.
+ *
+ * Internal support routine.
+ */
+static struct arena *
+pmemalloc_arena_of(struct pool *pp, struct clump *clp)
+{
+	int lo = 0;
+	int hi = pp->narenas - 1;
+
+	while (lo < hi) {
+		int mid = (lo + hi + 1) / 2;
+
+		if (pp->arenas[mid].start <= clp)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	return &pp->arenas[lo];
+}
+
+/*
+ * pmemalloc_thread_arena -- return this thread's arena number
+ *
+ * Threads are handed arenas round-robin the first time they need one.
+ * The number is taken modulo a pool's number of arenas.
+ *
+ * Internal support routine.
+ */
+static int
+pmemalloc_thread_arena(void)
+{
+	if (Arena < 0)
+		Arena = __atomic_fetch_add(&Next_arena, 1, __ATOMIC_RELAXED) %
+			PMEM_MAX_ARENAS;
+
+	return Arena;
 }
 
 /*
  * pmemalloc_coalesce_free -- find adjacent free blocks and coalesce them
  *
- * Scan the pmeme pool for recovery work:
- * 	- RESERVED clumps that need to be freed
- * 	- ACTIVATING clumps that need to be ACTIVE
- * 	- FREEING clumps that need to be freed
+ * Free clumps aren't merged across the point where an arena is going
+ * to start (see pmemalloc_arenas_build()), since they'd only have to
+ * be split there again.
  *
  * Internal support routine, used during recovery.
  */
 static void
 pmemalloc_coalesce_free(void *pmp)
 {
+	struct pool_header *hdrp =
+		PMEM(pmp, (struct pool_header *)PMEM_HDR_OFFSET);
 	struct clump *clp;
 	struct clump *firstfree;
 	struct clump *lastfree;
 	size_t csize;
+	int k = 1;
 
 	DEBUG("pmp=0x%lx", pmp);
 
@@ -198,25 +776,36 @@ pmemalloc_coalesce_free(void *pmp)
 	while (clp->size) {
 		size_t sz = clp->size & ~PMEM_STATE_MASK;
 		int state = clp->size & PMEM_STATE_MASK;
+		int boundary = 0;
 
 		DEBUG("[0x%lx]clump size %lx state %d",
 				OFF(pmp, clp), sz, state);
 
+		while (k < Narenas && OFF(pmp, clp) >=
+				pmemalloc_arena_target(hdrp->totalsize,
+					Narenas, k)) {
+			boundary = 1;
+			k++;
+		}
+
+		if (firstfree != NULL && lastfree != NULL &&
+				(boundary || state != PMEM_STATE_FREE)) {
+			DEBUG("coalesced size 0x%lx", csize);
+			firstfree->size = csize | PMEM_STATE_FREE;
+			pmem_persist(firstfree, sizeof(*firstfree), 0);
+			pmemalloc_fix_prevsize(clp, csize);
+		}
+		if (boundary || state != PMEM_STATE_FREE) {
+			firstfree = lastfree = NULL;
+			csize = 0;
+		}
+
 		if (state == PMEM_STATE_FREE) {
 			if (firstfree == NULL)
 				firstfree = clp;
 			else
 				lastfree = clp;
 			csize += sz;
-		} else if (firstfree != NULL && lastfree != NULL) {
-			DEBUG("coalesced size 0x%lx", csize);
-			firstfree->size = csize | PMEM_STATE_FREE;
-			pmem_persist(firstfree, sizeof(*firstfree), 0);
-			firstfree = lastfree = NULL;
-			csize = 0;
-		} else {
-			firstfree = lastfree = NULL;
-			csize = 0;
 		}
 
 		clp = (struct clump *)((uintptr_t)clp + sz);
@@ -228,35 +817,497 @@ pmemalloc_coalesce_free(void *pmp)
 				firstfree, (uintptr_t)firstfree + csize);
 		firstfree->size = csize | PMEM_STATE_FREE;
 		pmem_persist(firstfree, sizeof(*firstfree), 0);
+		pmemalloc_fix_prevsize(clp, csize);
 	}
 }
 
 /*
- * pmemalloc_init -- setup a Persistent Memory pool for use
- *
- * Inputs:
- *	path -- path to the file which will contain the memory pool
- *
- *	        If the file doesn't exist, it is created.  If it exists,
- *	        the state of the memory pool is initialized from the file.
+ * pmemalloc_arenas_build -- set up the volatile state for a pool
  *
- *	size -- size of the memory pool in bytes
- *
- *		The size is only used when creating the memory pool
- *		the first time (the file created will be extended to
- *		that size).  The smallest size allowed is 1 meg.  The
- *		largest size allowed is whatever the underlaying file
- *		system allows as a max file size.
- *
- * Outputs:
- * 	An opaque memory pool handle is returned on success.  That
- * 	handle must be passed in to most of the other pmem routines.
- *
- * 	On error, NULL is returned and errno is set.
+ * The pool is divided into Narenas arenas, and the FREE clumps in each
+ * go into its index.  An arena starts at the first clump at or above
+ * its share of the pool, and a FREE clump spanning that point is split
+ * there first, the same way pmemalloc_activate() splits: the new clump
+ * header is written in what's still free space, and setting the size
+ * of the lower clump commits the split.
  *
- * This function must be called before any other pmem functions.
+ * Internal support routine, used during recovery.
  */
-void *
+static void
+pmemalloc_arenas_build(void *pmp)
+{
+	struct pool_header *hdrp =
+		PMEM(pmp, (struct pool_header *)PMEM_HDR_OFFSET);
+	struct pool *pp;
+	struct clump *clp;
+	int k = 0;
+	int i;
+
+	DEBUG("pmp=0x%lx, narenas=%d", pmp, Narenas);
+
+	if ((pp = calloc(1, sizeof(*pp))) == NULL ||
+	    (pp->arenas = calloc(Narenas, sizeof(*pp->arenas))) == NULL)
+		FATALSYS("calloc");
+
+	if ((pp->slabmap = calloc(PMEM_SLAB_TOP, sizeof(*pp->slabmap))) == NULL)
+		FATALSYS("calloc");
+
+	pp->pmp = pmp;
+	pp->narenas = Narenas;
+	if ((errno = pthread_mutex_init(&pp->growlock, NULL)) != 0)
+		FATALSYS("pthread_mutex_init");
+	if ((errno = pthread_mutex_init(&pp->slablock, NULL)) != 0)
+		FATALSYS("pthread_mutex_init");
+	for (i = 0; i < pp->narenas; i++)
+		if ((errno = pthread_mutex_init(&pp->arenas[i].lock,
+						NULL)) != 0)
+			FATALSYS("pthread_mutex_init");
+
+	clp = PMEM(pmp, (struct clump *)PMEM_CLUMP_OFFSET);
+	for (;;) {
+		size_t sz = clp->size & ~PMEM_STATE_MASK;
+		uintptr_t target;
+
+		/* the last clump starts any arenas nothing else could */
+		while (k < pp->narenas && (clp->size == 0 ||
+			OFF(pmp, clp) >= pmemalloc_arena_target(
+					hdrp->totalsize, pp->narenas, k)))
+			pp->arenas[k++].start = clp;
+
+		if (clp->size == 0)
+			break;
+
+		if (k < pp->narenas &&
+		    (clp->size & PMEM_STATE_MASK) == PMEM_STATE_FREE &&
+		    OFF(pmp, clp) + sz > (target = pmemalloc_arena_target(
+					hdrp->totalsize, pp->narenas, k))) {
+			struct clump *newclp = PMEM(pmp, (struct clump *)target);
+			struct clump *next =
+				(struct clump *)((uintptr_t)clp + sz);
+			size_t lsize = (uintptr_t)newclp - (uintptr_t)clp;
+
+			DEBUG("splitting: [0x%lx] new clump", target);
+			memset(newclp, '\0', sizeof(*newclp));
+			newclp->size = (sz - lsize) | PMEM_STATE_FREE;
+			newclp->prevsize = lsize;
+			pmem_persist(newclp, sizeof(*newclp), 0);
+			clp->size = lsize | PMEM_STATE_FREE;
+			pmem_persist(clp, sizeof(*clp), 0);
+			next->prevsize = sz - lsize;
+			pmem_persist(&next->prevsize, sizeof(next->prevsize), 0);
+			sz = lsize;
+		}
+
+		clp = (struct clump *)((uintptr_t)clp + sz);
+	}
+
+	/* with the starts all known, each FREE clump goes to its arena */
+	clp = PMEM(pmp, (struct clump *)PMEM_CLUMP_OFFSET);
+	while (clp->size) {
+		if ((clp->size & PMEM_STATE_MASK) == PMEM_STATE_FREE) {
+			struct arena *ap = pmemalloc_arena_of(pp, clp);
+
+			pmemalloc_vclump_free(ap, pmemalloc_vclump_new(ap, clp,
+					clp->size & ~PMEM_STATE_MASK));
+		}
+		clp = (struct clump *)
+			((uintptr_t)clp + (clp->size & ~PMEM_STATE_MASK));
+	}
+
+	if ((errno = pthread_mutex_lock(&Pools_lock)) != 0)
+		FATALSYS("pthread_mutex_lock");
+	pp->next = Pools;
+	__atomic_store_n(&Pools, pp, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&Pools_lock);
+}
+
+/*
+ * pmemalloc_slab_class -- return the slab class for objects of size bytes
+ *
+ * Internal support routine.
+ */
+static int
+pmemalloc_slab_class(size_t size)
+{
+	int c;
+
+	for (c = 0; c < PMEM_SLAB_NCLASSES - 1; c++)
+		if (size <= Slab_sizes[c])
+			break;
+
+	return c;
+}
+
+/*
+ * pmemalloc_slab_page -- return the slab map entry for an offset
+ *
+ * The leaves of the map are allocated as they're needed, which may be
+ * by a lookup racing with another, so only one of them wins.
+ *
+ * Internal support routine.
+ */
+static struct slabpage *
+pmemalloc_slab_page(struct pool *pp, uintptr_t off)
+{
+	uintptr_t page = off >> PMEM_SLAB_SHIFT;
+	struct slabpage **leafp;
+	struct slabpage *leaf;
+
+	if (page / PMEM_SLAB_LEAF >= PMEM_SLAB_TOP)
+		FATAL("offset 0x%lx beyond the slab map", off);
+
+	leafp = &pp->slabmap[page / PMEM_SLAB_LEAF];
+	if ((leaf = __atomic_load_n(leafp, __ATOMIC_ACQUIRE)) == NULL) {
+		struct slabpage *new;
+
+		if ((new = calloc(PMEM_SLAB_LEAF, sizeof(*new))) == NULL)
+			FATALSYS("calloc");
+		if (__atomic_compare_exchange_n(leafp, &leaf, new, 0,
+					__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+			leaf = new;
+		else
+			free(new);
+	}
+
+	return &leaf[page % PMEM_SLAB_LEAF];
+}
+
+/*
+ * pmemalloc_slab_add -- set up the volatile state for a slab
+ *
+ * The caller holds the pool's slablock, or is pmemalloc_init().
+ *
+ * Internal support routine.
+ */
+static void
+pmemalloc_slab_add(struct pool *pp, struct slab *sp)
+{
+	struct slabinfo *si;
+	uintptr_t start = OFF(pp->pmp, sp);
+	uintptr_t end = start + sizeof(*sp) + sp->nslots * sp->slotsize;
+	uintptr_t off;
+	int c = pmemalloc_slab_class(sp->slotsize);
+	size_t i;
+
+	DEBUG("[0x%lx] slab of %lu slots of %lu bytes",
+			start, sp->nslots, sp->slotsize);
+
+	if (Slab_sizes[c] != sp->slotsize || sp->nslots == 0 ||
+			sp->nslots > PMEM_SLAB_SLOTS)
+		FATAL("[0x%lx] bad slab, %lu slots of %lu bytes",
+				start, sp->nslots, sp->slotsize);
+
+	if ((si = calloc(1, sizeof(*si))) == NULL ||
+	    (si->on = calloc(sp->nslots, sizeof(*si->on))) == NULL)
+		FATALSYS("calloc");
+
+	si->sp = sp;
+	si->slotsize = sp->slotsize;
+	si->nslots = sp->nslots;
+	memcpy(si->used, sp->bitmap, sizeof(si->used));
+
+	/* slots past the end are never free */
+	for (i = si->nslots; i < PMEM_SLAB_SLOTS; i++)
+		si->used[i / 64] |= 1ULL << (i % 64);
+
+	for (off = start & ~((1UL << PMEM_SLAB_SHIFT) - 1); off < end;
+			off += 1UL << PMEM_SLAB_SHIFT)
+		if (off < start)
+			pmemalloc_slab_page(pp, off)->hi = si;
+		else
+			pmemalloc_slab_page(pp, off)->lo = si;
+
+	si->next = pp->slabs[c];
+	__atomic_store_n(&pp->slabs[c], si, __ATOMIC_RELEASE);
+}
+
+/*
+ * pmemalloc_slab_recover -- finish slab activates and frees, set up slabs
+ *
+ * A slabrec with a state is an activate or free that got as far as
+ * its commit point, so it's finished: its pointer assignments are
+ * made (again), and its slot's bit set or cleared.
+ *
+ * Internal support routine, used during recovery.
+ */
+static void
+pmemalloc_slab_recover(void *pmp)
+{
+	struct pool_header *hdrp =
+		PMEM(pmp, (struct pool_header *)PMEM_HDR_OFFSET);
+	struct pool *pp = pmemalloc_pool(pmp);
+	struct slab *sp_;
+	int i;
+
+	DEBUG("pmp=0x%lx", pmp);
+
+	for (sp_ = hdrp->slabs_; sp_; sp_ = PMEM(pmp, sp_)->next_) {
+		struct slab *sp = PMEM(pmp, sp_);
+
+		for (i = 0; i < PMEM_SLAB_NREC; i++) {
+			struct slabrec *rp = &sp->rec[i];
+			uint64_t *wordp;
+			uint64_t bit;
+
+			if (rp->state == 0)
+				continue;
+			if (rp->slot >= sp->nslots)
+				FATAL("[0x%lx] bad slot %u in slab record",
+						OFF(pmp, sp), rp->slot);
+
+			wordp = &sp->bitmap[rp->slot / 64];
+			bit = 1ULL << (rp->slot % 64);
+
+			DEBUG("[0x%lx] slot %u state %u", OFF(pmp, sp),
+					rp->slot, rp->state);
+
+			pmemalloc_exec_on(pmp, rp->on);
+			if (rp->state == PMEM_STATE_ACTIVATING)
+				*wordp |= bit;
+			else
+				*wordp &= ~bit;
+			pmem_persist(wordp, sizeof(*wordp), 0);
+			rp->state = 0;
+			pmem_persist(&rp->state, sizeof(rp->state), 0);
+		}
+
+		pmemalloc_slab_add(pp, sp);
+	}
+}
+
+/*
+ * pmemalloc_coalesce -- merge a FREE clump with its FREE neighbours
+ *
+ * The neighbour below is found using prevsize, so only the clumps on
+ * either side are looked at.  Setting the size of the lowest of the
+ * merged clumps is the commit point: before it, the clumps are all
+ * still FREE on their own, after it, they're one clump, and the old
+ * headers inside it are just free space.  The prevsize of the clump
+ * above is set after that (and repaired by recovery if a crash gets in
+ * between).  Neighbours in another arena are left alone.
+ *
+ * vp is the clump's own vclump, just made, and it's joined to the
+ * vclumps of the neighbours it's merged with (which may be reserved in
+ * part, since that's only in DRAM).  The caller then frees vp, or
+ * keeps it reserved.  The caller holds the arena's lock.
+ *
+ * Internal support routine, used when freeing and growing.
+ */
+static void
+pmemalloc_coalesce(struct pool *pp, struct arena *ap, struct vclump *vp)
+{
+	void *pmp = pp->pmp;
+	struct clump *clp = vp->clp;
+	struct clump *first = clp;
+	struct clump *upper;
+	struct clump *next;
+	struct vclump *lvp = NULL;
+	struct vclump *uvp = NULL;
+	size_t csize = clp->size & ~PMEM_STATE_MASK;
+
+	DEBUG("pmp=0x%lx, clp=0x%lx", pmp, OFF(pmp, clp));
+
+	/* the zero-size clump at the end looks FREE, but isn't */
+	upper = (struct clump *)((uintptr_t)clp + csize);
+	if (pmemalloc_arena_of(pp, upper) == ap && upper->size != 0 &&
+		(upper->size & PMEM_STATE_MASK) == PMEM_STATE_FREE) {
+		csize += upper->size & ~PMEM_STATE_MASK;
+		if ((uvp = pmemalloc_vclump_find(ap, upper)) == NULL)
+			FATAL("clump 0x%lx not in the free index", upper);
+	}
+
+	/* the first clump in an arena has no neighbour below in it */
+	if (clp != ap->start) {
+		struct clump *lower =
+			(struct clump *)((uintptr_t)clp - clp->prevsize);
+
+		if ((lower->size & PMEM_STATE_MASK) == PMEM_STATE_FREE) {
+			first = lower;
+			csize += lower->size & ~PMEM_STATE_MASK;
+			if ((lvp = pmemalloc_vclump_find(ap, lower)) == NULL)
+				FATAL("clump 0x%lx not in the free index",
+						lower);
+			while (lvp->hi)
+				lvp = lvp->hi;
+		}
+	}
+
+	if (lvp == NULL && uvp == NULL)
+		return;
+
+	DEBUG("[0x%lx] coalesced size 0x%lx", OFF(pmp, first), csize);
+
+	first->size = csize | PMEM_STATE_FREE;
+	pmem_persist(first, sizeof(*first), 0);
+
+	next = (struct clump *)((uintptr_t)first + csize);
+	next->prevsize = csize;
+	pmem_persist(&next->prevsize, sizeof(next->prevsize), 0);
+
+	if (lvp) {
+		lvp->hi = vp;
+		vp->lo = lvp;
+	}
+	if (uvp) {
+		uvp->lo = vp;
+		vp->hi = uvp;
+	}
+}
+
+/*
+ * pmemalloc_extend -- add the space between two pool sizes as a free clump
+ *
+ * The pool must already be mapped (and the file extended) to the new
+ * size.  The old last clump becomes a free clump covering the new
+ * space, and a new last clump is put at the end.  Setting the size of
+ * the old last clump is the commit point: a crash before it leaves the
+ * pool as it was, with the file longer than the pool, and a crash
+ * after it leaves the new space in the pool, but the header not saying
+ * so yet.  pmemalloc_recover_grow() finishes the job in either case.
+ *
+ * Internal support routine, used when growing and during recovery.
+ */
+static void
+pmemalloc_extend(void *pmp, size_t oldsize, size_t size)
+{
+	struct pool_header *hdrp =
+		PMEM(pmp, (struct pool_header *)PMEM_HDR_OFFSET);
+	struct clump *clp = pmemalloc_lastclump(pmp, oldsize);
+	struct clump *lastclp = pmemalloc_lastclump(pmp, size);
+
+	DEBUG("pmp=0x%lx, oldsize=0x%lx, size=0x%lx", pmp, oldsize, size);
+
+	/* less than a chunk more means there's no room for a new clump */
+	if (lastclp > clp) {
+		/*
+		 * order here is important:
+		 * 	1. initialize new last clump
+		 * 	2. clear old last clump do list
+		 * 	3. persist both clumps in one batch
+		 * 	4. set old last clump size, FREE
+		 * 	5. persist old last clump
+		 */
+		size_t prevsize = clp->prevsize;
+
+		pmem_batch_begin();
+		memset(lastclp, '\0', sizeof(*lastclp));
+		lastclp->prevsize = (uintptr_t)lastclp - (uintptr_t)clp;
+		pmem_batch_add(lastclp, sizeof(*lastclp));
+		memset(clp, '\0', sizeof(*clp));
+		clp->prevsize = prevsize;
+		pmem_batch_add(clp, sizeof(*clp));
+		pmem_batch_commit();
+		clp->size = ((uintptr_t)lastclp - (uintptr_t)clp) |
+			PMEM_STATE_FREE;
+		pmem_persist(clp, sizeof(*clp), 0);
+	}
+
+	hdrp->totalsize = size;
+	pmem_persist(&hdrp->totalsize, sizeof(hdrp->totalsize), 0);
+}
+
+/*
+ * pmemalloc_recover_grow -- finish growing a pool after a possible crash
+ *
+ * When the file is longer than the header says, pmemalloc_grow() was
+ * interrupted.  If the clump list still ends where the header says,
+ * the new space is added now, otherwise only the header is behind.
+ *
+ * Internal support routine, used during recovery.
+ */
+static void
+pmemalloc_recover_grow(void *pmp, size_t size)
+{
+	struct pool_header *hdrp =
+		PMEM(pmp, (struct pool_header *)PMEM_HDR_OFFSET);
+	struct clump *clp;
+
+	if (hdrp->totalsize == size)
+		return;
+
+	DEBUG("pool size 0x%lx, file size 0x%lx", hdrp->totalsize, size);
+
+	if (hdrp->totalsize > size)
+		FATAL("file size %lu less than pool size %lu",
+				size, hdrp->totalsize);
+
+	clp = PMEM(pmp, (struct clump *)PMEM_CLUMP_OFFSET);
+	while (clp->size)
+		clp = (struct clump *)
+			((uintptr_t)clp + (clp->size & ~PMEM_STATE_MASK));
+
+	if (clp == pmemalloc_lastclump(pmp, size)) {
+		hdrp->totalsize = size;
+		pmem_persist(&hdrp->totalsize, sizeof(hdrp->totalsize), 0);
+	} else
+		pmemalloc_extend(pmp, hdrp->totalsize, size);
+}
+
+/*
+ * pmemalloc_arenas -- set the number of arenas pools are divided into
+ *
+ * Inputs:
+ *	narenas -- number of arenas, from 1 to 64
+ *
+ * Each arena has its own lock, and a thread allocates from one arena
+ * until it's out of room there, so threads mostly don't contend.  The
+ * number applies to pools set up by pmemalloc_init() from then on,
+ * and isn't kept in the pool, so it can be different each time the
+ * pool is opened.  The default is 1.
+ */
+void
+pmemalloc_arenas(int narenas)
+{
+	DEBUG("narenas=%d", narenas);
+
+	Narenas = MAX(1, MIN(narenas, PMEM_MAX_ARENAS));
+}
+
+/*
+ * pmemalloc_tcache -- set the size of the per-thread clump caches
+ *
+ * Inputs:
+ *	nclumps -- clumps of each size a thread keeps, from 0 to 64
+ *
+ * A clump of up to 1k freed by a thread is kept reserved in the
+ * thread's cache, and handed out again by pmemalloc_reserve() in that
+ * thread without a lock.  The cache is
+ * emptied when the thread exits.  The default is 0, for no caches.
+ */
+void
+pmemalloc_tcache(int nclumps)
+{
+	DEBUG("nclumps=%d", nclumps);
+
+	Tcache_max = MAX(0, MIN(nclumps, PMEM_TCACHE_MAX));
+}
+
+/*
+ * pmemalloc_init -- setup a Persistent Memory pool for use
+ *
+ * Inputs:
+ *	path -- path to the file which will contain the memory pool
+ *
+ *	        If the file doesn't exist, it is created.  If it exists,
+ *	        the state of the memory pool is initialized from the file.
+ *
+ *	size -- size of the memory pool in bytes
+ *
+ *		The size is only used when creating the memory pool
+ *		the first time (the file created will be extended to
+ *		that size).  The smallest size allowed is 1 meg.  The
+ *		largest size allowed is whatever the underlaying file
+ *		system allows as a max file size.
+ *
+ * Outputs:
+ * 	An opaque memory pool handle is returned on success.  That
+ * 	handle must be passed in to most of the other pmem routines.
+ *
+ * 	On error, NULL is returned and errno is set.
+ *
+ * This function must be called before any other pmem functions.
+ */
+void *
 pmemalloc_init(const char *path, size_t size)
 {
 	void *pmp;
@@ -296,9 +1347,10 @@ pmemalloc_init(const char *path, size_t size)
 		/*
 		 * location of last clump is calculated by rounding the file
 		 * size down to a multiple of 64, and then subtracting off
-		 * another 64 to hold the struct clump.  the last clump is
-		 * indicated by a size of zero (so no write is necessary
-		 * here since the file is initially zeros.
+		 * another 64 to hold the struct clump (see
+		 * pmemalloc_lastclump()).  the last clump is indicated by
+		 * a size of zero (the file is initially zeros, so only its
+		 * prevsize is written below).
 		 */
 		lastclumpoff =
 			(size & ~(PMEM_CHUNK_SIZE - 1)) - PMEM_CHUNK_SIZE;
@@ -312,241 +1364,1013 @@ pmemalloc_init(const char *path, size_t size)
 		DEBUG("[0x%lx] created clump, size 0x%lx",
 				PMEM_CLUMP_OFFSET, cl.size);
 
-		/*
-		 * write the pool header
-		 */
-		strcpy(hdr.signature, PMEM_SIGNATURE);
-		hdr.totalsize = size;
-		if (pwrite(fd, &hdr, sizeof(hdr), PMEM_HDR_OFFSET) < 0)
-			goto out;
+		/*
+		 * the last clump has the first one below it
+		 */
+		cl.prevsize = cl.size;
+		cl.size = 0;
+		if (pwrite(fd, &cl, sizeof(cl), lastclumpoff) < 0)
+			goto out;
+
+		/*
+		 * write the pool header
+		 */
+		strcpy(hdr.signature, PMEM_SIGNATURE);
+		hdr.totalsize = size;
+		if (pwrite(fd, &hdr, sizeof(hdr), PMEM_HDR_OFFSET) < 0)
+			goto out;
+
+		if (fsync(fd) < 0)
+			goto out;
+
+	} else {
+		if ((fd = open(path, O_RDWR)) < 0)
+			goto out;
+		size = stbuf.st_size;
+
+		/* XXX handle recovery case 1 described below */
+	}
+
+	/*
+	 * map the file, leaving room for pmemalloc_grow().  libpmem
+	 * keeps its own descriptor for growing the mapping.
+	 */
+	if ((pmp = pmem_map_ex(fd, size, PMEM_MAP_GROWABLE, NULL)) == NULL)
+		goto out;
+	close(fd);
+
+	/*
+	 * scan pool for recovery work, seven kinds:
+	 * 	1. pmem pool file sisn't even fully setup
+	 * 	2. pool growth that needs to be finished
+	 * 	3. RESERVED clumps that need to be freed (from pools
+	 * 	   written before reservations were kept in DRAM), and
+	 * 	   "on" lists left in FREE and ACTIVE clumps
+	 * 	4. ACTIVATING clumps that need to be ACTIVE
+	 * 	5. FREEING clumps that need to be freed
+	 * 	6. adjacent free clumps that need to be coalesced
+	 * 	7. slab activates and frees that need to be finished
+	 * the arenas and their free clump indexes are set up once all
+	 * the clumps are settled in FREE or ACTIVE, and kept up to date
+	 * from then on.  the slabs are ACTIVE clumps, so they're only
+	 * looked at after that.
+	 */
+	pmemalloc_recover_grow(pmp, size);
+	pmemalloc_recover(pmp);
+	pmemalloc_coalesce_free(pmp);
+	pmemalloc_arenas_build(pmp);
+	pmemalloc_slab_recover(pmp);
+
+	DEBUG("return pmp 0x%lx", pmp);
+	return pmp;
+
+out:
+	err = errno;
+	if (fd != -1)
+		close(fd);
+	errno = err;
+	return NULL;
+}
+
+/*
+ * pmemalloc_grow -- make a Persistent Memory pool bigger
+ *
+ * Inputs:
+ *	pmp -- a pmp as returned by pmemalloc_init()
+ *
+ *	size -- new size of the memory pool in bytes
+ *
+ * Outputs:
+ *	Returns 0 on success, or -1 with errno set (EINVAL if size
+ *	isn't bigger than the pool).
+ *
+ * The file is extended and the pool stays mapped at the same address,
+ * so pointers into it stay good.  The new space is added as a free
+ * clump, merged with the last clump of the pool if that's free.  A
+ * crash while growing leaves either the old pool or the new one.
+ */
+int
+pmemalloc_grow(void *pmp, size_t size)
+{
+	struct pool_header *hdrp =
+		PMEM(pmp, (struct pool_header *)PMEM_HDR_OFFSET);
+	struct pool *pp = pmemalloc_pool(pmp);
+	struct arena *ap = &pp->arenas[pp->narenas - 1];
+	struct clump *clp;
+	int err;
+
+	DEBUG("pmp=0x%lx, size=0x%lx", pmp, size);
+
+	if ((errno = pthread_mutex_lock(&pp->growlock)) != 0)
+		FATALSYS("pthread_mutex_lock");
+
+	if (size <= hdrp->totalsize) {
+		DEBUG("size %lu not bigger than pool size %lu",
+				size, hdrp->totalsize);
+		pthread_mutex_unlock(&pp->growlock);
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (pmem_remap(pmp, size) < 0) {
+		err = errno;
+		pthread_mutex_unlock(&pp->growlock);
+		errno = err;
+		return -1;
+	}
+
+	/*
+	 * the new space goes to the last arena, which the last clump
+	 * is in, so only its lock is needed.  the old last clump is the
+	 * new FREE clump, if there was room.
+	 */
+	if ((errno = pthread_mutex_lock(&ap->lock)) != 0)
+		FATALSYS("pthread_mutex_lock");
+	clp = pmemalloc_lastclump(pmp, hdrp->totalsize);
+	pmemalloc_extend(pmp, hdrp->totalsize, size);
+	if (clp->size) {
+		struct vclump *vp = pmemalloc_vclump_new(ap, clp, clp->size);
+
+		pmemalloc_coalesce(pp, ap, vp);
+		pmemalloc_vclump_free(ap, vp);
+	}
+	pthread_mutex_unlock(&ap->lock);
+	pthread_mutex_unlock(&pp->growlock);
+
+	return 0;
+}
+
+/*
+ * pmemalloc_static_area -- return a pointer to the static 4k area
+ *
+ * Outputs:
+ * 	A pointer to a 4k static area is returned.  The caller may use
+ * 	this area for anything -- no structure is imposed by this library.
+ * 	This allows the caller to store pointers to roots of trees or
+ * 	beginning of linked lists, etc. in the same file as the rest of
+ * 	the memory pool.
+ *
+ * The pointer returned is a normal (absolute) pointer.  No need to use
+ * the PMEM() macro with it.  Changes to this area are not guaranteed
+ * persistent until pmem_persist() has been called, for example:
+ *	pmem_persist(pmem_static_area(pmp), PMEM_STATIC_SIZE);
+ */
+void *
+pmemalloc_static_area(void *pmp)
+{
+	DEBUG("pmp=0x%lx", pmp);
+
+	return PMEM(pmp, (void *)PMEM_STATIC_OFFSET);
+}
+
+/*
+ * pmemalloc_reserve -- allocate memory, volatile until pmemalloc_activate()
+ *
+ * Inputs:
+ *	pmp -- a pmp as returned by pmemalloc_init()
+ *
+ *	size -- number of bytes to allocate
+ *
+ * Outputs:
+ *	On success, this function returns memory allocated from the
+ *	memory-mapped file associated with pmp.  The memory is suitably
+ *	aligned for any kind of variable.  The memory is not initialized.
+ *
+ *	On failure, this function returns NULL and errno is set.
+ *
+ * The memory returned is initially *volatile* meaning that if the
+ * program exits (or system crashes) before pmemalloc_activate() is called
+ * with the return value, it is considered incompletely allocated
+ * and the memory is returned to the free pool in the memory-mapped
+ * file.  It works this way to prevent memory leaks when the system
+ * crashes between a successful return from pmemalloc_reserve() and when
+ * the caller actually links something to point at the new memory.
+ * The basic pattern for using pmemalloc_reserve() is this:
+ *
+ *	np_ = pmemalloc_reserve(pmp, sizeof(*np_));
+ *	...fill in fields in *np_...
+ *	pmemalloc_onactive(pmp, np_, &parent->next_, np_);
+ *	pmemalloc_activate(pmp, np_);
+ *
+ * In addition to flushing the data at *np_ to persistence, the
+ * pmemalloc_activate() call above also atomically marks that memory
+ * as in-use and stores the pointer to the persistent-memory-
+ * based pointer parent->next_ in this example).  So any crash that
+ * happens before parent->next_ is set to point at the new memory will
+ * result in the memory being returned back to the free list.
+ */
+void *
+pmemalloc_reserve(void *pmp, size_t size)
+{
+	size_t nsize = roundup(size + PMEM_CHUNK_SIZE, PMEM_CHUNK_SIZE);
+	struct pool *pp = pmemalloc_pool(pmp);
+	struct arena *ap;
+	struct vclump *vp;
+	size_t n = nsize / PMEM_CHUNK_SIZE;
+	void *ptr;
+	int a;
+	int i;
+
+	DEBUG("pmp=0x%lx, size=0x%lx -> 0x%lx", pmp, size, nsize);
+
+	/* a clump from this thread's cache is reserved already */
+	if (Tcache && Tcache->pmp == pmp && n <= PMEM_TCACHE_CHUNKS &&
+			Tcache->count[n] > 0) {
+		vp = Tcache->clumps[n][--Tcache->count[n]];
+		DEBUG("[0x%lx] from thread cache", OFF(pmp, vp->clp));
+		return (void *)((uintptr_t)vp->clp + PMEM_CHUNK_SIZE -
+				(uintptr_t)pmp);
+	}
+
+	/*
+	 * the index finds a free vclump that fits without a scan,
+	 * starting with this thread's own arena
+	 */
+	a = pmemalloc_thread_arena();
+	vp = NULL;
+	for (i = 0; i < pp->narenas; i++) {
+		ap = &pp->arenas[(a + i) % pp->narenas];
+		if ((errno = pthread_mutex_lock(&ap->lock)) != 0)
+			FATALSYS("pthread_mutex_lock");
+		if ((vp = pmemalloc_index_find(ap, nsize)) != NULL)
+			break;
+		pthread_mutex_unlock(&ap->lock);
+	}
+
+	if (vp == NULL) {
+		DEBUG("no free memory of size %lu available", nsize);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	ptr = (void *)(uintptr_t)vp->clp + PMEM_CHUNK_SIZE - (uintptr_t)pmp;
+
+	DEBUG("[0x%lx] fit found ptr 0x%lx, leftover 0x%lx bytes",
+			OFF(pmp, vp->clp), ptr, vp->size - nsize);
+
+	/*
+	 * the reservation is only made in DRAM: the rest of the vclump,
+	 * if there's room for a clump there, is split off as a free
+	 * vclump of its own, and the FREE clump in the pool is left as
+	 * it is until pmemalloc_activate().
+	 */
+	pmemalloc_index_remove(ap, vp);
+	if (vp->size - nsize >= PMEM_CHUNK_SIZE * 2) {
+		struct vclump *rest = pmemalloc_vclump_new(ap,
+				(struct clump *)((uintptr_t)vp->clp + nsize),
+				vp->size - nsize);
+
+		DEBUG("splitting: [0x%lx] new vclump", OFF(pmp, rest->clp));
+		rest->reserved = 0;
+		rest->lo = vp;
+		if ((rest->hi = vp->hi) != NULL)
+			rest->hi->lo = rest;
+		vp->hi = rest;
+		vp->size = nsize;
+		pmemalloc_index_add(ap, rest);
+	} else
+		DEBUG("no split required");
+
+	vp->reserved = 1;
+	memset(vp->on, '\0', sizeof(vp->on));
+	pthread_mutex_unlock(&ap->lock);
+
+	return ptr;
+}
+
+/*
+ * pmemalloc_reservation -- return the vclump of a reservation, locked
+ *
+ * The caller unlocks the arena returned in *app when done with it.
+ * NULL is returned, and no lock held, when ptr_ isn't reserved.
+ *
+ * Internal support routine.
+ */
+static struct vclump *
+pmemalloc_reservation(void *pmp, void *ptr_, struct arena **app)
+{
+	struct clump *clp =
+		PMEM(pmp, (struct clump *)((uintptr_t)ptr_ - PMEM_CHUNK_SIZE));
+	struct arena *ap = pmemalloc_arena_of(pmemalloc_pool(pmp), clp);
+	struct vclump *vp;
+
+	if ((errno = pthread_mutex_lock(&ap->lock)) != 0)
+		FATALSYS("pthread_mutex_lock");
+
+	if ((vp = pmemalloc_vclump_find(ap, clp)) == NULL || !vp->reserved) {
+		pthread_mutex_unlock(&ap->lock);
+		return NULL;
+	}
+
+	*app = ap;
+	return vp;
+}
+
+/*
+ * pmemalloc_onactive -- set assignments for when reservation goes active
+ *
+ * Inputs:
+ *	pmp -- a pmp as returned by pmemalloc_init()
+ *
+ *	parentp_ -- pointer to atomically set
+ *
+ *	nptr_ -- value to set in *parentp
+ */
+void
+pmemalloc_onactive(void *pmp, void *ptr_, void **parentp_, void *nptr_)
+{
+	struct arena *ap;
+	struct vclump *vp;
+	int i;
+
+	DEBUG("pmp=0x%lx, ptr_=0x%lx, parentp_=0x%lx, nptr_=0x%lx",
+			pmp, ptr_, parentp_, nptr_);
+
+	if ((vp = pmemalloc_reservation(pmp, ptr_, &ap)) == NULL)
+		FATAL("0x%lx is not reserved", ptr_);
+
+	DEBUG("[0x%lx] vclump on: 0x%lx 0x%lx 0x%lx 0x%lx 0x%lx 0x%lx",
+			OFF(pmp, vp->clp),
+			vp->on[0].off, vp->on[0].ptr_,
+			vp->on[1].off, vp->on[1].ptr_,
+			vp->on[2].off, vp->on[2].ptr_);
+
+	for (i = 0; i < PMEM_NUM_ON; i++)
+		if (vp->on[i].off == 0) {
+			DEBUG("using on[%d], off 0x%lx", i, OFF(pmp, parentp_));
+			/*
+			 * the list is only kept in DRAM until
+			 * pmemalloc_activate() writes it to the pool.
+			 */
+			vp->on[i].ptr_ = nptr_;
+			vp->on[i].off = OFF(pmp, parentp_);
+			pthread_mutex_unlock(&ap->lock);
+			return;
+		}
+
+	pthread_mutex_unlock(&ap->lock);
+	FATAL("exceeded onactive limit (%d)", PMEM_NUM_ON);
+}
+
+/*
+ * pmemalloc_free -- set assignments for when allocation gets freed
+ *
+ * Inputs:
+ *	pmp -- a pmp as returned by pmemalloc_init()
+ *
+ *	parentp_ -- pointer to atomically set
+ *
+ *	nptr_ -- value to set in *parentp
+ */
+void
+pmemalloc_onfree(void *pmp, void *ptr_, void **parentp_, void *nptr_)
+{
+	struct clump *clp;
+	int i;
+
+	DEBUG("pmp=0x%lx, ptr_=0x%lx, parentp_=0x%lx, nptr_=0x%lx",
+			pmp, ptr_, parentp_, nptr_);
+
+	clp = PMEM(pmp, (struct clump *)((uintptr_t)ptr_ - PMEM_CHUNK_SIZE));
+
+	ASSERTeq(clp->size & PMEM_STATE_MASK, PMEM_STATE_ACTIVE);
+
+	DEBUG("[0x%lx] clump on: 0x%lx 0x%lx 0x%lx 0x%lx 0x%lx 0x%lx",
+			OFF(pmp, clp),
+			clp->on[0].off, clp->on[0].ptr_,
+			clp->on[1].off, clp->on[1].ptr_,
+			clp->on[2].off, clp->on[2].ptr_);
+
+	for (i = 0; i < PMEM_NUM_ON; i++)
+		if (clp->on[i].off == 0) {
+			DEBUG("using on[%d], off 0x%lx", i, OFF(pmp, parentp_));
+			/*
+			 * order here is important:
+			 * 1. set ptr_
+			 * 2. make ptr_ persistent
+			 * 3. set off
+			 * 4. make off persistent
+			 */
+			clp->on[i].ptr_ = nptr_;
+			pmem_persist(clp, sizeof(*clp), 0);
+			clp->on[i].off = OFF(pmp, parentp_);
+			pmem_persist(clp, sizeof(*clp), 0);
+			return;
+		}
+
+	FATAL("exceeded onfree limit (%d)", PMEM_NUM_ON);
+}
+
+/*
+ * pmemalloc_activate -- atomically persist memory, mark in-use, store pointers
+ *
+ * Inputs:
+ *	pmp -- a pmp as returned by pmemalloc_init()
+ *
+ *	ptr_ -- memory to be persisted, as returned by pmemalloc_reserve()
+ */
+void
+pmemalloc_activate(void *pmp, void *ptr_)
+{
+	struct arena *ap;
+	struct vclump *vp;
+	struct vclump *hp;
+	struct clump *first;
+	struct clump *clp;
+	struct clump *next;
+	size_t sz;
+	size_t fsz;
+	int i;
+
+	DEBUG("pmp=%lx, ptr_=%lx", pmp, ptr_);
+
+	if ((vp = pmemalloc_reservation(pmp, ptr_, &ap)) == NULL)
+		FATAL("0x%lx is not reserved", ptr_);
+	sz = vp->size;
+	pthread_mutex_unlock(&ap->lock);
+
+	/* *ptr_ is ours alone, so it's flushed without holding the lock */
+	pmem_batch_begin();
+	pmem_batch_add(PMEM(pmp, ptr_), sz - PMEM_CHUNK_SIZE);
+
+	if ((errno = pthread_mutex_lock(&ap->lock)) != 0)
+		FATALSYS("pthread_mutex_lock");
+
+	DEBUG("[0x%lx] vclump on: 0x%lx 0x%lx 0x%lx 0x%lx 0x%lx 0x%lx",
+			OFF(pmp, vp->clp),
+			vp->on[0].off, vp->on[0].ptr_,
+			vp->on[1].off, vp->on[1].ptr_,
+			vp->on[2].off, vp->on[2].ptr_);
+
+	/*
+	 * the FREE clump the reservation is in starts where its first
+	 * vclump does.  it may have been merged with its neighbours
+	 * since the reservation was made, but it's still FREE.
+	 */
+	for (hp = vp; hp->lo; hp = hp->lo)
+		;
+	first = hp->clp;
+	fsz = first->size & ~PMEM_STATE_MASK;
+	clp = vp->clp;
+	next = (struct clump *)((uintptr_t)first + fsz);
+
+	/*
+	 * now the FREE clump is split in the pool, up to three ways:
+	 * the part below the reservation (if any) stays FREE, and the
+	 * part above it (if any) becomes a new FREE clump.  order here
+	 * is important:
+	 * 	1. initialize the clump above, still in free space
+	 * 	2. initialize the reservation's clump and "on" list,
+	 * 	   also in free space unless it starts the FREE clump
+	 * 	3. set the prevsize of the clump above the FREE clump
+	 * 	4. persist all three with *ptr_, in one batch
+	 * 	5. set the size of the FREE clump, which is the commit
+	 * 	   point: ACTIVATING if it's the reservation's clump
+	 * 	6. persist it
+	 * a crash before step 6 leaves that prevsize wrong for the
+	 * unsplit clump, and recovery repairs it from the sizes.
+	 */
+	if (vp->hi) {
+		struct clump *upper = (struct clump *)((uintptr_t)clp + sz);
+
+		memset(upper, '\0', sizeof(*upper));
+		upper->size = ((uintptr_t)next - (uintptr_t)upper) |
+			PMEM_STATE_FREE;
+		upper->prevsize = sz;
+		pmem_batch_add(upper, sizeof(*upper));
+	}
+	if (clp != first) {
+		memset(clp, '\0', sizeof(*clp));
+		clp->size = sz | PMEM_STATE_ACTIVATING;
+		clp->prevsize = (uintptr_t)clp - (uintptr_t)first;
+	}
+	memcpy(clp->on, vp->on, sizeof(clp->on));
+	pmem_batch_add(clp, sizeof(*clp));
+	if (vp->hi)
+		next->prevsize = (uintptr_t)next - (uintptr_t)clp - sz;
+	else
+		next->prevsize = sz;
+	pmem_batch_add(&next->prevsize, sizeof(next->prevsize));
+	pmem_batch_commit();
+
+	if (clp == first)
+		first->size = sz | PMEM_STATE_ACTIVATING;
+	else
+		first->size = ((uintptr_t)clp - (uintptr_t)first) |
+			PMEM_STATE_FREE;
+	pmem_persist(first, sizeof(*first), 0);
+
+	/* the vclumps on either side now belong to separate FREE clumps */
+	if (vp->lo)
+		vp->lo->hi = NULL;
+	if (vp->hi)
+		vp->hi->lo = NULL;
+	pmemalloc_vclump_delete(ap, vp);
+	pthread_mutex_unlock(&ap->lock);
+
+	/*
+	 * the clump is ACTIVATING, so it's no longer in the arena's
+	 * care.  order here is important:
+	 * 1. execute "on" list, persisting each one
+	 * 2. clear out "on" list, last to first
+	 * 3. set state to ACTIVE
+	 * 4. persist *clp
+	 */
+	pmemalloc_exec_on(pmp, clp->on);
+	for (i = PMEM_NUM_ON - 1; i >= 0; i--)
+		clp->on[i].off = 0;
+	pmem_persist(clp, sizeof(*clp), 0);
+	clp->size = sz | PMEM_STATE_ACTIVE;
+	pmem_persist(clp, sizeof(*clp), 0);
+}
+
+/*
+ * pmemalloc_release -- return a clump to the FREE clumps of its arena
+ *
+ * With keep set, the clump is reserved again right away, for a thread
+ * cache, and its vclump is returned.
+ *
+ * Internal support routine, used when freeing.
+ */
+static struct vclump *
+pmemalloc_release(struct pool *pp, struct clump *clp, int keep)
+{
+	struct arena *ap = pmemalloc_arena_of(pp, clp);
+	struct vclump *vp;
+
+	if ((errno = pthread_mutex_lock(&ap->lock)) != 0)
+		FATALSYS("pthread_mutex_lock");
+
+	clp->size = (clp->size & ~PMEM_STATE_MASK) | PMEM_STATE_FREE;
+	pmem_persist(clp, sizeof(*clp), 0);
+	vp = pmemalloc_vclump_new(ap, clp, clp->size);
+
+	/*
+	 * at this point we may have adjacent free clumps that need
+	 * to be coalesced.  there are three interesting cases:
+	 * 	case 1: the clump below us is free (need to combine two clumps)
+	 * 	case 2: the clump above us is free (need to combine two clumps)
+	 * 	case 3: both are free (need to combining three clumps)
+	 * clp->prevsize gets us back to the clump below, so only the two
+	 * neighbours are looked at.
+	 */
+	pmemalloc_coalesce(pp, ap, vp);
+
+	if (!keep) {
+		pmemalloc_vclump_free(ap, vp);
+		vp = NULL;
+	}
+
+	pthread_mutex_unlock(&ap->lock);
+	return vp;
+}
+
+/*
+ * pmemalloc_tcache_flush -- free all the clumps in a thread cache
+ *
+ * Internal support routine.
+ */
+static void
+pmemalloc_tcache_flush(struct tcache *tcp)
+{
+	struct pool *pp;
+	int n;
+
+	if (tcp->pmp == NULL)
+		return;
+
+	DEBUG("pmp=0x%lx", tcp->pmp);
+
+	pp = pmemalloc_pool(tcp->pmp);
+	for (n = 0; n <= PMEM_TCACHE_CHUNKS; n++)
+		while (tcp->count[n] > 0) {
+			struct vclump *vp = tcp->clumps[n][--tcp->count[n]];
+			struct arena *ap = pmemalloc_arena_of(pp, vp->clp);
+
+			if ((errno = pthread_mutex_lock(&ap->lock)) != 0)
+				FATALSYS("pthread_mutex_lock");
+			pmemalloc_vclump_free(ap, vp);
+			pthread_mutex_unlock(&ap->lock);
+		}
+	tcp->pmp = NULL;
+}
+
+/*
+ * pmemalloc_tcache_destroy -- empty a thread's cache when the thread exits
+ *
+ * Internal support routine.
+ */
+static void
+pmemalloc_tcache_destroy(void *arg)
+{
+	pmemalloc_tcache_flush(arg);
+	free(arg);
+}
+
+/*
+ * pmemalloc_tcache_once -- set up for emptying caches
+ *
+ * Internal support routine.
+ */
+static void
+pmemalloc_tcache_once(void)
+{
+	if ((errno = pthread_key_create(&Tcache_key,
+					pmemalloc_tcache_destroy)) != 0)
+		FATALSYS("pthread_key_create");
+}
+
+/*
+ * pmemalloc_tcache_get -- return this thread's cache, set up for a pool
+ *
+ * A cache holds clumps from one pool at a time, so switching pools
+ * frees what's in it first.
+ *
+ * Internal support routine.
+ */
+static struct tcache *
+pmemalloc_tcache_get(void *pmp)
+{
+	if ((errno = pthread_once(&Tcache_once, pmemalloc_tcache_once)) != 0)
+		FATALSYS("pthread_once");
+
+	if (Tcache == NULL) {
+		if ((Tcache = calloc(1, sizeof(*Tcache))) == NULL)
+			FATALSYS("calloc");
+		if ((errno = pthread_setspecific(Tcache_key, Tcache)) != 0)
+			FATALSYS("pthread_setspecific");
+	}
+
+	if (Tcache->pmp != pmp) {
+		pmemalloc_tcache_flush(Tcache);
+		Tcache->pmp = pmp;
+	}
+
+	return Tcache;
+}
+
+/*
+ * pmemalloc_free -- free memory
+ *
+ * Inputs:
+ *	pmp -- a pmp as returned by pmemalloc_init()
+ *
+ *	ptr_ -- memory to be freed, as returned by pmemalloc_reserve()
+ */
+void
+pmemalloc_free(void *pmp, void *ptr_)
+{
+	struct arena *ap;
+	struct vclump *vp;
+	struct clump *clp;
+	struct tcache *tcp;
+	size_t sz;
+	size_t n;
+	int state;
+	int i;
+
+	DEBUG("pmp=%lx, ptr_=%lx", pmp, ptr_);
+
+	/* small clumps go to this thread's cache, if there's room */
+	tcp = Tcache_max ? pmemalloc_tcache_get(pmp) : NULL;
+
+	/* freeing a reservation is done in DRAM alone */
+	if ((vp = pmemalloc_reservation(pmp, ptr_, &ap)) != NULL) {
+		n = vp->size / PMEM_CHUNK_SIZE;
+		if (tcp && n <= PMEM_TCACHE_CHUNKS &&
+				tcp->count[n] < Tcache_max) {
+			DEBUG("[0x%lx] to thread cache", OFF(pmp, vp->clp));
+			memset(vp->on, '\0', sizeof(vp->on));
+			tcp->clumps[n][tcp->count[n]++] = vp;
+		} else
+			pmemalloc_vclump_free(ap, vp);
+		pthread_mutex_unlock(&ap->lock);
+		return;
+	}
+
+	clp = PMEM(pmp, (struct clump *)((uintptr_t)ptr_ - PMEM_CHUNK_SIZE));
+
+	DEBUG("[0x%lx] clump on: 0x%lx 0x%lx 0x%lx 0x%lx 0x%lx 0x%lx",
+			OFF(pmp, clp),
+			clp->on[0].off, clp->on[0].ptr_,
+			clp->on[1].off, clp->on[1].ptr_,
+			clp->on[2].off, clp->on[2].ptr_);
+
+	sz = clp->size & ~PMEM_STATE_MASK;
+	state = clp->size & PMEM_STATE_MASK;
+
+	if (state != PMEM_STATE_ACTIVE)
+		FATAL("freeing clumb in bad state: %d", state);
+
+	n = sz / PMEM_CHUNK_SIZE;
+	if (tcp && (n > PMEM_TCACHE_CHUNKS || tcp->count[n] >= Tcache_max))
+		tcp = NULL;
+
+	/*
+	 * order here is important:
+	 * 1. set state to FREEING
+	 * 2. persist *clp (now we're committed towards STATE_FREE)
+	 * 3. execute onfree stores, persisting each one
+	 * 4. set state to FREE
+	 * 5. persist *clp
+	 */
+	clp->size = sz | PMEM_STATE_FREEING;
+	pmem_persist(clp, sizeof(*clp), 0);
+	pmemalloc_exec_on(pmp, clp->on);
+	for (i = PMEM_NUM_ON - 1; i >= 0; i--)
+		clp->on[i].off = 0;
+	pmem_persist(clp, sizeof(*clp), 0);
+
+	if ((vp = pmemalloc_release(pmemalloc_pool(pmp), clp,
+					tcp != NULL)) != NULL) {
+		DEBUG("[0x%lx] to thread cache", OFF(pmp, clp));
+		tcp->clumps[n][tcp->count[n]++] = vp;
+	}
+}
+
+/*
+ * pmemalloc_slab_of -- return the slab a slot is in, and the slot number
+ *
+ * Internal support routine.
+ */
+static struct slabinfo *
+pmemalloc_slab_of(struct pool *pp, void *ptr_, size_t *slotp)
+{
+	uintptr_t off = (uintptr_t)ptr_;
+	struct slabpage *pgp = pmemalloc_slab_page(pp, off);
+	struct slabinfo *si = pgp->hi;
+	uintptr_t base;
+
+	if (si == NULL || off < OFF(pp->pmp, si->sp))
+		si = pgp->lo;
+
+	if (si == NULL)
+		FATAL("0x%lx not in a slab", off);
 
-		if (fsync(fd) < 0)
-			goto out;
+	base = OFF(pp->pmp, si->sp) + sizeof(struct slab);
+	if (off < base || (off - base) % si->slotsize ||
+			(off - base) / si->slotsize >= si->nslots)
+		FATAL("0x%lx not a slab slot", off);
 
-	} else {
-		if ((fd = open(path, O_RDWR)) < 0)
-			goto out;
-		size = stbuf.st_size;
+	*slotp = (off - base) / si->slotsize;
+	return si;
+}
 
-		/* XXX handle recovery case 1 described below */
-	}
+/*
+ * pmemalloc_slab_claim -- claim a free slot in a slab, without a lock
+ *
+ * Threads start looking in different words of the bitmap, so they
+ * don't all go after the same bits.  Returns -1 if the slab is full.
+ *
+ * Internal support routine.
+ */
+static int
+pmemalloc_slab_claim(struct slabinfo *si)
+{
+	int nwords = (si->nslots + 63) / 64;
+	int start = pmemalloc_thread_arena() % nwords;
+	int i;
 
-	/*
-	 * map the file
-	 */
-	if ((pmp = pmem_map(fd, size)) == NULL)
-		goto out;
+	for (i = 0; i < nwords; i++) {
+		int w = (start + i) % nwords;
+		uint64_t v = __atomic_load_n(&si->used[w], __ATOMIC_RELAXED);
 
-	/*
-	 * scan pool for recovery work, five kinds:
-	 * 	1. pmem pool file sisn't even fully setup
-	 * 	2. RESERVED clumps that need to be freed
-	 * 	3. ACTIVATING clumps that need to be ACTIVE
-	 * 	4. FREEING clumps that need to be freed
-	 * 	5. adjacent free clumps that need to be coalesced
-	 */
-	pmemalloc_recover(pmp);
-	pmemalloc_coalesce_free(pmp);
+		while (~v) {
+			int b = __builtin_ctzll(~v);
 
-	DEBUG("return pmp 0x%lx", pmp);
-	return pmp;
+			if (__atomic_compare_exchange_n(&si->used[w], &v,
+					v | (1ULL << b), 0, __ATOMIC_ACQUIRE,
+					__ATOMIC_RELAXED))
+				return w * 64 + b;
+		}
+	}
 
-out:
-	err = errno;
-	if (fd != -1)
-		close(fd);
-	errno = err;
-	return NULL;
+	return -1;
 }
 
 /*
- * pmemalloc_static_area -- return a pointer to the static 4k area
+ * pmemalloc_slab_new -- add a slab with slots of class c to a pool
  *
- * Outputs:
- * 	A pointer to a 4k static area is returned.  The caller may use
- * 	this area for anything -- no structure is imposed by this library.
- * 	This allows the caller to store pointers to roots of trees or
- * 	beginning of linked lists, etc. in the same file as the rest of
- * 	the memory pool.
+ * The slab is reserved as a clump, set up, and activated with the
+ * pool header's list of slabs pointing at it, so a crash part way
+ * leaves either no slab or a complete one.  The caller holds the
+ * pool's slablock.  Returns -1 with errno set if there's no room.
  *
- * The pointer returned is a normal (absolute) pointer.  No need to use
- * the PMEM() macro with it.  Changes to this area are not guaranteed
- * persistent until pmem_persist() has been called, for example:
- *	pmem_persist(pmem_static_area(pmp), PMEM_STATIC_SIZE);
+ * Internal support routine.
  */
-void *
-pmemalloc_static_area(void *pmp)
+static int
+pmemalloc_slab_new(struct pool *pp, int c)
 {
-	DEBUG("pmp=0x%lx", pmp);
+	void *pmp = pp->pmp;
+	struct pool_header *hdrp =
+		PMEM(pmp, (struct pool_header *)PMEM_HDR_OFFSET);
+	size_t slotsize = Slab_sizes[c];
+	size_t nslots = ((1UL << PMEM_SLAB_SHIFT) - sizeof(struct slab) +
+			slotsize - 1) / slotsize;
+	struct slab *sp_;
+	struct slab *sp;
+
+	DEBUG("pmp=0x%lx, slotsize=%lu, nslots=%lu", pmp, slotsize, nslots);
+
+	if ((sp_ = pmemalloc_reserve(pmp,
+				sizeof(*sp) + nslots * slotsize)) == NULL)
+		return -1;
+
+	sp = PMEM(pmp, sp_);
+	memset(sp, '\0', sizeof(*sp));
+	sp->next_ = hdrp->slabs_;
+	sp->slotsize = slotsize;
+	sp->nslots = nslots;
+	pmemalloc_onactive(pmp, sp_, (void **)&hdrp->slabs_, sp_);
+	pmemalloc_activate(pmp, sp_);
+
+	pmemalloc_slab_add(pp, sp);
+	return 0;
+}
 
-	return PMEM(pmp, (void *)PMEM_STATIC_OFFSET);
+/*
+ * pmemalloc_slab_logged -- activate or free a slot using a slabrec
+ *
+ * Used when the slot has pointer assignments to make along with it.
+ * A slab has a few slabrecs, claimed the same way as slots are; when
+ * they're all in use, this waits for one.
+ *
+ * Internal support routine.
+ */
+static void
+pmemalloc_slab_logged(void *pmp, struct slabinfo *si, size_t slot,
+		uint32_t state)
+{
+	struct slab *sp = si->sp;
+	uint64_t *wordp = &sp->bitmap[slot / 64];
+	uint64_t bit = 1ULL << (slot % 64);
+	struct slabrec *rp;
+	unsigned v;
+	int r;
+
+	v = __atomic_load_n(&si->recbusy, __ATOMIC_RELAXED);
+	for (;;) {
+		if (v == (1U << PMEM_SLAB_NREC) - 1) {
+			sched_yield();
+			v = __atomic_load_n(&si->recbusy, __ATOMIC_RELAXED);
+			continue;
+		}
+		r = __builtin_ctz(~v);
+		if (__atomic_compare_exchange_n(&si->recbusy, &v,
+				v | (1U << r), 0, __ATOMIC_ACQUIRE,
+				__ATOMIC_RELAXED))
+			break;
+	}
+	rp = &sp->rec[r];
+
+	DEBUG("[0x%lx] slot %lu state %u using rec %d",
+			OFF(pmp, sp), slot, state, r);
+
+	/*
+	 * order here is important:
+	 * 1. persist the slot (if activating) and the slabrec, in one batch
+	 * 2. set the slabrec's state
+	 * 3. persist it (now we're committed to finishing)
+	 * 4. execute "on" list, persisting each one
+	 * 5. set or clear the slot's bit, and persist it
+	 * 6. clear the slabrec's state, and persist it
+	 */
+	rp->slot = slot;
+	memcpy(rp->on, si->on[slot], sizeof(rp->on));
+	pmem_batch_begin();
+	if (state == PMEM_STATE_ACTIVATING)
+		pmem_batch_add((char *)sp + sizeof(*sp) + slot * si->slotsize,
+				si->slotsize);
+	pmem_batch_add(rp, sizeof(*rp));
+	pmem_batch_commit();
+	rp->state = state;
+	pmem_persist(&rp->state, sizeof(rp->state), 0);
+	pmemalloc_exec_on(pmp, rp->on);
+	if (state == PMEM_STATE_ACTIVATING)
+		__atomic_fetch_or(wordp, bit, __ATOMIC_RELAXED);
+	else
+		__atomic_fetch_and(wordp, ~bit, __ATOMIC_RELAXED);
+	pmem_persist(wordp, sizeof(*wordp), 0);
+	rp->state = 0;
+	pmem_persist(&rp->state, sizeof(rp->state), 0);
+
+	__atomic_fetch_and(&si->recbusy, ~(1U << r), __ATOMIC_RELEASE);
 }
 
 /*
- * pmemalloc_reserve -- allocate memory, volatile until pmemalloc_activate()
+ * pmemalloc_slab_reserve -- allocate a small object, volatile until activated
  *
  * Inputs:
  *	pmp -- a pmp as returned by pmemalloc_init()
  *
- *	size -- number of bytes to allocate
+ *	size -- number of bytes to allocate, at most PMEM_SLAB_MAX
  *
  * Outputs:
- *	On success, this function returns memory allocated from the
- *	memory-mapped file associated with pmp.  The memory is suitably
- *	aligned for any kind of variable.  The memory is not initialized.
- *
- *	On failure, this function returns NULL and errno is set.
+ *	On success, this function returns a slot of at least size bytes
+ *	in a slab, aligned to 16 bytes.  The memory is not initialized.
  *
- * The memory returned is initially *volatile* meaning that if the
- * program exits (or system crashes) before pmemalloc_activate() is called
- * with the return value, it is considered incompletely allocated
- * and the memory is returned to the free pool in the memory-mapped
- * file.  It works this way to prevent memory leaks when the system
- * crashes between a successful return from pmemalloc_reserve() and when
- * the caller actually links something to point at the new memory.
- * The basic pattern for using pmemalloc_reserve() is this:
+ *	On failure, this function returns NULL and errno is set (EINVAL
+ *	if size is too big for a slab).
  *
- *	np_ = pmemalloc_reserve(pmp, sizeof(*np_));
- *	...fill in fields in *np_...
- *	pmemalloc_onactive(pmp, np_, &parent->next_, np_);
- *	pmemalloc_activate(pmp, np_);
- *
- * In addition to flushing the data at *np_ to persistence, the
- * pmemalloc_activate() call above also atomically marks that memory
- * as in-use and stores the pointer to the persistent-memory-
- * based pointer parent->next_ in this example).  So any crash that
- * happens before parent->next_ is set to point at the new memory will
- * result in the memory being returned back to the free list.
+ * This works like pmemalloc_reserve(), with pmemalloc_slab_onactive()
+ * and pmemalloc_slab_activate() taking the place of pmemalloc_onactive()
+ * and pmemalloc_activate(), but the memory has no clump header, and is
+ * claimed without a lock or any writes to the pool.  Slabs are added
+ * to the pool as they're needed, and stay in it.
  */
 void *
-pmemalloc_reserve(void *pmp, size_t size)
+pmemalloc_slab_reserve(void *pmp, size_t size)
 {
-	size_t nsize = roundup(size + PMEM_CHUNK_SIZE, PMEM_CHUNK_SIZE);
-	struct clump *clp;
-
-	DEBUG("pmp=0x%lx, size=0x%lx -> 0x%lx", pmp, size, nsize);
-
-	clp = PMEM(pmp, (struct clump *)PMEM_CLUMP_OFFSET);
-
-	if (clp->size == 0)
-		FATAL("no clumps found");
-
-	/* first fit */
-	while (clp->size) {
-		size_t sz = clp->size & ~PMEM_STATE_MASK;
-		int state = clp->size & PMEM_STATE_MASK;
+	struct pool *pp = pmemalloc_pool(pmp);
+	int c = pmemalloc_slab_class(size);
+	struct slabinfo *head;
+	struct slabinfo *hint;
+	struct slabinfo *si;
+	int slot;
+	int err;
 
-		DEBUG("[0x%lx] clump size 0x%lx state %d",
-				OFF(pmp, clp), sz, state);
+	DEBUG("pmp=0x%lx, size=0x%lx", pmp, size);
 
-		if (state == PMEM_STATE_FREE && nsize <= sz) {
-			void *ptr = (void *)
-				(uintptr_t)clp + PMEM_CHUNK_SIZE -
-				(uintptr_t)pmp;
-			size_t leftover = sz - nsize;
-
-			DEBUG("fit found ptr 0x%lx, leftover 0x%lx bytes",
-					ptr, leftover);
-			if (leftover >= PMEM_CHUNK_SIZE * 2) {
-				struct clump *newclp;
-				int i;
-
-				newclp = (struct clump *)
-					((uintptr_t)clp + nsize);
-
-				DEBUG("splitting: [0x%lx] new clump",
-						OFF(pmp, newclp));
-				/*
-				 * can go ahead and start fiddling with
-				 * this freely since it is in the middle
-				 * of a free clump until we change fields
-				 * in *clp.  order here is important:
-				 * 	1. initialize new clump
-				 * 	2. persist new clump
-				 * 	3. initialize existing clump do list
-				 * 	4. persist existing clump
-				 * 	5. set new clump size, RESERVED
-				 * 	6. persist existing clump
-				 */
-				memset(newclp, '\0', sizeof(*newclp));
-				newclp->size = leftover | PMEM_STATE_FREE;
-				pmem_persist(newclp, sizeof(*newclp), 0);
-				for (i = 0; i < PMEM_NUM_ON; i++) {
-					clp->on[i].off = 0;
-					clp->on[i].ptr_ = 0;
-				}
-				pmem_persist(clp, sizeof(*clp), 0);
-				clp->size = nsize | PMEM_STATE_RESERVED;
-				pmem_persist(clp, sizeof(*clp), 0);
-			} else {
-				int i;
-
-				DEBUG("no split required");
-
-				for (i = 0; i < PMEM_NUM_ON; i++) {
-					clp->on[i].off = 0;
-					clp->on[i].ptr_ = 0;
-				}
-				pmem_persist(clp, sizeof(*clp), 0);
-				clp->size = sz | PMEM_STATE_RESERVED;
-				pmem_persist(clp, sizeof(*clp), 0);
-			}
+	if (size > PMEM_SLAB_MAX) {
+		DEBUG("size %lu too big for a slab", size);
+		errno = EINVAL;
+		return NULL;
+	}
 
-			return ptr;
+	for (;;) {
+		head = __atomic_load_n(&pp->slabs[c], __ATOMIC_ACQUIRE);
+		if ((hint = __atomic_load_n(&pp->slabhint[c],
+						__ATOMIC_RELAXED)) == NULL)
+			hint = head;
+
+		/* from the last slab that had room, round to it again */
+		for (si = hint; si; si = si->next)
+			if ((slot = pmemalloc_slab_claim(si)) >= 0)
+				goto found;
+		for (si = head; si != hint; si = si->next)
+			if ((slot = pmemalloc_slab_claim(si)) >= 0)
+				goto found;
+
+		/* they're all full, add a slab unless another thread did */
+		if ((errno = pthread_mutex_lock(&pp->slablock)) != 0)
+			FATALSYS("pthread_mutex_lock");
+		if (pp->slabs[c] == head && pmemalloc_slab_new(pp, c) < 0) {
+			err = errno;
+			pthread_mutex_unlock(&pp->slablock);
+			DEBUG("no room for a slab of %lu byte slots",
+					Slab_sizes[c]);
+			errno = err;
+			return NULL;
 		}
-
-		clp = (struct clump *)((uintptr_t)clp + sz);
-		DEBUG("[0x%lx] next clump", OFF(pmp, clp));
+		pthread_mutex_unlock(&pp->slablock);
 	}
 
-	DEBUG("no free memory of size %lu available", nsize);
-	errno = ENOMEM;
-	return NULL;
+found:
+	if (si != hint)
+		__atomic_store_n(&pp->slabhint[c], si, __ATOMIC_RELAXED);
+
+	DEBUG("[0x%lx] slot %d", OFF(pmp, si->sp), slot);
+
+	return (void *)(OFF(pmp, si->sp) + sizeof(struct slab) +
+			slot * si->slotsize);
 }
 
 /*
- * pmemalloc_onactive -- set assignments for when reservation goes active
+ * pmemalloc_slab_onactive -- set assignments for when a slot goes active
  *
  * Inputs:
  *	pmp -- a pmp as returned by pmemalloc_init()
  *
+ *	ptr_ -- slot as returned by pmemalloc_slab_reserve()
+ *
  *	parentp_ -- pointer to atomically set
  *
  *	nptr_ -- value to set in *parentp
+ *
+ * The list is kept in DRAM until pmemalloc_slab_activate().
  */
 void
-pmemalloc_onactive(void *pmp, void *ptr_, void **parentp_, void *nptr_)
+pmemalloc_slab_onactive(void *pmp, void *ptr_, void **parentp_, void *nptr_)
 {
-	struct clump *clp;
+	struct slabinfo *si;
+	size_t slot;
+	uint64_t bit;
 	int i;
 
 	DEBUG("pmp=0x%lx, ptr_=0x%lx, parentp_=0x%lx, nptr_=0x%lx",
 			pmp, ptr_, parentp_, nptr_);
 
-	clp = PMEM(pmp, (struct clump *)((uintptr_t)ptr_ - PMEM_CHUNK_SIZE));
-
-	ASSERTeq(clp->size & PMEM_STATE_MASK, PMEM_STATE_RESERVED);
+	si = pmemalloc_slab_of(pmemalloc_pool(pmp), ptr_, &slot);
+	bit = 1ULL << (slot % 64);
 
-	DEBUG("[0x%lx] clump on: 0x%lx 0x%lx 0x%lx 0x%lx 0x%lx 0x%lx",
-			OFF(pmp, clp),
-			clp->on[0].off, clp->on[0].ptr_,
-			clp->on[1].off, clp->on[1].ptr_,
-			clp->on[2].off, clp->on[2].ptr_);
+	if ((__atomic_load_n(&si->sp->bitmap[slot / 64],
+					__ATOMIC_RELAXED) & bit))
+		FATAL("slab slot 0x%lx not reserved", ptr_);
 
 	for (i = 0; i < PMEM_NUM_ON; i++)
-		if (clp->on[i].off == 0) {
-			DEBUG("using on[%d], off 0x%lx", i, OFF(pmp, parentp_));
-			/*
-			 * order here is important:
-			 * 1. set ptr_
-			 * 2. make ptr_ persistent
-			 * 3. set off
-			 * 4. make off persistent
-			 */
-			clp->on[i].ptr_ = nptr_;
-			pmem_persist(clp, sizeof(*clp), 0);
-			clp->on[i].off = OFF(pmp, parentp_);
-			pmem_persist(clp, sizeof(*clp), 0);
+		if (si->on[slot][i].off == 0) {
+			si->on[slot][i].ptr_ = nptr_;
+			si->on[slot][i].off = OFF(pmp, parentp_);
 			return;
 		}
 
@@ -554,48 +2378,41 @@ pmemalloc_onactive(void *pmp, void *ptr_, void **parentp_, void *nptr_)
 }
 
 /*
- * pmemalloc_free -- set assignments for when allocation gets freed
+ * pmemalloc_slab_onfree -- set assignments for when a slot gets freed
  *
  * Inputs:
  *	pmp -- a pmp as returned by pmemalloc_init()
  *
+ *	ptr_ -- slot as returned by pmemalloc_slab_reserve()
+ *
  *	parentp_ -- pointer to atomically set
  *
  *	nptr_ -- value to set in *parentp
+ *
+ * The list is kept in DRAM until pmemalloc_slab_free().
  */
 void
-pmemalloc_onfree(void *pmp, void *ptr_, void **parentp_, void *nptr_)
+pmemalloc_slab_onfree(void *pmp, void *ptr_, void **parentp_, void *nptr_)
 {
-	struct clump *clp;
+	struct slabinfo *si;
+	size_t slot;
+	uint64_t bit;
 	int i;
 
 	DEBUG("pmp=0x%lx, ptr_=0x%lx, parentp_=0x%lx, nptr_=0x%lx",
 			pmp, ptr_, parentp_, nptr_);
 
-	clp = PMEM(pmp, (struct clump *)((uintptr_t)ptr_ - PMEM_CHUNK_SIZE));
-
-	ASSERTeq(clp->size & PMEM_STATE_MASK, PMEM_STATE_ACTIVE);
+	si = pmemalloc_slab_of(pmemalloc_pool(pmp), ptr_, &slot);
+	bit = 1ULL << (slot % 64);
 
-	DEBUG("[0x%lx] clump on: 0x%lx 0x%lx 0x%lx 0x%lx 0x%lx 0x%lx",
-			OFF(pmp, clp),
-			clp->on[0].off, clp->on[0].ptr_,
-			clp->on[1].off, clp->on[1].ptr_,
-			clp->on[2].off, clp->on[2].ptr_);
+	if ((__atomic_load_n(&si->sp->bitmap[slot / 64],
+					__ATOMIC_RELAXED) & bit) == 0)
+		FATAL("slab slot 0x%lx not active", ptr_);
 
 	for (i = 0; i < PMEM_NUM_ON; i++)
-		if (clp->on[i].off == 0) {
-			DEBUG("using on[%d], off 0x%lx", i, OFF(pmp, parentp_));
-			/*
-			 * order here is important:
-			 * 1. set ptr_
-			 * 2. make ptr_ persistent
-			 * 3. set off
-			 * 4. make off persistent
-			 */
-			clp->on[i].ptr_ = nptr_;
-			pmem_persist(clp, sizeof(*clp), 0);
-			clp->on[i].off = OFF(pmp, parentp_);
-			pmem_persist(clp, sizeof(*clp), 0);
+		if (si->on[slot][i].off == 0) {
+			si->on[slot][i].ptr_ = nptr_;
+			si->on[slot][i].off = OFF(pmp, parentp_);
 			return;
 		}
 
@@ -603,132 +2420,91 @@ pmemalloc_onfree(void *pmp, void *ptr_, void **parentp_, void *nptr_)
 }
 
 /*
- * pmemalloc_activate -- atomically persist memory, mark in-use, store pointers
+ * pmemalloc_slab_activate -- persist a slot, mark it in-use, store pointers
  *
  * Inputs:
  *	pmp -- a pmp as returned by pmemalloc_init()
  *
- *	ptr_ -- memory to be persisted, as returned by pmemalloc_reserve()
+ *	ptr_ -- slot to be persisted, as returned by pmemalloc_slab_reserve()
  */
 void
-pmemalloc_activate(void *pmp, void *ptr_)
+pmemalloc_slab_activate(void *pmp, void *ptr_)
 {
-	struct clump *clp;
-	size_t sz;
-	int i;
+	struct slabinfo *si;
+	size_t slot;
+	uint64_t *wordp;
+	uint64_t bit;
 
 	DEBUG("pmp=%lx, ptr_=%lx", pmp, ptr_);
 
-	clp = PMEM(pmp, (struct clump *)((uintptr_t)ptr_ - PMEM_CHUNK_SIZE));
-
-	ASSERTeq(clp->size & PMEM_STATE_MASK, PMEM_STATE_RESERVED);
+	si = pmemalloc_slab_of(pmemalloc_pool(pmp), ptr_, &slot);
+	wordp = &si->sp->bitmap[slot / 64];
+	bit = 1ULL << (slot % 64);
 
-	DEBUG("[0x%lx] clump on: 0x%lx 0x%lx 0x%lx 0x%lx 0x%lx 0x%lx",
-			OFF(pmp, clp),
-			clp->on[0].off, clp->on[0].ptr_,
-			clp->on[1].off, clp->on[1].ptr_,
-			clp->on[2].off, clp->on[2].ptr_);
+	if ((__atomic_load_n(&si->used[slot / 64], __ATOMIC_RELAXED) &
+			bit) == 0 ||
+	    (__atomic_load_n(wordp, __ATOMIC_RELAXED) & bit))
+		FATAL("slab slot 0x%lx not reserved", ptr_);
 
-	sz = clp->size & ~PMEM_STATE_MASK;
+	if (si->on[slot][0].off) {
+		pmemalloc_slab_logged(pmp, si, slot, PMEM_STATE_ACTIVATING);
+		memset(si->on[slot], '\0', sizeof(si->on[slot]));
+		return;
+	}
 
 	/*
-	 * order here is important:
+	 * with no assignments to make, setting the slot's bit is the
+	 * commit point, and only the line it's in is flushed:
 	 * 1. persist *ptr_
-	 * 2. set state to ACTIVATING
-	 * 3. persist *clp (now we're committed to progressing to STATE_ACTIVE)
-	 * 4. execute "on" list, persisting each one
-	 * 5. clear out "on" list, last to first
-	 * 5. set state to ACTIVE
-	 * 6. persist *clp
+	 * 2. set the slot's bit
+	 * 3. persist it
 	 */
-	pmem_persist(PMEM(pmp, ptr_), clp->size - PMEM_CHUNK_SIZE, 0);
-	clp->size = sz | PMEM_STATE_ACTIVATING;
-	pmem_persist(clp, sizeof(*clp), 0);
-	for (i = 0; i < PMEM_NUM_ON; i++)
-		if (clp->on[i].off) {
-			uintptr_t *dest =
-				PMEM(pmp, (uintptr_t *)clp->on[i].off);
-			*dest = (uintptr_t)clp->on[i].ptr_;
-			pmem_persist(dest, sizeof(*dest), 0);
-		} else
-			break;
-	for (i = PMEM_NUM_ON - 1; i >= 0; i--)
-		clp->on[i].off = 0;
-	pmem_persist(clp, sizeof(*clp), 0);
-	clp->size = sz | PMEM_STATE_ACTIVE;
-	pmem_persist(clp, sizeof(*clp), 0);
+	pmem_persist(PMEM(pmp, ptr_), si->slotsize, 0);
+	__atomic_fetch_or(wordp, bit, __ATOMIC_RELAXED);
+	pmem_persist(wordp, sizeof(*wordp), 0);
 }
 
 /*
- * pmemalloc_free -- free memory
+ * pmemalloc_slab_free -- free a slot
  *
  * Inputs:
  *	pmp -- a pmp as returned by pmemalloc_init()
  *
- *	ptr_ -- memory to be freed, as returned by pmemalloc_reserve()
+ *	ptr_ -- slot to be freed, as returned by pmemalloc_slab_reserve()
+ *
+ * The slot may be either reserved or active.
  */
 void
-pmemalloc_free(void *pmp, void *ptr_)
+pmemalloc_slab_free(void *pmp, void *ptr_)
 {
-	struct clump *clp;
-	size_t sz;
-	int state;
-	int i;
+	struct slabinfo *si;
+	size_t slot;
+	uint64_t *wordp;
+	uint64_t bit;
 
 	DEBUG("pmp=%lx, ptr_=%lx", pmp, ptr_);
 
-	clp = PMEM(pmp, (struct clump *)((uintptr_t)ptr_ - PMEM_CHUNK_SIZE));
-
-
-	DEBUG("[0x%lx] clump on: 0x%lx 0x%lx 0x%lx 0x%lx 0x%lx 0x%lx",
-			OFF(pmp, clp),
-			clp->on[0].off, clp->on[0].ptr_,
-			clp->on[1].off, clp->on[1].ptr_,
-			clp->on[2].off, clp->on[2].ptr_);
-
-	sz = clp->size & ~PMEM_STATE_MASK;
-	state = clp->size & PMEM_STATE_MASK;
-
-	if (state != PMEM_STATE_RESERVED && state != PMEM_STATE_ACTIVE)
-		FATAL("freeing clumb in bad state: %d", state);
-
-	if (state == PMEM_STATE_ACTIVE) {
-		/*
-		 * order here is important:
-		 * 1. set state to FREEING
-		 * 2. persist *clp (now we're committed towards STATE_FREE)
-		 * 3. execute onfree stores, persisting each one
-		 * 4. set state to FREE
-		 * 5. persist *clp
-		 */
-		clp->size = sz | PMEM_STATE_FREEING;
-		pmem_persist(clp, sizeof(*clp), 0);
-		for (i = 0; i < PMEM_NUM_ON; i++)
-			if (clp->on[i].off) {
-				uintptr_t *dest =
-					PMEM(pmp, (uintptr_t *)clp->on[i].off);
-				*dest = (uintptr_t)clp->on[i].ptr_;
-				pmem_persist(dest, sizeof(*dest), 0);
-			} else
-				break;
-		for (i = PMEM_NUM_ON - 1; i >= 0; i--)
-			clp->on[i].off = 0;
-		pmem_persist(clp, sizeof(*clp), 0);
+	si = pmemalloc_slab_of(pmemalloc_pool(pmp), ptr_, &slot);
+	wordp = &si->sp->bitmap[slot / 64];
+	bit = 1ULL << (slot % 64);
+
+	if ((__atomic_load_n(&si->used[slot / 64], __ATOMIC_RELAXED) &
+			bit) == 0)
+		FATAL("freeing slab slot 0x%lx not in use", ptr_);
+
+	if (__atomic_load_n(wordp, __ATOMIC_RELAXED) & bit) {
+		if (si->on[slot][0].off)
+			pmemalloc_slab_logged(pmp, si, slot,
+					PMEM_STATE_FREEING);
+		else {
+			__atomic_fetch_and(wordp, ~bit, __ATOMIC_RELAXED);
+			pmem_persist(wordp, sizeof(*wordp), 0);
+		}
 	}
-	clp->size = sz | PMEM_STATE_FREE;
-	pmem_persist(clp, sizeof(*clp), 0);
 
-	/*
-	 * at this point we may have adjacent free clumps that need
-	 * to be coalesced.  there are three interesting cases:
-	 * 	case 1: the clump below us is free (need to combine two clumps)
-	 * 	case 2: the clump above us is free (need to combine two clumps)
-	 * 	case 3: both are free (need to combining three clumps)
-	 * XXX this can be much more optimal by using clp->prevsize to
-	 *     get back to the clump below us.  for now, we just invoke
-	 *     the recovery code for coalescing.
-	 */
-	pmemalloc_coalesce_free(pmp);
+	/* the slot can be claimed again once it's out of the bitmap */
+	memset(si->on[slot], '\0', sizeof(si->on[slot]));
+	__atomic_fetch_and(&si->used[slot / 64], ~bit, __ATOMIC_RELEASE);
 }
 
 /*
@@ -750,6 +2526,10 @@ void pmemalloc_check(const char *path)
 	struct clump *lastclp;
 	struct pool_header *hdrp;
 	size_t clumptotal;
+	size_t prevsize = 0;
+	size_t size;		/* pool size the clumps are laid out for */
+	int growing = 0;	/* pmemalloc_grow() was interrupted */
+	unsigned nstale = 0;	/* clumps with a stale prevsize */
 	/*
 	 * stats we keep for each type of memory:
 	 * 	stats[PMEM_STATE_FREE] for free clumps
@@ -773,6 +2553,17 @@ void pmemalloc_check(const char *path)
 		"Freeing",
 		"TOTAL",
 	};
+	/*
+	 * stats we keep for the slabs, by slot size
+	 */
+	struct {
+		unsigned slabs;
+		unsigned slots;
+		unsigned active;
+		unsigned pending;	/* slabrecs recovery will finish */
+	} slabstats[PMEM_SLAB_NCLASSES] = { 0 };
+	unsigned nslabs = 0;
+	struct slab *sp_;
 	int i;
 
 	DEBUG("path=%s", path);
@@ -803,15 +2594,30 @@ void pmemalloc_check(const char *path)
 		FATAL("failed signature check");
 	DEBUG("signature check passed");
 
+	/*
+	 * a file longer than the pool is a pmemalloc_grow() that a crash
+	 * interrupted, which pmemalloc_init() finishes.  the clumps end
+	 * where the header says, or already at the end of the file if
+	 * only the header is behind.
+	 */
+	if (hdrp->totalsize > stbuf.st_size)
+		FATAL("file size %lu less than pool size %lu",
+				stbuf.st_size, hdrp->totalsize);
+	size = hdrp->totalsize;
+	if (size != stbuf.st_size) {
+		DEBUG("pool size %lu, file size %lu: growth pending",
+				size, stbuf.st_size);
+		growing = 1;
+	}
+
 	clp = PMEM(pmp, (struct clump *)PMEM_CLUMP_OFFSET);
 	/*
-	 * location of last clump is calculated by rounding the file
+	 * location of last clump is calculated by rounding the pool
 	 * size down to a multiple of 64, and then subtracting off
 	 * another 64 to hold the struct clump.  the last clump is
 	 * indicated by a size of zero.
 	 */
-	lastclp = PMEM(pmp, (struct clump *)
-		(stbuf.st_size & ~(PMEM_CHUNK_SIZE - 1)) - PMEM_CHUNK_SIZE);
+	lastclp = pmemalloc_lastclump(pmp, size);
 	DEBUG("    clp 0x%lx (off 0x%lx)", clp, OFF(pmp, clp));
 	DEBUG("lastclp 0x%lx (off 0x%lx)", lastclp, OFF(pmp, lastclp));
 
@@ -826,22 +2632,22 @@ void pmemalloc_check(const char *path)
 	 * + clumptotal
 	 * + last clump marker (CHUNK_SIZE)
 	 * + any bytes we rounded off the end
-	 * = file size
+	 * = pool size
 	 */
 	if (PMEM_CLUMP_OFFSET + clumptotal + 
-		(stbuf.st_size & (PMEM_CHUNK_SIZE - 1)) + PMEM_CHUNK_SIZE
-		== stbuf.st_size) {
-		DEBUG("section sizes correctly add up to file size");
+		(size & (PMEM_CHUNK_SIZE - 1)) + PMEM_CHUNK_SIZE
+		== size) {
+		DEBUG("section sizes correctly add up to pool size");
 	} else {
 		FATAL("CLUMP_OFFSET %d + clumptotal %lu + rounded %d + "
-				"CHUNK_SIZE %d = %lu, (not st_size %lu)",
+				"CHUNK_SIZE %d = %lu, (not pool size %lu)",
 				PMEM_CLUMP_OFFSET, clumptotal,
-				(stbuf.st_size & (PMEM_CHUNK_SIZE - 1)),
+				(size & (PMEM_CHUNK_SIZE - 1)),
 				PMEM_CHUNK_SIZE,
 				PMEM_CLUMP_OFFSET + clumptotal +
-				(stbuf.st_size & (PMEM_CHUNK_SIZE - 1)) +
+				(size & (PMEM_CHUNK_SIZE - 1)) +
 				PMEM_CHUNK_SIZE,
-				stbuf.st_size);
+				size);
 	}
 
 	if (clp->size == 0)
@@ -858,6 +2664,17 @@ void pmemalloc_check(const char *path)
 			clp->on[1].off, clp->on[1].ptr_,
 			clp->on[2].off, clp->on[2].ptr_);
 
+		/*
+		 * a crash can leave prevsize stale, and pools from before
+		 * it was kept have it zero; pmemalloc_init() repairs it
+		 */
+		if (clp->prevsize != prevsize) {
+			DEBUG("[0x%lx] prevsize 0x%lx, clump below is 0x%lx",
+					OFF(pmp, clp), clp->prevsize, prevsize);
+			nstale++;
+		}
+		prevsize = sz;
+
 		if (sz > stats[PMEM_STATE_UNUSED].largest)
 			stats[PMEM_STATE_UNUSED].largest = sz;
 		if (stats[PMEM_STATE_UNUSED].smallest == 0 ||
@@ -911,9 +2728,67 @@ void pmemalloc_check(const char *path)
 
 	if (clp == lastclp)
 		DEBUG("all clump space accounted for");
-	else
+	else if (growing &&
+			clp == pmemalloc_lastclump(pmp, stbuf.st_size)) {
+		DEBUG("clumps already cover the new space");
+		lastclp = clp;
+		clumptotal = (uintptr_t)lastclp -
+			(uintptr_t)PMEM(pmp, (struct clump *)PMEM_CLUMP_OFFSET);
+	} else
 		FATAL("clump list stopped at %lx instead of %lx", clp, lastclp);
 
+	if (clp->prevsize != prevsize) {
+		DEBUG("last clump prevsize 0x%lx, clump below is 0x%lx",
+				clp->prevsize, prevsize);
+		nstale++;
+	}
+
+	/*
+	 * the slabs are ACTIVE clumps, so they're counted above as well
+	 */
+	for (sp_ = hdrp->slabs_; sp_; sp_ = PMEM(pmp, sp_)->next_) {
+		struct slab *sp = PMEM(pmp, sp_);
+		struct clump *sclp = (struct clump *)
+			((uintptr_t)sp - PMEM_CHUNK_SIZE);
+		int c = pmemalloc_slab_class(sp->slotsize);
+		int state;
+		size_t slot;
+
+		DEBUG("[0x%lx] slab of %lu slots of %lu bytes",
+				OFF(pmp, sp), sp->nslots, sp->slotsize);
+
+		if ((uintptr_t)sp_ < PMEM_CLUMP_OFFSET + PMEM_CHUNK_SIZE ||
+				sclp >= lastclp)
+			FATAL("slab 0x%lx outside the pool", sp_);
+
+		/* a crash may leave the slab's clump still ACTIVATING */
+		state = sclp->size & PMEM_STATE_MASK;
+		if (state != PMEM_STATE_ACTIVE &&
+				state != PMEM_STATE_ACTIVATING)
+			FATAL("[0x%lx] slab clump in bad state: %d",
+					OFF(pmp, sp), state);
+
+		if (Slab_sizes[c] != sp->slotsize || sp->nslots == 0 ||
+				sp->nslots > PMEM_SLAB_SLOTS ||
+				sizeof(*sp) + sp->nslots * sp->slotsize +
+				PMEM_CHUNK_SIZE >
+				(sclp->size & ~PMEM_STATE_MASK))
+			FATAL("[0x%lx] bad slab, %lu slots of %lu bytes",
+					OFF(pmp, sp), sp->nslots, sp->slotsize);
+
+		if (++nslabs > stats[PMEM_STATE_UNUSED].count)
+			FATAL("loop in the list of slabs");
+
+		slabstats[c].slabs++;
+		slabstats[c].slots += sp->nslots;
+		for (slot = 0; slot < sp->nslots; slot++)
+			if (sp->bitmap[slot / 64] & (1ULL << (slot % 64)))
+				slabstats[c].active++;
+		for (i = 0; i < PMEM_SLAB_NREC; i++)
+			if (sp->rec[i].state)
+				slabstats[c].pending++;
+	}
+
 	if (munmap(pmp, stbuf.st_size) < 0)
 		FATALSYS("munmap");
 
@@ -921,8 +2796,15 @@ void pmemalloc_check(const char *path)
 	 * print the report
 	 */
 	printf("Summary of pmem pool:\n");
-	printf("File size: %lu, %d allocatable bytes in pool\n\n",
+	printf("File size: %lu, %d allocatable bytes in pool\n",
 			stbuf.st_size, clumptotal);
+	if (growing)
+		printf("Growth from %lu pending, finished by pmemalloc_init\n",
+				size);
+	if (nstale)
+		printf("%u stale prevsize, repaired by pmemalloc_init\n",
+				nstale);
+	printf("\n");
 	printf("     State      Bytes     Clumps    Largest   Smallest\n");
 	for (i = 0; i < PMEM_STATE_UNUSED + 1; i++) {
 		printf("%10s %10d %10d %10d %10d\n",
@@ -932,4 +2814,17 @@ void pmemalloc_check(const char *path)
 				stats[i].largest,
 				stats[i].smallest);
 	}
+
+	if (nslabs == 0)
+		return;
+
+	printf("\n Slot size      Slabs      Slots     Active    Pending\n");
+	for (i = 0; i < PMEM_SLAB_NCLASSES; i++)
+		if (slabstats[i].slabs)
+			printf("%10lu %10u %10u %10u %10u\n",
+					Slab_sizes[i],
+					slabstats[i].slabs,
+					slabstats[i].slots,
+					slabstats[i].active,
+					slabstats[i].pending);
 }
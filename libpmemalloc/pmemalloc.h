@@ -46,17 +46,32 @@
  */
 #define	PMEM_NUM_ON 3
 
+/*
+ * biggest object pmemalloc_slab_reserve() allocates
+ */
+#define	PMEM_SLAB_MAX 256
+
 /*
  * given a relative pointer, add in the base associated
  * with the given Persistent Memory Pool (pmp).
  */
 #define	PMEM(pmp, ptr_) ((typeof(ptr_))(pmp + (uintptr_t)ptr_))
 
+void pmemalloc_arenas(int narenas);
+void pmemalloc_tcache(int nclumps);
 void *pmemalloc_init(const char *path, size_t size);
+int pmemalloc_grow(void *pmp, size_t size);
 void *pmemalloc_static_area(void *pmp);
 void *pmemalloc_reserve(void *pmp, size_t size);
 void pmemalloc_onactive(void *pmp, void *ptr_, void **parentp_, void *nptr_);
 void pmemalloc_onfree(void *pmp, void *ptr_, void **parentp_, void *nptr_);
 void pmemalloc_activate(void *pmp, void *ptr_);
 void pmemalloc_free(void *pmp, void *ptr_);
+void *pmemalloc_slab_reserve(void *pmp, size_t size);
+void pmemalloc_slab_onactive(void *pmp, void *ptr_, void **parentp_,
+		void *nptr_);
+void pmemalloc_slab_onfree(void *pmp, void *ptr_, void **parentp_,
+		void *nptr_);
+void pmemalloc_slab_activate(void *pmp, void *ptr_);
+void pmemalloc_slab_free(void *pmp, void *ptr_);
 void pmemalloc_check(const char *path);
@@ -33,18 +33,35 @@
 /*
  * pmemalloc_test1.c -- unit test 1 for libpmemalloc
  *
- * Usage: pmemalloc_test1 [-FMd] path [numbers...]
+ * Usage: pmemalloc_test1 [-FIMds] [-g size] path [numbers...]
  *
- * Prepends any numbers given to a pmemalloc-based linked list.
+ * Prepends any numbers given to a pmemalloc-based linked list,
+ * growing the pool to size bytes first if -g is given.
  * If no numbers given, prints the list.
+ * With -s, the nodes are allocated from slabs (use it for every run
+ * on a pool, or none).
+ *
+ * With -I, the run is made in crash image mode (see
+ * pmem_fit_image_mode()), so the pool file is left as it was (except
+ * for being extended by -g, which the next run finishes).  Then
+ * the durable image at every epoch is written out to path.crash, and
+ * a child process recovers it with pmemalloc_init(), checks that the
+ * list is the one from before the run, the one from after it, or one
+ * in between, and runs pmemalloc_check() on it.  That checks a crash
+ * at every persist point in one run, instead of one run per crash
+ * point under icount.
  */
 
+#include <sys/param.h>
+#include <sys/wait.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
 #include <stdarg.h>
+#include <limits.h>
 
 #include "util/util.h"
 #include "icount/icount.h"
@@ -68,7 +85,106 @@ struct static_info {
 	struct node *rootnp_;	/* first node of the linked list */
 };
 
-char Usage[] = "[-FMd] path [strings...]";	/* for USAGE() */
+/*
+ * what check_image() checks the crash images against
+ */
+struct image_check {
+	const char *path;	/* where each image is written */
+	int *before;		/* the list before the run */
+	size_t nbefore;
+	int *after;		/* the list after the run */
+	size_t nafter;
+};
+
+char Usage[] = "[-FIMds] [-g size] path [strings...]";	/* for USAGE() */
+
+/*
+ * list_values -- return the values in the list, setting *np to the count
+ */
+static int *
+list_values(void *pmp, struct static_info *sp, size_t *np)
+{
+	struct node *np_;
+	int *values = NULL;
+	size_t n = 0;
+
+	for (np_ = sp->rootnp_; np_; np_ = PMEM(pmp, np_)->next_) {
+		if ((n & (n - 1)) == 0 &&
+		    (values = realloc(values, sizeof(*values) *
+				(n ? n * 2 : 1))) == NULL)
+			FATALSYS("realloc");
+		values[n++] = PMEM(pmp, np_)->value;
+	}
+
+	*np = n;
+	return values;
+}
+
+/*
+ * check_image -- recover and check the durable image at one epoch
+ *
+ * The recovered list must be a tail of the longer of the lists from
+ * before and after the run, at least as long as the shorter one.
+ */
+static int
+check_image(const void *image, size_t len, unsigned long epoch, void *arg)
+{
+	struct image_check *icp = arg;
+	int fd;
+	pid_t pid;
+	int status;
+
+	DEBUG("epoch %lu", epoch);
+
+	if ((fd = open(icp->path, O_CREAT|O_TRUNC|O_WRONLY, 0666)) < 0)
+		FATALSYS("%s", icp->path);
+	if (write(fd, image, len) != len)
+		FATALSYS("write %s", icp->path);
+	close(fd);
+
+	if ((pid = fork()) < 0)
+		FATALSYS("fork");
+
+	if (pid == 0) {
+		int *longer = icp->nafter > icp->nbefore ?
+			icp->after : icp->before;
+		size_t nlonger = MAX(icp->nbefore, icp->nafter);
+		size_t nshorter = MIN(icp->nbefore, icp->nafter);
+		int *values;
+		size_t n;
+		void *pmp;
+
+		/* the child's own mapping is of a real file */
+		pmem_msync_mode();
+		if (freopen("/dev/null", "w", stdout) == NULL)
+			FATALSYS("/dev/null");
+
+		if ((pmp = pmemalloc_init(icp->path, MY_POOL_SIZE)) == NULL)
+			FATALSYS("pmemalloc_init on %s", icp->path);
+
+		values = list_values(pmp,
+			(struct static_info *)pmemalloc_static_area(pmp), &n);
+		if (n < nshorter || n > nlonger ||
+		    memcmp(values, longer + nlonger - n,
+				sizeof(*values) * n))
+			FATAL("epoch %lu: unexpected list of %lu values",
+					epoch, n);
+
+		pmemalloc_check(icp->path);
+		exit(0);
+	}
+
+	if (waitpid(pid, &status, 0) < 0)
+		FATALSYS("waitpid(pid=%d)", pid);
+
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "%s: crash image at epoch %lu failed\n",
+				Myname, epoch);
+		return 1;
+	}
+
+	return 0;
+}
 
 int
 main(int argc, char *argv[])
@@ -77,19 +193,28 @@ main(int argc, char *argv[])
 	int opt;
 	int fflag = 0;
 	int iflag = 0;
+	int Iflag = 0;
+	int sflag = 0;
 	unsigned long icount;
+	size_t gsize = 0;
 	void *pmp;
 	struct static_info *sp;
 	struct node *parent_;
 	struct node *np_;
+	struct image_check ic = { 0 };
 
 	Myname = argv[0];
-	while ((opt = getopt(argc, argv, "FMdfi:")) != -1) {
+	while ((opt = getopt(argc, argv, "FIMdfg:i:s")) != -1) {
 		switch (opt) {
 		case 'F':
 			pmem_fit_mode();
 			break;
 
+		case 'I':
+			Iflag++;
+			pmem_fit_image_mode();
+			break;
+
 		case 'M':
 			pmem_msync_mode();
 			break;
@@ -102,11 +227,19 @@ main(int argc, char *argv[])
 			fflag++;
 			break;
 
+		case 'g':
+			gsize = strtoul(optarg, NULL, 10);
+			break;
+
 		case 'i':
 			iflag++;
 			icount = strtoul(optarg, NULL, 10);
 			break;
 
+		case 's':
+			sflag++;
+			break;
+
 		default:
 			USAGE(NULL);
 		}
@@ -122,6 +255,9 @@ main(int argc, char *argv[])
 	/* fetch our static info */
 	sp = (struct static_info *)pmemalloc_static_area(pmp);
 
+	if (Iflag)
+		ic.before = list_values(pmp, sp, &ic.nbefore);
+
 	if (optind < argc) {	/* numbers supplied as arguments? */
 		int i;
 
@@ -131,19 +267,31 @@ main(int argc, char *argv[])
 		if (iflag)
 			icount_start(icount);	/* start instruction count */
 
+		if (gsize && pmemalloc_grow(pmp, gsize) < 0)
+			FATALSYS("pmemalloc_grow");
+
 		for (i = optind; i < argc; i++) {
 			int value = atoi(argv[i]);
 
-			if ((np_ = pmemalloc_reserve(pmp,
-							sizeof(*np_))) == NULL)
+			if (sflag)
+				np_ = pmemalloc_slab_reserve(pmp, sizeof(*np_));
+			else
+				np_ = pmemalloc_reserve(pmp, sizeof(*np_));
+			if (np_ == NULL)
 				FATALSYS("pmemalloc_reserve");
 
 			/* link it in at the beginning of the list */
 			PMEM(pmp, np_)->next_ = sp->rootnp_;
 			PMEM(pmp, np_)->value = value;
-			pmemalloc_onactive(pmp, np_,
-					(void **)&sp->rootnp_, np_);
-			pmemalloc_activate(pmp, np_);
+			if (sflag) {
+				pmemalloc_slab_onactive(pmp, np_,
+						(void **)&sp->rootnp_, np_);
+				pmemalloc_slab_activate(pmp, np_);
+			} else {
+				pmemalloc_onactive(pmp, np_,
+						(void **)&sp->rootnp_, np_);
+				pmemalloc_activate(pmp, np_);
+			}
 		}
 
 		if (iflag) {
@@ -163,9 +311,15 @@ main(int argc, char *argv[])
 			icount_start(icount);	/* start instruction count */
 
 		np_ = sp->rootnp_;
-		pmemalloc_onfree(pmp, np_, (void **)&sp->rootnp_,
-				PMEM(pmp, np_)->next_);
-		pmemalloc_free(pmp, np_);
+		if (sflag) {
+			pmemalloc_slab_onfree(pmp, np_, (void **)&sp->rootnp_,
+					PMEM(pmp, np_)->next_);
+			pmemalloc_slab_free(pmp, np_);
+		} else {
+			pmemalloc_onfree(pmp, np_, (void **)&sp->rootnp_,
+					PMEM(pmp, np_)->next_);
+			pmemalloc_free(pmp, np_);
+		}
 
 		if (iflag) {
 			icount_stop();		/* end instruction count */
@@ -188,6 +342,20 @@ main(int argc, char *argv[])
 		printf("\n");
 	}
 
+	if (Iflag) {
+		char cpath[PATH_MAX];
+		unsigned long nimages = pmem_image_epoch() + 1;
+
+		snprintf(cpath, sizeof(cpath), "%s.crash", path);
+		ic.path = cpath;
+		ic.after = list_values(pmp, sp, &ic.nafter);
+		if (pmem_image_walk(pmp, check_image, &ic) != 0)
+			FATAL("crash image check failed");
+		unlink(cpath);
+
+		printf("%lu crash images checked\n", nimages);
+	}
+
 	DEBUG("Done.");
 	exit(0);
 }
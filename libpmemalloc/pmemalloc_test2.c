@@ -33,7 +33,21 @@
 /*
  * pmemalloc_test2.c -- unit test 2 for libpmemalloc
  *
- * Usage: pmemalloc_test2 [-FMd] path
+ * Usage: pmemalloc_test2 [-FMSd] [-t threads [-a arenas] [-c clumps]] path
+ *
+ * With -S, libpmem statistics for each call site are printed at the end.
+ *
+ * With -t, the pool is instead worked on by that many threads at once,
+ * using pmemalloc_arenas(arenas) and pmemalloc_tcache(clumps).  Each
+ * thread has its own row of slots in the static area, and over and
+ * over picks a slot at random: if it holds an object, the object's
+ * contents are checked and it's usually freed, otherwise a new object
+ * is reserved and filled in, and usually activated into the slot (or
+ * else freed again without being activated).  The objects left in the
+ * slots stay in the pool, and are checked first thing the next time,
+ * which may use a different number of threads and arenas.  Each thread
+ * seeds its own random numbers, so the counts printed are the same from
+ * run to run.  The pool is left for pmemalloc_check to look over.
  */
 
 #include <stdio.h>
@@ -42,6 +56,7 @@
 #include <errno.h>
 #include <string.h>
 #include <stdarg.h>
+#include <pthread.h>
 
 #include "util/util.h"
 #include "icount/icount.h"
@@ -51,7 +66,188 @@
 #define	MY_POOL_SIZE	(10 * 1024 * 1024)
 #define NPTRS 4096
 
-char Usage[] = "[-FMd] path";	/* for USAGE() */
+#define	MAXTHREADS 16
+#define	SLOTS 32	/* slots per thread, filling the static area */
+#define	ITERS 4000	/* slots picked by each thread */
+
+char Usage[] = "[-FMSd] [-t threads [-a arenas] [-c clumps]] path";
+							/* for USAGE() */
+
+/*
+ * what each object starts with, the rest is filled with fill()
+ */
+struct obj {
+	int thread;
+	int slot;
+	size_t size;
+};
+
+/*
+ * the static area, with the objects of each thread
+ */
+struct static_info {
+	struct obj *slots_[MAXTHREADS][SLOTS];
+};
+
+/*
+ * what each thread works with, and what it counts
+ */
+struct thread {
+	pthread_t tid;
+	int num;
+	void *pmp;
+	unsigned long nactivated;
+	unsigned long nfreed;
+	unsigned long nunused;	/* freed without being activated */
+};
+
+/*
+ * fill -- the byte each object is filled with past its header
+ */
+static int
+fill(int thread, int slot, size_t size)
+{
+	return (thread * SLOTS + slot + (int)size) & 0xff;
+}
+
+/*
+ * check_obj -- check the contents of the object in a slot
+ *
+ * Internal support routine.
+ */
+static void
+check_obj(void *pmp, struct obj *op_, int thread, int slot)
+{
+	struct obj *op = PMEM(pmp, op_);
+	unsigned char *p = (unsigned char *)(op + 1);
+	size_t i;
+
+	if (op->thread != thread || op->slot != slot)
+		FATAL("slot %d/%d holds the object for slot %d/%d",
+				thread, slot, op->thread, op->slot);
+
+	for (i = 0; i < op->size - sizeof(*op); i++)
+		if (p[i] != fill(thread, slot, op->size))
+			FATAL("slot %d/%d: object corrupted at byte %zu",
+					thread, slot, sizeof(*op) + i);
+}
+
+/*
+ * worker -- allocate, activate and free in the thread's slots
+ *
+ * Internal support routine.
+ */
+static void *
+worker(void *arg)
+{
+	struct thread *tp = (struct thread *)arg;
+	void *pmp = tp->pmp;
+	struct static_info *sp = pmemalloc_static_area(pmp);
+	unsigned seed = tp->num + 1;
+	int i;
+
+	for (i = 0; i < ITERS; i++) {
+		int slot = rand_r(&seed) % SLOTS;
+		struct obj **slotp_ = &sp->slots_[tp->num][slot];
+		struct obj *op_;
+		size_t size;
+
+		if ((op_ = *slotp_) != NULL) {
+			check_obj(pmp, op_, tp->num, slot);
+			if (rand_r(&seed) % 4 == 0)
+				continue;	/* keep it a while longer */
+
+			pmemalloc_onfree(pmp, op_, (void **)slotp_, NULL);
+			pmemalloc_free(pmp, op_);
+			tp->nfreed++;
+			continue;
+		}
+
+		/* mostly small enough for the thread caches, some not */
+		if (rand_r(&seed) % 4)
+			size = sizeof(struct obj) + rand_r(&seed) % 900;
+		else
+			size = 1024 + rand_r(&seed) % 4096;
+
+		if ((op_ = pmemalloc_reserve(pmp, size)) == NULL)
+			FATALSYS("pmemalloc_reserve: thread %d iteration %d",
+					tp->num, i);
+
+		PMEM(pmp, op_)->thread = tp->num;
+		PMEM(pmp, op_)->slot = slot;
+		PMEM(pmp, op_)->size = size;
+		memset(PMEM(pmp, op_) + 1, fill(tp->num, slot, size),
+				size - sizeof(struct obj));
+
+		if (rand_r(&seed) % 5 == 0) {
+			pmemalloc_free(pmp, op_);
+			tp->nunused++;
+			continue;
+		}
+
+		pmemalloc_onactive(pmp, op_, (void **)slotp_, op_);
+		pmemalloc_activate(pmp, op_);
+		tp->nactivated++;
+	}
+
+	return NULL;
+}
+
+/*
+ * threaded -- the -t test, see the top of this file
+ *
+ * Internal support routine.
+ */
+static void
+threaded(void *pmp, int nthreads, int narenas, int nclumps)
+{
+	struct static_info *sp = pmemalloc_static_area(pmp);
+	struct thread threads[MAXTHREADS];
+	unsigned long nactivated = 0;
+	unsigned long nfreed = 0;
+	unsigned long nunused = 0;
+	int nleft = 0;
+	int t;
+	int s;
+
+	for (t = 0; t < MAXTHREADS; t++)
+		for (s = 0; s < SLOTS; s++)
+			if (sp->slots_[t][s] != NULL) {
+				check_obj(pmp, sp->slots_[t][s], t, s);
+				nleft++;
+			}
+	printf("%d objects from the last run checked\n", nleft);
+
+	for (t = 0; t < nthreads; t++) {
+		memset(&threads[t], '\0', sizeof(threads[t]));
+		threads[t].num = t;
+		threads[t].pmp = pmp;
+		if ((errno = pthread_create(&threads[t].tid, NULL,
+				worker, &threads[t])) != 0)
+			FATALSYS("pthread_create");
+	}
+
+	for (t = 0; t < nthreads; t++) {
+		if ((errno = pthread_join(threads[t].tid, NULL)) != 0)
+			FATALSYS("pthread_join");
+		nactivated += threads[t].nactivated;
+		nfreed += threads[t].nfreed;
+		nunused += threads[t].nunused;
+	}
+
+	nleft = 0;
+	for (t = 0; t < MAXTHREADS; t++)
+		for (s = 0; s < SLOTS; s++)
+			if (sp->slots_[t][s] != NULL) {
+				check_obj(pmp, sp->slots_[t][s], t, s);
+				nleft++;
+			}
+
+	printf("%d threads, %d arenas, tcache %d: %lu activated, "
+			"%lu freed, %lu freed unused, %d left\n",
+			nthreads, narenas, nclumps, nactivated, nfreed,
+			nunused, nleft);
+}
 
 int
 main(int argc, char *argv[])
@@ -60,10 +256,14 @@ main(int argc, char *argv[])
 	int opt;
 	void *pmp;
 	int i;
+	int sflag = 0;
+	int nthreads = 0;
+	int narenas = 1;
+	int nclumps = 0;
 	void *ptrs[NPTRS];
 
 	Myname = argv[0];
-	while ((opt = getopt(argc, argv, "FMdfi:")) != -1) {
+	while ((opt = getopt(argc, argv, "FMSdfi:t:a:c:")) != -1) {
 		switch (opt) {
 		case 'F':
 			pmem_fit_mode();
@@ -73,10 +273,27 @@ main(int argc, char *argv[])
 			pmem_msync_mode();
 			break;
 
+		case 'S':
+			sflag++;
+			pmem_stats_enable(1);
+			break;
+
 		case 'd':
 			Debug++;
 			break;
 
+		case 't':
+			nthreads = atoi(optarg);
+			break;
+
+		case 'a':
+			narenas = atoi(optarg);
+			break;
+
+		case 'c':
+			nclumps = atoi(optarg);
+			break;
+
 		default:
 			USAGE(NULL);
 		}
@@ -89,9 +306,25 @@ main(int argc, char *argv[])
 	if (optind < argc)
 		USAGE(NULL);
 
+	if (nthreads < 0 || nthreads > MAXTHREADS)
+		USAGE("threads must be 1 to %d", MAXTHREADS);
+
+	if (nthreads) {
+		pmemalloc_arenas(narenas);
+		pmemalloc_tcache(nclumps);
+	}
+
 	if ((pmp = pmemalloc_init(path, MY_POOL_SIZE)) == NULL)
 		FATALSYS("pmemalloc_init on %s", path);
 
+	if (nthreads) {
+		threaded(pmp, nthreads, narenas, nclumps);
+		if (sflag)
+			pmem_stats_dump(stdout);
+		DEBUG("Done.");
+		exit(0);
+	}
+
 	for (i = 0; i < NPTRS; i++) {
 		if ((ptrs[i] = pmemalloc_reserve(pmp, 10 + i)) == NULL)
 			FATALSYS("pmemalloc_reserve: iteration %d", i);
@@ -122,6 +355,9 @@ main(int argc, char *argv[])
 
 	pmemalloc_check(path);
 
+	if (sflag)
+		pmem_stats_dump(stdout);
+
 	DEBUG("Done.");
 	exit(0);
 }